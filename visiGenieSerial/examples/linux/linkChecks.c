@@ -0,0 +1,232 @@
+/**
+ * Checks corners of the link that are hard to reach with a real display. A scripted display answers commands from
+ * memory, and bytes can be put on the line ahead of its answers. Each check prints ok or FAILED and the exit status
+ * is the number that failed.
+ *
+ * Build from this directory with:
+ *   cc -O2 -pthread -I../.. linkChecks.c ../../visiGenieSerial.c ../../visiGenieSerialPosix.c \
+ *     ../../visiGenieSerialMt.c -o linkChecks
+ */
+
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include "visiGenieSerial.h"
+#include "visiGenieSerialMt.h"
+
+#define LINE_SIZE   1024
+
+static GenieContext display;
+static GenieHandlerEntry handlers[4];
+
+/* What the display sends, and the command it is putting together */
+static uint8_t line[LINE_SIZE];
+static uint16_t lineHead, lineTail;
+static uint8_t command[GENIE_FRAME_SIZE];
+static uint8_t commandLen;
+static uint16_t values[64][4];
+static bool silent;           /* commands go unanswered */
+static uint32_t writes;
+
+static void put(const uint8_t *bytes, uint16_t len) {
+
+  while (len--) line[lineTail++ % LINE_SIZE] = *bytes++;
+}
+
+static void putFrame(uint8_t cmd, uint8_t object, uint8_t index, uint16_t value) {
+
+  uint8_t frame[GENIE_FRAME_SIZE] = { cmd, object, index, (uint8_t)(value >> 8), (uint8_t)value, 0 };
+
+  frame[5] = frame[0] ^ frame[1] ^ frame[2] ^ frame[3] ^ frame[4];
+  put(frame, GENIE_FRAME_SIZE);
+}
+
+/* UserApiConfig handlers, the host end of the line */
+static bool availHandler(void) {
+
+  return lineHead != lineTail;
+}
+
+static uint8_t readHandler(void) {
+
+  return line[lineHead++ % LINE_SIZE];
+}
+
+static void writeHandler(uint32_t val) {
+
+  static const uint8_t ack = GENIE_ACK;
+
+  command[commandLen++] = (uint8_t)val;
+  if (command[0] == GENIE_READ_OBJ && commandLen == 4) {
+    if (!silent) putFrame(GENIE_REPORT_OBJ, command[1], command[2], values[command[1] & 63][command[2] & 3]);
+    commandLen = 0;
+  } else if (command[0] == GENIE_WRITE_OBJ && commandLen == 6) {
+    values[command[1] & 63][command[2] & 3] = (uint16_t)(command[3] << 8 | command[4]);
+    writes++;
+    if (!silent) put(&ack, 1);
+    commandLen = 0;
+  } else if (commandLen == GENIE_FRAME_SIZE) {
+    commandLen = 0;
+  }
+}
+
+static uint32_t millisHandler(void) {
+
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint32_t)(ts.tv_sec * 1000 + ts.tv_nsec / 1000000);
+}
+
+static UserApiConfig userConfig = {
+  .available = availHandler,
+  .read = readHandler,
+  .write = writeHandler,
+  .millis = millisHandler
+};
+
+static void reset(void) {
+
+  lineHead = lineTail = 0;
+  commandLen = 0;
+  silent = false;
+  writes = 0;
+  memset(values, 0, sizeof(values));
+  genieCtxInitWithConfig(&display, &userConfig);
+  genieCtxAttachDispatchTable(&display, handlers, 4);
+}
+
+static uint16_t sliderSeen;
+
+static void onSlider(GenieContext *ctx, GenieFrame *event, void *userData) {
+
+  sliderSeen = genieGetEventData(event);
+}
+
+/* A report nothing handles must not hold up an event that has a callback */
+static bool unhandledAhead(void) {
+
+  GenieFrame event;
+
+  reset();
+  sliderSeen = 0;
+  values[GENIE_OBJ_LED_DIGITS][0] = 42;
+  genieCtxOn(&display, GENIE_REPORT_EVENT, GENIE_OBJ_SLIDER, 0, onSlider, NULL);
+  genieCtxReadObject(&display, GENIE_OBJ_LED_DIGITS, 0);
+  putFrame(GENIE_REPORT_EVENT, GENIE_OBJ_SLIDER, 0, 7);
+  genieCtxDoEventsBudget(&display, true, 0, 0);
+
+  return sliderSeen == 7 && genieCtxDequeueEvent(&display, &event) &&
+         event.reportObject.cmd == GENIE_REPORT_OBJ && genieGetEventData(&event) == 42 &&
+         !genieCtxDequeueEvent(&display, &event);
+}
+
+/* A value sent as an event answers a sync read of an object never written, with no shadow table */
+static bool readCacheHit(void) {
+
+  uint16_t value = 0;
+  GenieFrame event;
+
+  reset();
+  genieCtxSetReadMaxAge(&display, 1000);
+  putFrame(GENIE_REPORT_EVENT, GENIE_OBJ_SLIDER, 1, 9);
+  genieCtxDoEventsBudget(&display, false, 0, 0);
+  while (genieCtxDequeueEvent(&display, &event)) {
+  }
+
+  /* Nothing would answer a read that went out */
+  silent = true;
+  return genieCtxReadObjectSync(&display, GENIE_OBJ_SLIDER, 1, &value, 100) == ERROR_NONE && value == 9;
+}
+
+/* A frame that fails its checksum, with one byte of the body changed */
+static void putDamaged(uint8_t cmd, uint8_t object, uint8_t index, uint16_t value) {
+
+  uint8_t frame[GENIE_FRAME_SIZE] = { cmd, object, index, (uint8_t)(value >> 8), (uint8_t)value, 0 };
+
+  frame[5] = frame[0] ^ frame[1] ^ frame[2] ^ frame[3] ^ frame[4] ^ 0x80;
+  put(frame, GENIE_FRAME_SIZE);
+}
+
+/* An ACK inside a damaged frame is not the answer to the write waiting for one */
+static bool replayedAck(void) {
+
+  static const uint8_t ack = GENIE_ACK;
+  GenieStats stats;
+
+  reset();
+  silent = true;
+  genieCtxWriteObject(&display, GENIE_OBJ_LED_DIGITS, 0, 5);
+  putDamaged(GENIE_REPORT_EVENT, GENIE_OBJ_SLIDER, 0, GENIE_ACK << 8);
+  genieCtxDoEventsBudget(&display, false, 0, 0);
+  genieCtxGetStats(&display, &stats, false);
+  if (stats.acks != 0) return false;
+
+  put(&ack, 1);
+  genieCtxDoEventsBudget(&display, false, 0, 0);
+  genieCtxGetStats(&display, &stats, false);
+  return stats.acks == 1;
+}
+
+/* A magic report header inside a damaged frame must not swallow the event after it */
+static bool replayedMagic(void) {
+
+  reset();
+  sliderSeen = 0;
+  genieCtxOn(&display, GENIE_REPORT_EVENT, GENIE_OBJ_SLIDER, 0, onSlider, NULL);
+  putDamaged(GENIE_REPORT_EVENT, GENIE_OBJ_SLIDER, 0, GENIEM_REPORT_BYTES << 8 | 1);
+  putFrame(GENIE_REPORT_EVENT, GENIE_OBJ_SLIDER, 0, 3);
+  genieCtxDoEventsBudget(&display, true, 0, 0);
+
+  return sliderSeen == 3;
+}
+
+static GenieMt mt;
+static volatile bool serving;
+
+static void *ioThread(void *arg) {
+
+  while (serving) genieMtService(&mt);
+  return arg;
+}
+
+/* A producer waiting on text the library will not send hears so, rather than wait forever */
+static bool mtRefused(void) {
+
+  pthread_t io;
+  int result;
+
+  reset();
+  genieMtInit(&mt, &userConfig);
+  serving = true;
+  pthread_create(&io, NULL, ioThread, NULL);
+  result = genieMtWriteStrUtf8(&mt, 0, "\xc0\xaf", 2, true);
+  serving = false;
+  pthread_join(io, NULL);
+
+  return result == ERROR_MT_REFUSED && commandLen == 0;
+}
+
+static const struct {
+  const char *name;
+  bool (*check)(void);
+} checks[] = {
+  { "unhandled report ahead of a handled event", unhandledAhead },
+  { "read cache hit on an object never written", readCacheHit },
+  { "ACK in a damaged frame left for the real one", replayedAck },
+  { "magic header in a damaged frame passed over", replayedMagic },
+  { "text that is not UTF-8 refused to a waiting writer", mtRefused },
+};
+
+int main(void) {
+
+  unsigned int i, failed = 0;
+
+  for (i = 0; i < sizeof(checks) / sizeof(checks[0]); i++) {
+    bool ok = checks[i].check();
+    printf("%-50s %s\n", checks[i].name, ok ? "ok" : "FAILED");
+    if (!ok) failed++;
+  }
+
+  return failed;
+}
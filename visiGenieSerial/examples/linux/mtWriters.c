@@ -0,0 +1,129 @@
+/**
+ * Several threads update one display at once through visiGenieSerialMt. One animates the gauge, one counts on the LED
+ * digits and one writes the time to the strings object and waits for each write to be answered, while the main thread
+ * reads the slider back once a second. The I/O thread started by geniePosixIoStart is the only one to touch the port.
+ *
+ * Build from this directory with:
+ *   cc -O2 -pthread -I../.. mtWriters.c ../../visiGenieSerial.c ../../visiGenieSerialPosix.c \
+ *     ../../visiGenieSerialMt.c -o mtWriters
+ * and run with:
+ *   ./mtWriters /dev/ttyUSB0
+ */
+
+#include <pthread.h>
+#include <stdio.h>
+#include <time.h>
+#include <unistd.h>
+#include "visiGenieSerialMt.h"
+#include "../ti/demoProject.h"
+
+static GenieMt mt;
+static GeniePosixIo io;
+
+/* ERROR_MT_FULL means the I/O thread is behind, so give it a moment */
+static void writeObject(uint16_t object, uint16_t index, uint16_t value) {
+
+  while (genieMtWriteObject(&mt, object, index, value, false) == ERROR_MT_FULL) {
+    usleep(1000);
+  }
+}
+
+static void *gaugeThread(void *arg) {
+
+  int gaugeVal = 0, gaugeAddVal = 1;
+
+  for (;;) {
+    writeObject(GENIE_COOLGAUGE0, gaugeVal);
+    gaugeVal += gaugeAddVal;
+    if (gaugeVal == GENIE_COOLGAUGE0_MAX) gaugeAddVal = -1;
+    if (gaugeVal == 0) gaugeAddVal = 1;
+    usleep(20000);
+  }
+
+  return arg;
+}
+
+static void *digitsThread(void *arg) {
+
+  uint16_t count = 0;
+
+  for (;;) {
+    writeObject(GENIE_LEDDIGITS0, count);
+    count = (count + 1) % (GENIE_LEDDIGITS0_MAX + 1);
+    usleep(100000);
+  }
+
+  return arg;
+}
+
+static void *clockThread(void *arg) {
+
+  char text[16];
+  time_t now;
+  int result;
+
+  for (;;) {
+    now = time(NULL);
+    strftime(text, sizeof(text), "%H:%M:%S", localtime(&now));
+
+    /* Returns once the display has answered */
+    result = genieMtWriteStr(&mt, GENIE_STRINGS0_INDEX, text, true);
+
+    if (result != ERROR_NONE) {
+      fprintf(stderr, "WriteStr: %d\n", result);
+    }
+
+    sleep(1);
+  }
+
+  return arg;
+}
+
+/* Runs on the I/O thread, like every handler */
+static void onSlider0(GenieContext *ctx, GenieFrame *event, void *userData) {
+
+  printf("slider moved to %u\n", genieGetEventData(event));
+}
+
+int main(int argc, char **argv) {
+
+  static UserApiConfig config;
+  GeniePosixPort port;
+  pthread_t threads[3];
+  uint16_t value;
+
+  if (argc != 2) {
+    fprintf(stderr, "usage: %s /dev/ttyXXX\n", argv[0]);
+    return 2;
+  }
+
+  if (geniePosixOpen(&port, argv[1], GENIE_PROJECT_SPEED) < 0) {
+    perror(argv[1]);
+    return 1;
+  }
+
+  /* The context is set up before any other thread uses it */
+  geniePosixConfig(&port, &config);
+  genieMtInit(&mt, &config);
+  genieCtxSetWindow(genieMtContext(&mt), GENIE_PROJECT_SNDBUF);
+  genieCtxAttachShadow(genieMtContext(&mt), genieProjectShadow, GENIE_PROJECT_SHADOW);
+  genieCtxAttachDispatchTable(genieMtContext(&mt), genieProjectHandlers, GENIE_PROJECT_HANDLERS);
+  genieCtxOn(genieMtContext(&mt), GENIE_REPORT_EVENT, GENIE_SLIDER0, onSlider0, NULL);
+
+  if (geniePosixIoStart(&io, &mt, &port) < 0) {
+    perror("geniePosixIoStart");
+    return 1;
+  }
+
+  pthread_create(&threads[0], NULL, gaugeThread, NULL);
+  pthread_create(&threads[1], NULL, digitsThread, NULL);
+  pthread_create(&threads[2], NULL, clockThread, NULL);
+
+  for (;;) {
+    sleep(1);
+
+    if (genieMtReadObject(&mt, GENIE_SLIDER0, &value) == ERROR_NONE) {
+      printf("slider is at %u\n", value);
+    }
+  }
+}
@@ -0,0 +1,90 @@
+/**
+ * Runs the gauge demo from a Linux box, with the library inside an epoll loop rather than a busy loop. The display's
+ * port is watched for input next to a timerfd that drives the animation.
+ *
+ * Build from this directory with:
+ *   cc -O2 -I../.. posixGateway.c ../../visiGenieSerial.c ../../visiGenieSerialPosix.c -o posixGateway
+ * and run with:
+ *   ./posixGateway /dev/ttyUSB0
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <unistd.h>
+#include "visiGenieSerialPosix.h"
+#include "../ti/demoProject.h"
+
+#define FRAME_MS    50
+
+static GenieContext display;
+
+/* Written every frame, so their headers are built once */
+static const GenieObjectHandle gauge = GENIE_HANDLE(GENIE_COOLGAUGE0);
+static const GenieObjectHandle digits = GENIE_HANDLE(GENIE_LEDDIGITS0);
+
+static void onSlider0(GenieContext *ctx, GenieFrame *event, void *userData) {
+
+  genieCtxWriteObject(ctx, GENIE_LEDDIGITS0, genieGetEventData(event));
+}
+
+int main(int argc, char **argv) {
+
+  struct itimerspec period = { { 0, FRAME_MS * 1000000L }, { 0, FRAME_MS * 1000000L } };
+  struct epoll_event ev, ready[2];
+  static UserApiConfig config;
+  GeniePosixPort port;
+  int gaugeVal = 0, gaugeAddVal = 1, epfd, tfd, n, i;
+  uint64_t ticks;
+
+  if (argc != 2) {
+    fprintf(stderr, "usage: %s /dev/ttyXXX\n", argv[0]);
+    return 2;
+  }
+
+  if (geniePosixOpen(&port, argv[1], GENIE_PROJECT_SPEED) < 0) {
+    perror(argv[1]);
+    return 1;
+  }
+
+  geniePosixConfig(&port, &config);
+  genieCtxInitWithConfig(&display, &config);
+  genieCtxSetWindow(&display, GENIE_PROJECT_SNDBUF);
+  genieCtxAttachShadow(&display, genieProjectShadow, GENIE_PROJECT_SHADOW);
+  genieCtxAttachDispatchTable(&display, genieProjectHandlers, GENIE_PROJECT_HANDLERS);
+  genieCtxOn(&display, GENIE_REPORT_EVENT, GENIE_SLIDER0, onSlider0, NULL);
+
+  epfd = epoll_create1(0);
+  tfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
+  timerfd_settime(tfd, 0, &period, NULL);
+
+  ev.events = EPOLLIN;
+  ev.data.fd = geniePosixFd(&port);
+  epoll_ctl(epfd, EPOLL_CTL_ADD, ev.data.fd, &ev);
+  ev.data.fd = tfd;
+  epoll_ctl(epfd, EPOLL_CTL_ADD, tfd, &ev);
+
+  for (;;) {
+    n = epoll_wait(epfd, ready, 2, -1);
+
+    for (i = 0; i < n; i++) {
+      if (ready[i].data.fd == tfd) {
+        if (read(tfd, &ticks, sizeof(ticks)) < 0) {
+          continue;
+        }
+
+        genieCtxBeginBurst(&display);
+        genieCtxWriteHandle(&display, &gauge, gaugeVal);
+        genieCtxWriteHandle(&display, &digits, gaugeVal);
+        genieCtxFlush(&display);
+        gaugeVal += gaugeAddVal;
+        if (gaugeVal == GENIE_LEDDIGITS0_MAX) gaugeAddVal = -1;
+        if (gaugeVal == 0) gaugeAddVal = 1;
+      } else {
+        /* Bytes are waiting, run them through the state machine */
+        geniePosixService(&display, true);
+      }
+    }
+  }
+}
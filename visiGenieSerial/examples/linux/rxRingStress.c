@@ -0,0 +1,103 @@
+/**
+ * Checks the interrupt fed receive ring on Linux. A producer thread stands in for the UART ISR and pushes event
+ * frames with genieRxIsrPushBytes while the main thread parses them, then the two sides are compared.
+ *
+ * Build from this directory with:
+ *   cc -O2 -pthread -I../.. rxRingStress.c ../../visiGenieSerial.c -o rxRingStress
+ */
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include "visiGenieSerial.h"
+
+#define FRAMES          1000000
+#define CHUNK_MAX       7
+
+static GenieContext display;
+
+/* UserApiConfig handlers. Nothing is read through them, the ring is used instead */
+static bool availHandler(void) {
+
+  return false;
+}
+
+static uint8_t readHandler(void) {
+
+  return 0;
+}
+
+static void writeHandler(uint32_t val) {
+
+  (void)val;
+}
+
+static uint32_t millisHandler(void) {
+
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint32_t)(ts.tv_sec * 1000 + ts.tv_nsec / 1000000);
+}
+
+/* Plays the ISR: frames go in as odd sized pieces so they straddle the ring's wrap point. A real ISR would lose
+   whatever does not fit, this one retries so the check can expect every frame; the ring counts the refusals. */
+static void *producer(void *arg) {
+
+  uint8_t frame[GENIE_FRAME_SIZE];
+  uint32_t seq, sent;
+  uint16_t n, len;
+  unsigned int seed = 1;
+
+  (void)arg;
+  for (seq = 0; seq < FRAMES; seq++) {
+    frame[0] = GENIE_REPORT_EVENT;
+    frame[1] = GENIE_OBJ_SLIDER;
+    frame[2] = (uint8_t)seq;
+    frame[3] = (uint8_t)(seq >> 8);
+    frame[4] = (uint8_t)seq;
+    frame[5] = frame[0] ^ frame[1] ^ frame[2] ^ frame[3] ^ frame[4];
+    for (sent = 0; sent < GENIE_FRAME_SIZE; sent += n) {
+      len = 1 + rand_r(&seed) % CHUNK_MAX;
+      if (len > GENIE_FRAME_SIZE - sent) len = GENIE_FRAME_SIZE - sent;
+      n = genieRxIsrPushBytes(&display, &frame[sent], len);
+      if (n == 0) sched_yield();
+    }
+  }
+  return NULL;
+}
+
+int main(void) {
+
+  static UserApiConfig userConfig = {
+    .available = availHandler,
+    .read = readHandler,
+    .write = writeHandler,
+    .millis = millisHandler
+  };
+  pthread_t thread;
+  GenieFrame event;
+  uint32_t received = 0, errors = 0, overflows;
+  uint16_t expected;
+
+  genieCtxInitWithConfig(&display, &userConfig);
+  genieCtxUseRxRing(&display, true);
+  pthread_create(&thread, NULL, producer, NULL);
+
+  while (received < FRAMES) {
+    /* Parse no more than the event queue can hold, then empty it */
+    if (genieCtxDoEventsBudget(&display, false, GENIE_FRAME_SIZE * 8, 0) == 0) sched_yield();
+    while (genieCtxDequeueEvent(&display, &event)) {
+      expected = (uint16_t)received;
+      if (event.reportObject.index != (uint8_t)received || genieGetEventData(&event) != expected) errors++;
+      received++;
+    }
+  }
+
+  pthread_join(thread, NULL);
+  printf("frames %u, errors %u, ring high water %u of %u, refused bytes ",
+         received, errors, genieCtxGetRxRingStats(&display, &overflows), GENIE_RX_RING_SIZE);
+  printf("%u\n", overflows);
+  return errors != 0;
+}
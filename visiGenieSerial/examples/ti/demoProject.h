@@ -0,0 +1,93 @@
+/////////////////////// demoProject.h ///////////////////////
+//
+//      Generated by genieGen from genieArduino-WS4-Demo.4DGenie, do not edit.
+//      Include it in one source file only.
+//
+
+#ifndef DEMOPROJECT_H
+#define DEMOPROJECT_H
+
+#include "visiGenieSerial.h"
+
+#define GENIE_PROJECT_PLATFORM  "uLCD-32PTU-LR"
+#define GENIE_PROJECT_SPEED     200000
+#define GENIE_PROJECT_SNDBUF    2    // for genieCtxSetWindow
+#define GENIE_PROJECT_MULTIDROP 0
+#define GENIE_PROJECT_ADDRESS   1    // for genieBusAdd
+#define GENIE_PROJECT_FORMS     1
+#define GENIE_PROJECT_OBJECTS   7
+#define GENIE_PROJECT_SHADOW    3    // objects set with WriteObject
+#define GENIE_PROJECT_HANDLERS  1    // objects that report events
+
+// Form0, Form on form 0
+#define GENIE_FORM0_OBJECT               GENIE_OBJ_FORM
+#define GENIE_FORM0_INDEX                0
+#define GENIE_FORM0_FORM                 0
+#define GENIE_FORM0_MIN                  0
+#define GENIE_FORM0_MAX                  65535
+#define GENIE_FORM0                      GENIE_FORM0_OBJECT, GENIE_FORM0_INDEX
+
+// Leddigits0, LedDigits on form 0
+#define GENIE_LEDDIGITS0_OBJECT          GENIE_OBJ_LED_DIGITS
+#define GENIE_LEDDIGITS0_INDEX           0
+#define GENIE_LEDDIGITS0_FORM            0
+#define GENIE_LEDDIGITS0_MIN             0
+#define GENIE_LEDDIGITS0_MAX             99
+#define GENIE_LEDDIGITS0                 GENIE_LEDDIGITS0_OBJECT, GENIE_LEDDIGITS0_INDEX
+
+// Coolgauge0, Coolgauge on form 0
+#define GENIE_COOLGAUGE0_OBJECT          GENIE_OBJ_COOL_GAUGE
+#define GENIE_COOLGAUGE0_INDEX           0
+#define GENIE_COOLGAUGE0_FORM            0
+#define GENIE_COOLGAUGE0_MIN             0
+#define GENIE_COOLGAUGE0_MAX             100
+#define GENIE_COOLGAUGE0                 GENIE_COOLGAUGE0_OBJECT, GENIE_COOLGAUGE0_INDEX
+
+// Slider0, GSlider on form 0
+#define GENIE_SLIDER0_OBJECT             GENIE_OBJ_SLIDER
+#define GENIE_SLIDER0_INDEX              0
+#define GENIE_SLIDER0_FORM               0
+#define GENIE_SLIDER0_MIN                0
+#define GENIE_SLIDER0_MAX                99
+#define GENIE_SLIDER0                    GENIE_SLIDER0_OBJECT, GENIE_SLIDER0_INDEX
+
+// Strings0, Strings on form 0
+#define GENIE_STRINGS0_OBJECT            GENIE_OBJ_STRINGS
+#define GENIE_STRINGS0_INDEX             0
+#define GENIE_STRINGS0_FORM              0
+#define GENIE_STRINGS0_MIN               0
+#define GENIE_STRINGS0_MAX               65535
+#define GENIE_STRINGS0                   GENIE_STRINGS0_OBJECT, GENIE_STRINGS0_INDEX
+
+// Userled0, UserLed on form 0
+#define GENIE_USERLED0_OBJECT            GENIE_OBJ_USER_LED
+#define GENIE_USERLED0_INDEX             0
+#define GENIE_USERLED0_FORM              0
+#define GENIE_USERLED0_MIN               0
+#define GENIE_USERLED0_MAX               65535
+#define GENIE_USERLED0                   GENIE_USERLED0_OBJECT, GENIE_USERLED0_INDEX
+
+// Statictext0, StaticText on form 0
+#define GENIE_STATICTEXT0_OBJECT         GENIE_OBJ_STATIC_TEXT
+#define GENIE_STATICTEXT0_INDEX          0
+#define GENIE_STATICTEXT0_FORM           0
+#define GENIE_STATICTEXT0_MIN            0
+#define GENIE_STATICTEXT0_MAX            65535
+#define GENIE_STATICTEXT0                GENIE_STATICTEXT0_OBJECT, GENIE_STATICTEXT0_INDEX
+
+// Sorted by object then index, see genieFindObject
+static const GenieObjectInfo genieProjectObjects[GENIE_PROJECT_OBJECTS] = {
+    { GENIE_OBJ_SLIDER,          0,   0,     0,    99 },
+    { GENIE_OBJ_COOL_GAUGE,      0,   0,     0,   100 },
+    { GENIE_OBJ_FORM,            0,   0,     0, 65535 },
+    { GENIE_OBJ_LED_DIGITS,      0,   0,     0,    99 },
+    { GENIE_OBJ_STRINGS,         0,   0,     0, 65535 },
+    { GENIE_OBJ_USER_LED,        0,   0,     0, 65535 },
+    { GENIE_OBJ_STATIC_TEXT,     0,   0,     0, 65535 },
+};
+
+// For genieCtxAttachShadow and genieCtxAttachDispatchTable
+static GenieShadowEntry  genieProjectShadow[GENIE_PROJECT_SHADOW > 0 ? GENIE_PROJECT_SHADOW : 1];
+static GenieHandlerEntry genieProjectHandlers[GENIE_PROJECT_HANDLERS > 0 ? GENIE_PROJECT_HANDLERS : 1];
+
+#endif
@@ -6,6 +6,7 @@
 #include <stdbool.h>
 #include "inc/hw_ints.h"
 #include "inc/hw_memmap.h"
+#include "inc/hw_types.h"
 #include "driverlib/debug.h"
 #include "driverlib/gpio.h"
 #include "driverlib/interrupt.h"
@@ -16,6 +17,8 @@
 #include "driverlib/uart.h"
 #include "driverlib/hibernate.h"
 #include "visiGenieSerial.h"
+/* Object names and ranges, generated with tools/genieGen from visi-gui/genieArduino-WS4-Demo.4DGenie */
+#include "demoProject.h"
 
 #define EXT_CRYSTAL    0
 #define CLK_CFG        (SYSCTL_XTAL_25MHZ | SYSCTL_OSC_MAIN | SYSCTL_USE_PLL | SYSCTL_CFG_VCO_480)
@@ -27,7 +30,14 @@
 #define UART_CFG       (UART_CONFIG_WLEN_8 | UART_CONFIG_PAR_NONE | UART_CONFIG_STOP_ONE)
 #define UART_BAUD      115200
 #define UART_PIN_CFG   GPIO_PIN_4 | GPIO_PIN_5
-#define MILLI_PER_SEC  1000
+#define CYCLES_PER_US  (CLK_MHZ / 1000000)
+
+/* Cortex-M4 debug cycle counter, counts core clocks */
+#define DEMCR          0xE000EDFC
+#define DEMCR_TRCENA   0x01000000
+#define DWT_CTRL       0xE0001000
+#define DWT_CYCCNTENA  0x00000001
+#define DWT_CYCCNT     0xE0001004
 
 /* Keep clock global */
 uint32_t g_ui32SysClock;
@@ -35,6 +45,7 @@ uint32_t g_ui32SysClock;
 /* init */
 static void initUart(void);
 static void initRtc(void);
+static void initCycleCounter(void);
 static void initGpio(void);
 static void initDisplayAnimationLoop(void);
 
@@ -43,16 +54,20 @@ static bool uartAvailHandler(void);
 static uint8_t uartReadHandler(void);
 static void uartWriteHandler(uint32_t val);
 static uint32_t uartGetMillis(void);
+static uint32_t uartGetMicros(void);
+static uint64_t elapsedCycles(void);
 static void resetDisplay(void);
 
 /* Event handlers */
-static void myGenieEventHandler(void);
+static void onSlider0(GenieContext *ctx, GenieFrame *event, void *userData);
+static void onUserLed0(GenieContext *ctx, GenieFrame *event, void *userData);
 static void HibernateHandler(void);
 
 int main(void) {
 
   initGpio();
   initRtc();
+  initCycleCounter();
   initUart();
   initDisplayAnimationLoop();
 }
@@ -64,11 +79,16 @@ static void initDisplayAnimationLoop(void) {
     .available = uartAvailHandler,
     .read =  uartReadHandler,
     .write = uartWriteHandler,
-    .millis = uartGetMillis
+    .millis = uartGetMillis,
+    /* Reply timeouts follow the display's measured round trip time */
+    .micros = uartGetMicros
   };
 
   genieInitWithConfig(&userConfig);
-  genieAttachEventHandler(myGenieEventHandler);
+  /* Keep as many commands in flight as the project's SndBuf allows */
+  genieCtxSetWindow(genieDefaultContext(), GENIE_PROJECT_SNDBUF);
+  genieOn(GENIE_REPORT_EVENT, GENIE_SLIDER0, onSlider0, NULL);
+  genieOn(GENIE_REPORT_OBJ, GENIE_USERLED0, onUserLed0, NULL);
   resetDisplay();
   genieWriteContrast(15); 
   genieWriteStr(0, GENIE_VERSION);
@@ -77,11 +97,12 @@ static void initDisplayAnimationLoop(void) {
   for(;;) {
       waitPeriod = uartGetMillis();
       ROM_SysCtlDelay((g_ui32SysClock / 18) * 1);
-      genieDoEvents(true);
-      genieWriteObject(GENIE_OBJ_COOL_GAUGE, 0, gaugeVal);
-      genieWriteObject(GENIE_OBJ_LED_DIGITS, 0, gaugeVal);
+      /* Drain everything received since the last pass, not just one byte */
+      genieCtxDoEventsBudget(genieDefaultContext(), true, 64, 0);
+      genieWriteObject(GENIE_COOLGAUGE0, gaugeVal);
+      genieWriteObject(GENIE_LEDDIGITS0, gaugeVal);
       gaugeVal += gaugeAddVal;
-      if (gaugeVal == 99) gaugeAddVal = -1;
+      if (gaugeVal == GENIE_LEDDIGITS0_MAX) gaugeAddVal = -1;
       if (gaugeVal == 0) gaugeAddVal = 1;
   }
 }
@@ -108,6 +129,13 @@ static void initRtc(void) {
   HibernateCounterMode(HIBERNATE_COUNTER_RTC);
 }
 
+static void initCycleCounter(void) {
+
+  HWREG(DEMCR) |= DEMCR_TRCENA;
+  HWREG(DWT_CYCCNT) = 0;
+  HWREG(DWT_CTRL) |= DWT_CYCCNTENA;
+}
+
 static void initUart(void) {
   
   ROM_SysCtlPeripheralEnable(SYSCTL_PERIPH_UART3);
@@ -133,29 +161,16 @@ static void resetDisplay(void) {
   ROM_SysCtlDelay((g_ui32SysClock / 3) * 5);
 }
 
-static void myGenieEventHandler(void) {
-  
-  GenieFrame Event;
-  genieDequeueEvent(&Event);
-  int32_t slider_val = 0;
-  
-  if (Event.reportObject.cmd == GENIE_REPORT_EVENT) {
-    if (Event.reportObject.object == GENIE_OBJ_SLIDER){
-      if (Event.reportObject.index == 0){
-        slider_val = genieGetEventData(&Event);
-        genieWriteObject(GENIE_OBJ_LED_DIGITS, 0, slider_val);
-      }
-    }
-  }
-  if (Event.reportObject.cmd == GENIE_REPORT_OBJ) {
-    if (Event.reportObject.object == GENIE_OBJ_USER_LED) {
-      if (Event.reportObject.index == 0) {
-        bool UserLed0_val = genieGetEventData(&Event);
-        UserLed0_val = !UserLed0_val;
-        genieWriteObject(GENIE_OBJ_USER_LED, 0, UserLed0_val);
-      }
-    }
-  }
+static void onSlider0(GenieContext *ctx, GenieFrame *event, void *userData) {
+
+  int32_t slider_val = genieGetEventData(event);
+  genieCtxWriteObject(ctx, GENIE_LEDDIGITS0, slider_val);
+}
+
+static void onUserLed0(GenieContext *ctx, GenieFrame *event, void *userData) {
+
+  bool UserLed0_val = genieGetEventData(event);
+  genieCtxWriteObject(ctx, GENIE_USERLED0, !UserLed0_val);
 }
 
 /* UserApiConfig Handlers */
@@ -176,5 +191,24 @@ static void uartWriteHandler(uint32_t val) {
 
 static uint32_t uartGetMillis(void) {
   
-  return ROM_HibernateRTCGet() * MILLI_PER_SEC;
+  /* The RTC only counts whole seconds, too coarse for reply timeouts */
+  return (uint32_t)(elapsedCycles() / (CYCLES_PER_US * 1000));
+}
+
+static uint32_t uartGetMicros(void) {
+
+  return (uint32_t)(elapsedCycles() / CYCLES_PER_US);
+}
+
+/* Extends the 32 bit cycle counter, which wraps every 35 s at 120 MHz. The library reads the time often enough while
+   it is talking to the display, and a wrap missed while idle only loses time, it doesn't go backwards. */
+static uint64_t elapsedCycles(void) {
+
+  static uint32_t last;
+  static uint64_t total;
+  uint32_t now = HWREG(DWT_CYCCNT);
+
+  total += now - last;
+  last = now;
+  return total;
 }
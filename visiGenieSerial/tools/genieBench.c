@@ -0,0 +1,320 @@
+/////////////////////// genieBench ///////////////////////
+//
+//      Measures the library against genieSim over a pty, through
+//      the public API: genieWriteObject, genieWriteStr,
+//      genieWriteMagicBytes, genieReadObject, genieReadObjectSync
+//      and bursts of display events.
+//
+//      For each run it reports commands a second, the latency from
+//      a call to its ACK or report (p50, p99, max and a power of two
+//      histogram), host CPU time a command, how much of what
+//      crossed the line was payload, and how busy each direction of
+//      the line was. The results are written as
+//      JSON so runs can be compared for regressions.
+//
+//      Usage:  genieBench [-b baud] [-n commands] [-d ackDelayUs]
+//                         [-o results.json]
+//
+/*********************************************************************
+ * This file is part of visiGenieSerial:
+ *    visiGenieSerial is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU Lesser General Public License as
+ *    published by the Free Software Foundation, either version 3 of the
+ *    License, or (at your option) any later version.
+ *
+ *    visiGenieSerial is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU Lesser General Public License for more details.
+ *
+ *    You should have received a copy of the GNU Lesser General Public
+ *    License along with visiGenieSerial.
+ *    If not, see <http://www.gnu.org/licenses/>.
+ *********************************************************************/
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <poll.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "genieSim.h"
+#include "visiGenieSerialPosix.h"
+
+#define HISTOGRAM_BUCKETS   32
+#define ID_SLOTS            1024    // more than any window, indexed by command id
+#define EVENT_MILLIS        1000
+#define STRING_LENGTH       20
+#define MAGIC_LENGTH        32
+
+typedef enum {
+    RUN_WRITE_OBJECT,
+    RUN_WRITE_STR,
+    RUN_WRITE_MAGIC,
+    RUN_READ_OBJECT,
+    RUN_READ_SYNC,
+    RUN_EVENTS
+} RunKind;
+
+typedef struct {
+    const char     *name;
+    RunKind         kind;
+    uint8_t         window;
+    uint32_t        payload;        // useful bytes a command carries
+} Run;
+
+static const Run runs[] = {
+    { "writeObject",        RUN_WRITE_OBJECT,   1,                  2 },
+    { "writeObject",        RUN_WRITE_OBJECT,   GENIE_MAX_PENDING,  2 },
+    { "writeStr",           RUN_WRITE_STR,      1,                  STRING_LENGTH },
+    { "writeStr",           RUN_WRITE_STR,      GENIE_MAX_PENDING,  STRING_LENGTH },
+    { "writeMagicBytes",    RUN_WRITE_MAGIC,    1,                  MAGIC_LENGTH },
+    { "writeMagicBytes",    RUN_WRITE_MAGIC,    GENIE_MAX_PENDING,  MAGIC_LENGTH },
+    { "readObject",         RUN_READ_OBJECT,    GENIE_MAX_PENDING,  2 },
+    { "readObjectSync",     RUN_READ_SYNC,      1,                  2 },
+    { "events",             RUN_EVENTS,         1,                  2 }
+};
+
+static GenieSim         sim;
+static volatile int     simStop;
+static uint64_t         issued[ID_SLOTS];
+static uint32_t        *latencies;
+static uint32_t         completed;
+static uint32_t         failures;
+
+static void *simThread(void *arg) {
+    (void)arg;
+
+    while (!simStop) {
+        genieSimStep(&sim, 10);
+    }
+
+    return NULL;
+}
+
+static uint64_t threadCpuMicros(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return (uint64_t)ts.tv_sec * 1000000u + (uint64_t)(ts.tv_nsec / 1000);
+}
+
+static void onCompletion(GenieContext *ctx, GeniePendingCommand *pc, int result) {
+    (void)ctx;
+
+    if (result != ERROR_NONE) {
+        failures++;
+        return;
+    }
+
+    latencies[completed++] = (uint32_t)(genieSimMicros() - issued[pc->id % ID_SLOTS]);
+}
+
+// the command just handed over was stamped before the call, which
+// may have waited for the window, so queueing counts as latency
+static void stamp(uint64_t before) {
+    issued[genieCtxLastCommandId(genieDefaultContext()) % ID_SLOTS] = before;
+}
+
+static int compareU32(const void *a, const void *b) {
+    uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+    return (x > y) - (x < y);
+}
+
+static void printRun(FILE *out, const Run *run, uint32_t ops, uint64_t elapsed, uint64_t cpu,
+                     uint32_t baud, bool first) {
+    uint32_t histogram[HISTOGRAM_BUCKETS] = { 0 };
+    uint32_t i, b, wire = sim.stats.rxBytes + sim.stats.txBytes;
+    uint64_t payload = (uint64_t)ops * run->payload;
+    double seconds = elapsed / 1e6;
+
+    qsort(latencies, completed, sizeof(uint32_t), compareU32);
+
+    for (i = 0; i < completed; i++) {
+        for (b = 0; b < HISTOGRAM_BUCKETS - 1 && (latencies[i] >> b) > 1; b++) {
+        }
+
+        histogram[b]++;
+    }
+
+    fprintf(out, "%s    {\"name\": \"%s\", \"window\": %u, \"ops\": %u, \"failures\": %u, \"seconds\": %.6f, "
+            "\"ops_per_sec\": %.1f,\n", first ? "" : ",\n", run->name, run->window, ops, failures, seconds,
+            seconds > 0 ? ops / seconds : 0.0);
+
+    if (completed > 0) {
+        fprintf(out, "     \"latency_us\": {\"p50\": %u, \"p99\": %u, \"max\": %u},\n",
+                latencies[completed / 2], latencies[(uint64_t)completed * 99 / 100], latencies[completed - 1]);
+    }
+
+    // bucket b holds latencies from 2^b up to 2^(b+1) microseconds
+    fprintf(out, "     \"histogram_log2_us\": [");
+
+    for (i = 0; i < HISTOGRAM_BUCKETS; i++) {
+        fprintf(out, "%s%u", i ? ", " : "", histogram[i]);
+    }
+
+    // the line is full duplex, each direction is busy on its own
+    fprintf(out, "],\n     \"host_cpu_us_per_op\": %.2f, \"wire_bytes\": %u, \"payload_bytes\": %llu, "
+            "\"efficiency\": %.3f, \"tx_utilisation\": %.3f, \"rx_utilisation\": %.3f, \"events_sent\": %u, "
+            "\"events_dropped\": %u}",
+            ops ? (double)cpu / ops : 0.0, wire, (unsigned long long)payload, wire ? (double)payload / wire : 0.0,
+            (baud && seconds > 0) ? sim.stats.rxBytes * 10.0 / baud / seconds : 0.0,
+            (baud && seconds > 0) ? sim.stats.txBytes * 10.0 / baud / seconds : 0.0, sim.stats.events, sim.stats.dropped);
+}
+
+static int bench(FILE *out, const Run *run, uint32_t baud, uint32_t count, uint32_t ackDelayUs, bool first) {
+    static UserApiConfig config;
+    GenieSimConfig simConfig = { 0 };
+    GeniePosixPort port;
+    pthread_t thread;
+    char slave[128], text[STRING_LENGTH + 1];
+    uint8_t magic[MAGIC_LENGTH];
+    uint64_t start, cpu, before;
+    uint32_t i, ops = 0;
+    uint16_t value;
+
+    simConfig.ackDelayUs = ackDelayUs;
+    simConfig.baud = baud;
+
+    if (run->kind == RUN_EVENTS) {
+        // as many as the line can carry
+        simConfig.eventRate = baud ? baud / 10 / GENIE_FRAME_SIZE : 200000;
+        simConfig.eventObject = GENIE_OBJ_SLIDER;
+    }
+
+    if (genieSimOpenPty(&sim, &simConfig, slave, sizeof(slave)) < 0 ||
+            geniePosixOpen(&port, slave, baud ? baud : 115200) < 0) {
+        perror("pty");
+        return -1;
+    }
+
+    geniePosixConfig(&port, &config);
+    genieInitWithConfig(&config);
+    genieCtxSetWindow(genieDefaultContext(), run->window);
+    genieCtxAttachCompletionHandler(genieDefaultContext(), (run->kind == RUN_READ_SYNC) ? NULL : onCompletion);
+    completed = 0;
+    failures = 0;
+    memset(text, 'x', STRING_LENGTH);
+    text[STRING_LENGTH] = 0;
+    memset(magic, 0x5A, sizeof(magic));
+
+    simStop = 0;
+    pthread_create(&thread, NULL, simThread, NULL);
+    start = genieSimMicros();
+    cpu = threadCpuMicros();
+
+    if (run->kind == RUN_EVENTS) {
+        // the way a host in an event loop would take them in
+        while (genieSimMicros() - start < EVENT_MILLIS * 1000u) {
+            struct pollfd pfd = { geniePosixFd(&port), POLLIN, 0 };
+
+            if (poll(&pfd, 1, 10) > 0) {
+                ops += geniePosixService(genieDefaultContext(), true);
+            }
+        }
+    } else {
+        for (i = 0; i < count; i++) {
+            before = genieSimMicros();
+
+            switch (run->kind) {
+                case RUN_WRITE_OBJECT:
+                    genieWriteObject(GENIE_OBJ_LED_DIGITS, i & 7, (uint16_t)i);
+                    break;
+
+                case RUN_WRITE_STR:
+                    text[0] = (char)('a' + i % 26);
+                    genieWriteStr(0, text);
+                    break;
+
+                case RUN_WRITE_MAGIC:
+                    magic[0] = (uint8_t)i;
+                    genieWriteMagicBytes(0, magic, MAGIC_LENGTH);
+                    break;
+
+                case RUN_READ_OBJECT:
+                    genieReadObject(GENIE_OBJ_LED_DIGITS, i & 7);
+                    break;
+
+                case RUN_READ_SYNC:
+                    // timed here, the call returns with the value
+                    if (genieReadObjectSync(GENIE_OBJ_LED_DIGITS, i & 7, &value, 1000) == ERROR_NONE) {
+                        latencies[completed++] = (uint32_t)(genieSimMicros() - before);
+                    } else {
+                        failures++;
+                    }
+                    break;
+
+                default:
+                    break;
+            }
+
+            if (run->kind != RUN_READ_SYNC) {
+                stamp(before);
+            }
+
+            // the reports of pipelined reads are queued as events
+            while (genieDequeueEvent(&(GenieFrame){ 0 })) {
+            }
+        }
+
+        genieCtxWaitIdle(genieDefaultContext());
+        ops = count;
+    }
+
+    cpu = threadCpuMicros() - cpu;
+    printRun(out, run, ops, genieSimMicros() - start, cpu, baud, first);
+
+    simStop = 1;
+    pthread_join(thread, NULL);
+    geniePosixClose(&port);
+    close(sim.fd);
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    uint32_t baud = 200000, count = 2000, ackDelayUs = 100;
+    FILE *out = stdout;
+    size_t i;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "b:n:d:o:")) != -1) {
+        switch (opt) {
+            case 'b': baud = (uint32_t)strtoul(optarg, NULL, 0); break;
+            case 'n': count = (uint32_t)strtoul(optarg, NULL, 0); break;
+            case 'd': ackDelayUs = (uint32_t)strtoul(optarg, NULL, 0); break;
+            case 'o':
+                if ((out = fopen(optarg, "w")) == NULL) {
+                    perror(optarg);
+                    return 1;
+                }
+                break;
+            default:
+                fprintf(stderr, "usage: %s [-b baud] [-n commands] [-d ackDelayUs] [-o results.json]\n", argv[0]);
+                return 2;
+        }
+    }
+
+    // room for every event a run could see as well as every command
+    latencies = malloc(sizeof(uint32_t) * (count + 1000000u));
+
+    if (latencies == NULL) {
+        return 1;
+    }
+
+    fprintf(out, "{\"baud\": %u, \"commands\": %u, \"ack_delay_us\": %u, \"max_pending\": %u,\n \"results\": [\n",
+            baud, count, ackDelayUs, GENIE_MAX_PENDING);
+
+    for (i = 0; i < sizeof(runs) / sizeof(runs[0]); i++) {
+        if (bench(out, &runs[i], baud, count, ackDelayUs, i == 0) < 0) {
+            return 1;
+        }
+    }
+
+    fprintf(out, "\n ]}\n");
+    return (out != stdout && fclose(out) != 0) ? 1 : 0;
+}
@@ -0,0 +1,482 @@
+/////////////////////// genieGen ///////////////////////
+//
+//      Writes a C header describing a Workshop4 ViSi-Genie project
+//      from its .4DGenie file, so the host code can name objects
+//      rather than hard-code type and index numbers, and size its
+//      tables for the screens it actually drives.
+//
+//      Usage:  genieGen project.4DGenie [header.h]
+//
+//      The header holds, for every object:
+//        GENIE_<NAME>          object, index pair for genieWriteObject
+//        GENIE_<NAME>_OBJECT   GENIE_OBJ_* type
+//        GENIE_<NAME>_INDEX    index within its type
+//        GENIE_<NAME>_FORM     index of the form it is on
+//        GENIE_<NAME>_MIN/MAX  value range
+//      plus genieProjectObjects[], sorted for genieFindObject, and
+//      a shadow table and dispatch table of exactly the right size.
+//
+//      Build with:
+//        cc -O2 -o genieGen genieGen.c
+//
+/*********************************************************************
+ * This file is part of visiGenieSerial:
+ *    visiGenieSerial is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU Lesser General Public License as
+ *    published by the Free Software Foundation, either version 3 of the
+ *    License, or (at your option) any later version.
+ *
+ *    visiGenieSerial is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU Lesser General Public License for more details.
+ *
+ *    You should have received a copy of the GNU Lesser General Public
+ *    License along with visiGenieSerial.
+ *    If not, see <http://www.gnu.org/licenses/>.
+ *********************************************************************/
+
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#define MAX_OBJECTS     512
+#define MAX_NAME        64
+#define MAX_LINE        512
+#define OBJ_TYPES       34
+
+typedef struct {
+    char        name[MAX_NAME];
+    int         type;           // GENIE_OBJ_* value
+    int         index;
+    int         form;
+    long        min;
+    long        max;
+    int         reports;        // sends events to the host
+    int         line;
+} Object;
+
+// Workshop4 class names, in GENIE_OBJ_* order
+static const char *workshopClass[OBJ_TYPES] = {
+    "Dipswitch",    "Knob",         "Rockerswitch", "Rotaryswitch",
+    "GSlider",      "Trackbar",     "Winbutton",    "Angularmeter",
+    "Coolgauge",    "Customdigits", "Form",         "Gauge",
+    "Image",        "Keyboard",     "Led",          "LedDigits",
+    "Meter",        "Strings",      "Thermometer",  "UserLed",
+    "Video",        "StaticText",   "Sound",        "Timer",
+    "Spectrum",     "Scope",        "Tank",         "UserImages",
+    "PinOutput",    "PinInput",     "4Dbutton",     "AniButton",
+    "ColorPicker",  "UserButton"
+};
+
+// matching names from visiGenieSerial.h
+static const char *genieObject[OBJ_TYPES] = {
+    "GENIE_OBJ_DIPSW",          "GENIE_OBJ_KNOB",           "GENIE_OBJ_ROCKERSW",
+    "GENIE_OBJ_ROTARYSW",       "GENIE_OBJ_SLIDER",         "GENIE_OBJ_TRACKBAR",
+    "GENIE_OBJ_WINBUTTON",      "GENIE_OBJ_ANGULAR_METER",  "GENIE_OBJ_COOL_GAUGE",
+    "GENIE_OBJ_CUSTOM_DIGITS",  "GENIE_OBJ_FORM",           "GENIE_OBJ_GAUGE",
+    "GENIE_OBJ_IMAGE",          "GENIE_OBJ_KEYBOARD",       "GENIE_OBJ_LED",
+    "GENIE_OBJ_LED_DIGITS",     "GENIE_OBJ_METER",          "GENIE_OBJ_STRINGS",
+    "GENIE_OBJ_THERMOMETER",    "GENIE_OBJ_USER_LED",       "GENIE_OBJ_VIDEO",
+    "GENIE_OBJ_STATIC_TEXT",    "GENIE_OBJ_SOUND",          "GENIE_OBJ_TIMER",
+    "GENIE_OBJ_SPECTRUM",       "GENIE_OBJ_SCOPE",          "GENIE_OBJ_TANK",
+    "GENIE_OBJ_USERIMAGES",     "GENIE_OBJ_PINOUTPUT",      "GENIE_OBJ_PININPUT",
+    "GENIE_OBJ_4DBUTTON",       "GENIE_OBJ_ANIBUTTON",      "GENIE_OBJ_COLORPICKER",
+    "GENIE_OBJ_USERBUTTON"
+};
+
+// types whose value the host sets with genieWriteObject, so the
+// shadow table needs a slot for each. Inputs only report, Strings
+// are written as text and forms are activated, not shadowed.
+static const char hostWrites[OBJ_TYPES] = {
+    0, 0, 0, 0, 0, 0, 0, 1,     // Dipswitch .. Winbutton, Angularmeter
+    1, 1, 0, 1, 0, 0, 1, 1,     // Coolgauge .. LedDigits
+    1, 0, 1, 1, 1, 0, 1, 1,     // Meter .. Timer
+    1, 1, 1, 1, 1, 0, 0, 0,     // Spectrum .. AniButton
+    0, 0                        // ColorPicker, UserButton
+};
+
+#define TYPE_FORM           10
+#define TYPE_LED_DIGITS     15
+
+static Object   objects[MAX_OBJECTS];
+static int      objectCount;
+static int      typeCount[OBJ_TYPES];
+static char     platform[MAX_NAME];
+static long     speed;
+static long     sndBuf;
+static int      multidrop;
+static long     destination;
+
+////////////////////// classType ////////////////////////
+//
+// Returns: the GENIE_OBJ_* value for a Workshop class, or -1
+//
+static int classType(const char *name) {
+    int i;
+
+    for (i = 0; i < OBJ_TYPES; i++) {
+        if (strcasecmp(name, workshopClass[i]) == 0) {
+            return i;
+        }
+    }
+
+    // older projects use Slider for GSlider
+    if (strcasecmp(name, "Slider") == 0) {
+        return 4;
+    }
+
+    return -1;
+}
+
+////////////////////// splitLine ////////////////////////
+//
+// Split "    Key    Value" into its key and value, stripping the
+// quotes Workshop puts around strings.
+//
+// Returns: the indent, or -1 for a blank line
+//
+static int splitLine(char *line, char **key, char **value) {
+    char *p = line, *end;
+    int indent = 0;
+
+    // UTF-8 byte order mark
+    if ((unsigned char)p[0] == 0xEF && (unsigned char)p[1] == 0xBB && (unsigned char)p[2] == 0xBF) {
+        p += 3;
+    }
+
+    end = p + strlen(p);
+
+    while (end > p && isspace((unsigned char)end[-1])) {
+        *--end = 0;
+    }
+
+    while (*p == ' ' || *p == '\t') {
+        p++;
+        indent++;
+    }
+
+    if (*p == 0) {
+        return -1;
+    }
+
+    *key = p;
+
+    while (*p && !isspace((unsigned char)*p)) {
+        p++;
+    }
+
+    if (*p) {
+        *p++ = 0;
+    }
+
+    while (isspace((unsigned char)*p)) {
+        p++;
+    }
+
+    if (*p == '\'' && end > p + 1 && end[-1] == '\'') {
+        end[-1] = 0;
+        p++;
+    }
+
+    *value = p;
+    return indent;
+}
+
+////////////////////// setProperty ////////////////////////
+//
+static void setProperty(Object *o, const char *key, const char *value) {
+    if (strcasecmp(key, "Name") == 0) {
+        snprintf(o->name, sizeof(o->name), "%s", value);
+    } else if (strcasecmp(key, "Minvalue") == 0 || strcasecmp(key, "MinimumValue") == 0) {
+        o->min = strtol(value, NULL, 0);
+    } else if (strcasecmp(key, "Maxvalue") == 0 || strcasecmp(key, "MaximumValue") == 0) {
+        o->max = strtol(value, NULL, 0);
+    } else if (strcasecmp(key, "Digits") == 0 && o->type == TYPE_LED_DIGITS) {
+        long max = 1;
+        int digits = atoi(value);
+
+        while (digits-- > 0 && max <= 0xFFFF) {
+            max *= 10;
+        }
+
+        o->max = (max - 1 > 0xFFFF) ? 0xFFFF : max - 1;
+    } else if (strncasecmp(key, "On", 2) == 0 && strcasecmp(value, "Report Message") == 0) {
+        o->reports = 1;
+    }
+}
+
+////////////////////// parseProject ////////////////////////
+//
+// Read the project's top level blocks. Each object block starts
+// with its class name and ends with "end". Indexes are given per
+// type in the order objects appear, which is how Workshop numbers
+// them.
+//
+// Returns: 0 on success
+//
+static int parseProject(FILE *f, const char *path) {
+    char line[MAX_LINE], *key, *value;
+    Object *o = NULL;
+    int lineNo = 0, inOptions = 0, inBlock = 0, form = -1, indent, type;
+
+    while (fgets(line, sizeof(line), f)) {
+        lineNo++;
+        indent = splitLine(line, &key, &value);
+
+        if (indent < 0) {
+            continue;
+        }
+
+        if (indent > 0) {
+            if (o != NULL) {
+                setProperty(o, key, value);
+            } else if (inOptions && strcasecmp(key, "Speed") == 0) {
+                speed = strtol(value, NULL, 0);
+            } else if (inOptions && strcasecmp(key, "SndBuf") == 0) {
+                sndBuf = strtol(value, NULL, 0);
+            } else if (inOptions && strcasecmp(key, "Multidrop") == 0) {
+                multidrop = (strcasecmp(value, "Yes") == 0);
+            } else if (inOptions && strcasecmp(key, "Destination") == 0) {
+                destination = strtol(value, NULL, 0);
+            }
+
+            continue;
+        }
+
+        if (strcasecmp(key, "end") == 0) {
+            if (o != NULL && o->name[0] == 0) {
+                fprintf(stderr, "%s:%d: object has no name\n", path, o->line);
+                return -1;
+            }
+
+            o = NULL;
+            inOptions = 0;
+            inBlock = 0;
+            continue;
+        }
+
+        if (inBlock) {
+            fprintf(stderr, "%s:%d: missing end before %s\n", path, lineNo, key);
+            return -1;
+        }
+
+        inBlock = 1;
+
+        if (strcasecmp(key, "Platform") == 0) {
+            snprintf(platform, sizeof(platform), "%s", value);
+            inBlock = 0;
+            continue;
+        }
+
+        if (strcasecmp(key, "Version") == 0 || strcasecmp(key, "PlatRes") == 0) {
+            inBlock = 0;
+            continue;
+        }
+
+        if (strcasecmp(key, "Options") == 0) {
+            inOptions = 1;
+            continue;
+        }
+
+        type = classType(key);
+
+        if (type < 0) {
+            if (strcasecmp(key, "Depends") != 0) {
+                fprintf(stderr, "%s:%d: skipping unknown object %s\n", path, lineNo, key);
+            }
+
+            continue;
+        }
+
+        if (type == TYPE_FORM) {
+            form++;
+        } else if (form < 0) {
+            fprintf(stderr, "%s:%d: %s before the first form\n", path, lineNo, key);
+            return -1;
+        }
+
+        if (objectCount >= MAX_OBJECTS) {
+            fprintf(stderr, "%s:%d: more than %d objects\n", path, lineNo, MAX_OBJECTS);
+            return -1;
+        }
+
+        o = &objects[objectCount++];
+        memset(o, 0, sizeof(*o));
+        o->type = type;
+        o->index = typeCount[type]++;
+        o->form = form;
+        o->max = 0xFFFF;
+        o->line = lineNo;
+    }
+
+    if (inBlock) {
+        fprintf(stderr, "%s: missing end at end of file\n", path);
+        return -1;
+    }
+
+    return 0;
+}
+
+////////////////////// macroName ////////////////////////
+//
+// GENIE_ followed by the object's name in upper case, with
+// anything that can't go in an identifier turned into '_'.
+//
+static void macroName(const char *name, char *out, size_t size) {
+    size_t n = (size_t)snprintf(out, size, "GENIE_");
+
+    for (; *name && n + 1 < size; name++) {
+        out[n++] = isalnum((unsigned char)*name) ? (char)toupper((unsigned char)*name) : '_';
+    }
+
+    out[n] = 0;
+}
+
+////////////////////// guardName ////////////////////////
+//
+static void guardName(const char *base, char *out, size_t size) {
+    size_t n = 0;
+
+    for (; *base && n + 1 < size; base++) {
+        out[n++] = isalnum((unsigned char)*base) ? (char)toupper((unsigned char)*base) : '_';
+    }
+
+    out[n] = 0;
+}
+
+static int compareObjects(const void *a, const void *b) {
+    const Object *x = a, *y = b;
+
+    if (x->type != y->type) {
+        return x->type - y->type;
+    }
+
+    return x->index - y->index;
+}
+
+////////////////////// writeHeader ////////////////////////
+//
+static void writeHeader(FILE *out, const char *source, const char *header) {
+    char name[MAX_NAME + 8], macro[MAX_NAME + 16], guard[MAX_LINE];
+    int i, forms = 0, shadow = 0, handlers = 0;
+    const char *base = strrchr(source, '/'), *headerBase = strrchr(header, '/');
+    Object *o;
+
+    base = base ? base + 1 : source;
+    headerBase = headerBase ? headerBase + 1 : header;
+    guardName(headerBase, guard, sizeof(guard));
+
+    for (i = 0; i < objectCount; i++) {
+        o = &objects[i];
+
+        if (o->type == TYPE_FORM) {
+            forms++;
+        } else if (hostWrites[o->type]) {
+            shadow++;
+        }
+
+        if (o->reports) {
+            handlers++;
+        }
+    }
+
+    fprintf(out, "/////////////////////// %s ///////////////////////\n", headerBase);
+    fprintf(out, "//\n");
+    fprintf(out, "//      Generated by genieGen from %s, do not edit.\n", base);
+    fprintf(out, "//      Include it in one source file only.\n");
+    fprintf(out, "//\n\n");
+    fprintf(out, "#ifndef %s\n#define %s\n\n", guard, guard);
+    fprintf(out, "#include \"visiGenieSerial.h\"\n\n");
+    fprintf(out, "#define GENIE_PROJECT_PLATFORM  \"%s\"\n", platform);
+    fprintf(out, "#define GENIE_PROJECT_SPEED     %ld\n", speed);
+    fprintf(out, "#define GENIE_PROJECT_SNDBUF    %ld    // for genieCtxSetWindow\n", sndBuf > 0 ? sndBuf : 1);
+    fprintf(out, "#define GENIE_PROJECT_MULTIDROP %d\n", multidrop ? 1 : 0);
+    fprintf(out, "#define GENIE_PROJECT_ADDRESS   %ld    // for genieBusAdd\n", destination);
+    fprintf(out, "#define GENIE_PROJECT_FORMS     %d\n", forms);
+    fprintf(out, "#define GENIE_PROJECT_OBJECTS   %d\n", objectCount);
+    fprintf(out, "#define GENIE_PROJECT_SHADOW    %d    // objects set with WriteObject\n", shadow);
+    fprintf(out, "#define GENIE_PROJECT_HANDLERS  %d    // objects that report events\n", handlers);
+
+    for (i = 0; i < objectCount; i++) {
+        o = &objects[i];
+        macroName(o->name, name, sizeof(name));
+        fprintf(out, "\n// %s, %s on form %d\n", o->name, workshopClass[o->type], o->form);
+        fprintf(out, "#define %-32s %s\n", strcat(strcpy(macro, name), "_OBJECT"), genieObject[o->type]);
+        fprintf(out, "#define %-32s %d\n", strcat(strcpy(macro, name), "_INDEX"), o->index);
+        fprintf(out, "#define %-32s %d\n", strcat(strcpy(macro, name), "_FORM"), o->form);
+        fprintf(out, "#define %-32s %ld\n", strcat(strcpy(macro, name), "_MIN"), o->min);
+        fprintf(out, "#define %-32s %ld\n", strcat(strcpy(macro, name), "_MAX"), o->max);
+        fprintf(out, "#define %-32s %s_OBJECT, %s_INDEX\n", name, name, name);
+    }
+
+    qsort(objects, objectCount, sizeof(Object), compareObjects);
+
+    fprintf(out, "\n// Sorted by object then index, see genieFindObject\n");
+    fprintf(out, "static const GenieObjectInfo genieProjectObjects[GENIE_PROJECT_OBJECTS] = {\n");
+
+    for (i = 0; i < objectCount; i++) {
+        o = &objects[i];
+        fprintf(out, "    { %-24s %3d, %3d, %5ld, %5ld },\n", strcat(strcpy(macro, genieObject[o->type]), ","),
+                o->index, o->form, o->min, o->max);
+    }
+
+    fprintf(out, "};\n\n");
+    fprintf(out, "// For genieCtxAttachShadow and genieCtxAttachDispatchTable\n");
+    fprintf(out, "static GenieShadowEntry  genieProjectShadow[GENIE_PROJECT_SHADOW > 0 ? GENIE_PROJECT_SHADOW : 1];\n");
+    fprintf(out, "static GenieHandlerEntry genieProjectHandlers[GENIE_PROJECT_HANDLERS > 0 ? GENIE_PROJECT_HANDLERS : 1];\n");
+    fprintf(out, "\n#endif\n");
+}
+
+int main(int argc, char **argv) {
+    const char *header;
+    char defaultHeader[MAX_LINE];
+    FILE *in, *out;
+    char *dot;
+
+    if (argc < 2 || argc > 3) {
+        fprintf(stderr, "usage: %s project.4DGenie [header.h]\n", argv[0]);
+        return 2;
+    }
+
+    if ((in = fopen(argv[1], "r")) == NULL) {
+        perror(argv[1]);
+        return 1;
+    }
+
+    if (parseProject(in, argv[1]) != 0) {
+        fclose(in);
+        return 1;
+    }
+
+    fclose(in);
+
+    if (argc == 3) {
+        header = argv[2];
+    } else {
+        snprintf(defaultHeader, sizeof(defaultHeader) - 2, "%s", argv[1]);
+
+        if ((dot = strrchr(defaultHeader, '.')) != NULL && strchr(dot, '/') == NULL) {
+            *dot = 0;
+        }
+
+        strcat(defaultHeader, ".h");
+        header = defaultHeader;
+    }
+
+    if ((out = fopen(header, "w")) == NULL) {
+        perror(header);
+        return 1;
+    }
+
+    writeHeader(out, argv[1], header);
+
+    if (fclose(out) != 0) {
+        perror(header);
+        return 1;
+    }
+
+    return 0;
+}
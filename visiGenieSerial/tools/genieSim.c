@@ -0,0 +1,541 @@
+/////////////////////// genieSim ///////////////////////
+//
+//      A simulated Genie display, see genieSim.h.
+//
+/*********************************************************************
+ * This file is part of visiGenieSerial:
+ *    visiGenieSerial is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU Lesser General Public License as
+ *    published by the Free Software Foundation, either version 3 of the
+ *    License, or (at your option) any later version.
+ *
+ *    visiGenieSerial is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU Lesser General Public License for more details.
+ *
+ *    You should have received a copy of the GNU Lesser General Public
+ *    License along with visiGenieSerial.
+ *    If not, see <http://www.gnu.org/licenses/>.
+ *********************************************************************/
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include "genieSim.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+
+// most events sent in one step, so a stalled host isn't buried
+#define MAX_BURST   4096
+
+static size_t      commandLength       (GenieSim *sim, const uint8_t *rx, size_t len);
+static size_t      frameLength         (const uint8_t *rx, size_t len);
+static void        processCommand      (GenieSim *sim, const uint8_t *cmd, size_t len, uint64_t now);
+static void        queueReply          (GenieSim *sim, uint8_t display, const uint8_t *bytes, uint8_t len, uint64_t now);
+static size_t      addressed           (GenieSim *sim, uint8_t display, uint8_t *frame, size_t len);
+static void        sendDue             (GenieSim *sim, uint64_t now);
+static bool        txPut               (GenieSim *sim, const uint8_t *bytes, size_t len, bool mustSend);
+static void        txFlush             (GenieSim *sim);
+static uint64_t    wireTime            (GenieSim *sim, size_t len);
+static int64_t     pollTimeout         (GenieSim *sim, int timeoutMs, uint64_t now);
+
+////////////////////// SimMicros ////////////////////////
+//
+uint64_t genieSimMicros(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000u + (uint64_t)(ts.tv_nsec / 1000);
+}
+
+////////////////////// SimAttach ////////////////////////
+//
+// Act as the display on fd, one end of a socketpair for instance.
+//
+void genieSimAttach(GenieSim *sim, int fd, const GenieSimConfig *config) {
+    memset(sim, 0, sizeof(*sim));
+    sim->fd = fd;
+    sim->config = *config;
+    sim->start = genieSimMicros();
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+}
+
+////////////////////// SimOpenPty ////////////////////////
+//
+// Act as the display on a new pty. The host opens the slave, whose
+// path is copied into slave.
+//
+// Returns: 0 on success, -1 with errno set
+//
+int genieSimOpenPty(GenieSim *sim, const GenieSimConfig *config, char *slave, size_t size) {
+    struct termios tio;
+    int fd = posix_openpt(O_RDWR | O_NOCTTY);
+
+    if (fd < 0) {
+        return -1;
+    }
+
+    if (grantpt(fd) < 0 || unlockpt(fd) < 0 || ptsname_r(fd, slave, size) != 0) {
+        close(fd);
+        return -1;
+    }
+
+    // raw on our side too, so nothing is translated
+    if (tcgetattr(fd, &tio) == 0) {
+        cfmakeraw(&tio);
+        tcsetattr(fd, TCSANOW, &tio);
+    }
+
+    genieSimAttach(sim, fd, config);
+    return 0;
+}
+
+////////////////////// SimStep ////////////////////////
+//
+// Wait up to timeoutMs for something to do, then read and answer
+// commands and send whatever replies and events have fallen due.
+//
+// Returns: 0, or -1 when the host has gone away
+//
+int genieSimStep(GenieSim *sim, int timeoutMs) {
+    struct pollfd pfd;
+    struct timespec ts;
+    uint64_t now = genieSimMicros();
+    int64_t wait = pollTimeout(sim, timeoutMs, now);
+    size_t used, n;
+    ssize_t got;
+
+    pfd.fd = sim->fd;
+    pfd.events = (sim->rxLen < sizeof(sim->rx) ? POLLIN : 0) | (sim->txLen > 0 ? POLLOUT : 0);
+    pfd.revents = 0;
+
+    ts.tv_sec = (time_t)(wait / 1000000);
+    ts.tv_nsec = (long)(wait % 1000000) * 1000;
+
+    if (ppoll(&pfd, 1, (wait < 0) ? NULL : &ts, NULL) < 0 && errno != EINTR) {
+        return -1;
+    }
+
+    if (pfd.revents & POLLIN) {
+        got = read(sim->fd, sim->rx + sim->rxLen, sizeof(sim->rx) - sim->rxLen);
+
+        if (got == 0) {
+            return -1;
+        }
+
+        if (got > 0) {
+            sim->rxLen += (size_t)got;
+            sim->stats.rxBytes += (uint32_t)got;
+        }
+    } else if (pfd.revents & (POLLHUP | POLLERR)) {
+        return -1;
+    }
+
+    now = genieSimMicros();
+    used = 0;
+
+    // commands are left in rx while every reply slot is taken, which
+    // holds the host up the way a full display buffer would
+    while (sim->replyCount < GENIE_SIM_MAX_REPLIES &&
+            (n = commandLength(sim, sim->rx + used, sim->rxLen - used)) > 0) {
+        processCommand(sim, sim->rx + used, n, now);
+        used += n;
+    }
+
+    if (used > 0) {
+        memmove(sim->rx, sim->rx + used, sim->rxLen - used);
+        sim->rxLen -= used;
+    }
+
+    sendDue(sim, now);
+    txFlush(sim);
+    return 0;
+}
+
+////////////////////// Sim::commandLength ////////////////////////
+//
+// Returns: the length of the command at the front of rx, with its
+//              address on a multidrop line, 0 if it is not all
+//              there yet, or 1 for a byte that doesn't start a
+//              command
+//
+static size_t commandLength (GenieSim *sim, const uint8_t *rx, size_t len) {
+    size_t n;
+
+    if (sim->config.displays == 0) {
+        return frameLength(rx, len);
+    }
+
+    if (len == 0) {
+        return 0;
+    }
+
+    if ((uint8_t)(rx[0] - sim->config.firstAddress) >= sim->config.displays) {
+        return 1;
+    }
+
+    // an address followed by junk is junk
+    n = frameLength(rx + 1, len - 1);
+    return (n == 1) ? 1 : (n > 0) ? n + 1 : 0;
+}
+
+////////////////////// Sim::frameLength ////////////////////////
+//
+// Returns: the length of the command at the front of rx, as
+//              commandLength, leaving out any address
+//
+static size_t frameLength (const uint8_t *rx, size_t len) {
+    size_t need;
+
+    if (len == 0) {
+        return 0;
+    }
+
+    switch (rx[0]) {
+        case GENIE_READ_OBJ:        need = 4; break;
+        case GENIE_WRITE_OBJ:       need = 6; break;
+        case GENIE_WRITE_CONTRAST:  need = 3; break;
+
+        case GENIE_WRITE_STR:
+        case GENIE_WRITE_STRU:
+        case GENIEM_WRITE_BYTES:
+        case GENIEM_WRITE_DBYTES:
+            if (len < 3) {
+                return 0;
+            }
+
+            need = (size_t)rx[2] * ((rx[0] == GENIE_WRITE_STRU || rx[0] == GENIEM_WRITE_DBYTES) ? 2 : 1) + 4;
+            break;
+
+        default:
+            return 1;
+    }
+
+    return (len >= need) ? need : 0;
+}
+
+////////////////////// Sim::processCommand ////////////////////////
+//
+static void processCommand (GenieSim *sim, const uint8_t *cmd, size_t len, uint64_t now) {
+    uint8_t reply[GENIE_FRAME_SIZE], checksum = 0, d = 0;
+    bool lose;
+    size_t i;
+
+    // the host's write lands all at once, but on a real line the
+    // command is only all in once its bytes have crossed it
+    if (sim->config.baud != 0) {
+        sim->rxWire = ((sim->rxWire > now) ? sim->rxWire : now) + wireTime(sim, len);
+        now = sim->rxWire;
+    }
+
+    // no command is a single byte
+    if (len == 1) {
+        sim->stats.junk++;
+        return;
+    }
+
+    sim->stats.commands++;
+
+    // the checksum covers the address
+    for (i = 0; i < len; i++) {
+        checksum ^= cmd[i];
+    }
+
+    if (sim->config.displays != 0) {
+        d = cmd[0] - sim->config.firstAddress;
+        cmd++;
+        len--;
+    }
+
+    if (checksum != 0) {
+        sim->stats.badChecksums++;
+        reply[0] = GENIE_NAK;
+        queueReply(sim, d, reply, 1, now);
+        return;
+    }
+
+    sim->goodCommands++;
+
+    if (sim->config.nakEvery != 0 && sim->goodCommands % sim->config.nakEvery == 0) {
+        reply[0] = GENIE_NAK;
+        queueReply(sim, d, reply, 1, now);
+        return;
+    }
+
+    // the command is carried out but its reply never makes it back
+    lose = (sim->config.loseEvery != 0 && sim->goodCommands % sim->config.loseEvery == 0);
+    sim->stats.lost += lose;
+
+    switch (cmd[0]) {
+        case GENIE_READ_OBJ:
+            reply[0] = GENIE_REPORT_OBJ;
+            reply[1] = cmd[1];
+            reply[2] = cmd[2];
+            reply[3] = (cmd[1] < GENIE_SIM_OBJECTS) ? sim->values[d][cmd[1]][cmd[2]] >> 8 : 0;
+            reply[4] = (cmd[1] < GENIE_SIM_OBJECTS) ? sim->values[d][cmd[1]][cmd[2]] & 0xFF : 0;
+            reply[5] = reply[0] ^ reply[1] ^ reply[2] ^ reply[3] ^ reply[4];
+            if (!lose) {
+                queueReply(sim, d, reply, GENIE_FRAME_SIZE, now);
+            }
+            return;
+
+        case GENIE_WRITE_OBJ:
+            if (cmd[1] < GENIE_SIM_OBJECTS) {
+                sim->values[d][cmd[1]][cmd[2]] = (uint16_t)((cmd[3] << 8) | cmd[4]);
+            }
+            break;
+
+        case GENIE_WRITE_CONTRAST:
+            sim->contrast[d] = cmd[1];
+            break;
+
+        default:
+            break;
+    }
+
+    if (!lose) {
+        reply[0] = GENIE_ACK;
+        queueReply(sim, d, reply, 1, now);
+    }
+}
+
+////////////////////// Sim::queueReply ////////////////////////
+//
+// Each display works through its commands one after another, each
+// taking ackDelayUs, so a reply is due that long after the one
+// before. Replies from several displays wait for the line in turn.
+//
+static void queueReply (GenieSim *sim, uint8_t display, const uint8_t *bytes, uint8_t len, uint64_t now) {
+    GenieSimReply *r = &sim->replies[(sim->replyHead + sim->replyCount) % GENIE_SIM_MAX_REPLIES];
+    uint64_t *busy = &sim->busyUntil[display];
+
+    memcpy(r->bytes, bytes, len);
+    r->len = (uint8_t)addressed(sim, display, r->bytes, len);
+
+    if (*busy < now) {
+        *busy = now;
+    }
+
+    *busy += sim->config.ackDelayUs;
+
+    if (*busy < sim->lineFree) {
+        *busy = sim->lineFree;
+    }
+
+    *busy += wireTime(sim, r->len);
+    r->due = sim->lineFree = *busy;
+    sim->replyCount++;
+}
+
+////////////////////// Sim::addressed ////////////////////////
+//
+// On a multidrop line, put the display's address ahead of a frame
+// and into its checksum. frame must have room for one more byte.
+//
+// Returns: the length of the frame now
+//
+static size_t addressed (GenieSim *sim, uint8_t display, uint8_t *frame, size_t len) {
+    if (sim->config.displays == 0) {
+        return len;
+    }
+
+    memmove(frame + 1, frame, len);
+    frame[0] = sim->config.firstAddress + display;
+
+    if (len > 1) {
+        frame[len] ^= frame[0];
+    }
+
+    return len + 1;
+}
+
+////////////////////// Sim::sendDue ////////////////////////
+//
+static void sendDue (GenieSim *sim, uint64_t now) {
+    GenieSimReply *r;
+    uint8_t frame[1 + 3 + 2 * 255 + 1], checksum, cmd;
+    uint64_t due;
+    uint32_t burst;
+    size_t len, i;
+
+    while (sim->replyCount > 0) {
+        r = &sim->replies[sim->replyHead];
+
+        if (r->due > now) {
+            break;
+        }
+
+        txPut(sim, r->bytes, r->len, true);
+        cmd = r->bytes[(sim->config.displays != 0) ? 1 : 0];
+
+        if (cmd == GENIE_ACK) {
+            sim->stats.acks++;
+        } else if (cmd == GENIE_NAK) {
+            sim->stats.naks++;
+        } else {
+            sim->stats.reports++;
+        }
+
+        sim->replyHead = (sim->replyHead + 1) % GENIE_SIM_MAX_REPLIES;
+        sim->replyCount--;
+    }
+
+    if (sim->config.eventRate != 0) {
+        due = (now - sim->start) * sim->config.eventRate / 1000000u;
+
+        for (burst = 0; sim->eventsDue < due && burst < MAX_BURST; burst++) {
+            sim->eventsDue++;
+            sim->eventValue++;
+            frame[0] = GENIE_REPORT_EVENT;
+            frame[1] = sim->config.eventObject;
+            frame[2] = sim->config.eventIndex;
+            frame[3] = sim->eventValue >> 8;
+            frame[4] = sim->eventValue & 0xFF;
+            frame[5] = frame[0] ^ frame[1] ^ frame[2] ^ frame[3] ^ frame[4];
+            len = addressed(sim, (sim->config.displays != 0) ? sim->eventsDue % sim->config.displays : 0,
+                            frame, GENIE_FRAME_SIZE);
+
+            if (txPut(sim, frame, len, false)) {
+                sim->stats.events++;
+            } else {
+                sim->stats.dropped++;
+            }
+        }
+
+        // don't try to catch up on what a long stall skipped
+        sim->eventsDue = due;
+    }
+
+    if (sim->config.magicRate != 0) {
+        due = (now - sim->start) * sim->config.magicRate / 1000000u;
+
+        for (burst = 0; sim->magicDue < due && burst < MAX_BURST; burst++) {
+            sim->magicDue++;
+            frame[0] = sim->config.magicDouble ? GENIEM_REPORT_DBYTES : GENIEM_REPORT_BYTES;
+            frame[1] = sim->config.magicIndex;
+            frame[2] = sim->config.magicLength;
+            len = 3 + (size_t)sim->config.magicLength * (sim->config.magicDouble ? 2 : 1);
+
+            for (i = 3; i < len; i++) {
+                frame[i] = (uint8_t)(sim->magicDue + i);
+            }
+
+            for (checksum = 0, i = 0; i < len; i++) {
+                checksum ^= frame[i];
+            }
+
+            frame[len++] = checksum;
+            len = addressed(sim, (sim->config.displays != 0) ? sim->magicDue % sim->config.displays : 0, frame, len);
+
+            if (txPut(sim, frame, len, false)) {
+                sim->stats.magic++;
+            } else {
+                sim->stats.dropped++;
+            }
+        }
+
+        sim->magicDue = due;
+    }
+}
+
+////////////////////// Sim::txPut ////////////////////////
+//
+// Replies must get through, events are dropped when the host has
+// let a whole buffer of them pile up.
+//
+// Returns: true if the bytes were queued
+//
+static bool txPut (GenieSim *sim, const uint8_t *bytes, size_t len, bool mustSend) {
+    size_t limit = mustSend ? sizeof(sim->tx) : sizeof(sim->tx) - 256;
+
+    if (sim->txLen + len > limit) {
+        txFlush(sim);
+
+        if (sim->txLen + len > limit) {
+            if (!mustSend) {
+                return false;
+            }
+
+            // the host isn't reading, wait for it as a UART would
+            while (sim->txLen + len > sizeof(sim->tx)) {
+                struct pollfd pfd = { sim->fd, POLLOUT, 0 };
+                poll(&pfd, 1, 100);
+                txFlush(sim);
+            }
+        }
+    }
+
+    memcpy(sim->tx + sim->txLen, bytes, len);
+    sim->txLen += len;
+    return true;
+}
+
+////////////////////// Sim::txFlush ////////////////////////
+//
+static void txFlush (GenieSim *sim) {
+    ssize_t n;
+
+    while (sim->txLen > 0) {
+        n = write(sim->fd, sim->tx, sim->txLen);
+
+        if (n <= 0) {
+            return;
+        }
+
+        memmove(sim->tx, sim->tx + n, sim->txLen - (size_t)n);
+        sim->txLen -= (size_t)n;
+        sim->stats.txBytes += (uint32_t)n;
+    }
+}
+
+////////////////////// Sim::wireTime ////////////////////////
+//
+// Returns: microseconds len bytes take on the line, 8N1 being ten
+//              bits a byte
+//
+static uint64_t wireTime (GenieSim *sim, size_t len) {
+    if (sim->config.baud == 0) {
+        return 0;
+    }
+
+    return (uint64_t)len * 10u * 1000000u / sim->config.baud;
+}
+
+////////////////////// Sim::pollTimeout ////////////////////////
+//
+// Returns: microseconds to sleep before the next reply or event is
+//              due, or -1 to wait for input
+//
+static int64_t pollTimeout (GenieSim *sim, int timeoutMs, uint64_t now) {
+    uint64_t next = (timeoutMs < 0) ? UINT64_MAX : now + (uint64_t)timeoutMs * 1000u;
+    uint64_t due;
+
+    if (sim->replyCount > 0 && sim->replies[sim->replyHead].due < next) {
+        next = sim->replies[sim->replyHead].due;
+    }
+
+    if (sim->config.eventRate != 0) {
+        due = sim->start + (sim->eventsDue + 1) * 1000000u / sim->config.eventRate;
+        next = (due < next) ? due : next;
+    }
+
+    if (sim->config.magicRate != 0) {
+        due = sim->start + (sim->magicDue + 1) * 1000000u / sim->config.magicRate;
+        next = (due < next) ? due : next;
+    }
+
+    if (next == UINT64_MAX) {
+        return -1;
+    }
+
+    return (next <= now) ? 0 : (int64_t)(next - now);
+}
@@ -0,0 +1,117 @@
+/////////////////////// genieSim ///////////////////////
+//
+//      A simulated Genie display for testing hosts on Linux without
+//      hardware. It sits on one end of a pty or socketpair and
+//      speaks the protocol in visiGenieSerial.h:
+//
+//        WRITE_OBJ, WRITE_STR(U), WRITE_CONTRAST and the magic
+//        writes are ACKed, or NAKed on a bad checksum
+//        READ_OBJ is answered with a REPORT_OBJ of the last value
+//        written to the object
+//        replies can be NAKed or lost at a set interval
+//        REPORT_EVENT frames and GENIEM_REPORT_BYTES/DBYTES are
+//        sent out of the blue at a configurable rate
+//
+//      Each command takes ackDelayUs to process and commands are
+//      processed one at a time, like the real display. With a high
+//      event rate it doubles as a load generator.
+//
+//      Set displays to stand in for several displays on a multidrop
+//      line, at addresses firstAddress on. Each has its own objects
+//      and works through its own commands, but their replies and
+//      events take turns on the one line.
+//
+/*********************************************************************
+ * This file is part of visiGenieSerial:
+ *    visiGenieSerial is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU Lesser General Public License as
+ *    published by the Free Software Foundation, either version 3 of the
+ *    License, or (at your option) any later version.
+ *
+ *    visiGenieSerial is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU Lesser General Public License for more details.
+ *
+ *    You should have received a copy of the GNU Lesser General Public
+ *    License along with visiGenieSerial.
+ *    If not, see <http://www.gnu.org/licenses/>.
+ *********************************************************************/
+
+#ifndef genieSim_h
+#define genieSim_h
+
+#include "visiGenieSerial.h"
+
+#define GENIE_SIM_DISPLAYS      8
+#define GENIE_SIM_OBJECTS       64
+#define GENIE_SIM_RX_SIZE       1024
+#define GENIE_SIM_TX_SIZE       65536
+#define GENIE_SIM_MAX_REPLIES   64
+
+typedef struct GenieSimConfig {
+    uint32_t        ackDelayUs;     // time to process each command
+    uint32_t        eventRate;      // REPORT_EVENT frames a second, 0 for none
+    uint8_t         eventObject;
+    uint8_t         eventIndex;
+    uint32_t        magicRate;      // magic reports a second, 0 for none
+    uint8_t         magicIndex;
+    uint8_t         magicLength;    // bytes, or double bytes if magicDouble
+    bool            magicDouble;
+    uint32_t        nakEvery;       // NAK every nth good command, 0 never
+    uint32_t        loseEvery;      // no reply to every nth good command, 0 never
+    uint32_t        baud;           // line rate to model, 0 for an instant line
+    uint8_t         displays;       // on a multidrop line, 0 for one on a line of its own
+    uint8_t         firstAddress;
+} GenieSimConfig;
+
+typedef struct GenieSimStats {
+    uint32_t        commands;       // complete commands received
+    uint32_t        acks;
+    uint32_t        naks;
+    uint32_t        lost;           // replies not sent, see loseEvery
+    uint32_t        reports;        // REPORT_OBJ replies
+    uint32_t        events;         // REPORT_EVENT frames sent
+    uint32_t        magic;          // magic reports sent
+    uint32_t        dropped;        // events not sent as the host wasn't reading
+    uint32_t        badChecksums;
+    uint32_t        junk;           // bytes that didn't start a command
+    uint32_t        rxBytes;        // bytes from the host
+    uint32_t        txBytes;        // bytes to the host
+} GenieSimStats;
+
+typedef struct GenieSimReply {
+    uint64_t        due;            // monotonic microseconds
+    uint8_t         len;
+    uint8_t         bytes[GENIE_FRAME_SIZE + 1];
+} GenieSimReply;
+
+typedef struct GenieSim {
+    int             fd;
+    GenieSimConfig  config;
+    GenieSimStats   stats;
+    uint16_t        values[GENIE_SIM_DISPLAYS][GENIE_SIM_OBJECTS][256];
+    uint8_t         contrast[GENIE_SIM_DISPLAYS];
+    uint8_t         rx[GENIE_SIM_RX_SIZE];
+    size_t          rxLen;
+    uint8_t         tx[GENIE_SIM_TX_SIZE];
+    size_t          txLen;
+    GenieSimReply   replies[GENIE_SIM_MAX_REPLIES];
+    uint16_t        replyHead;
+    uint16_t        replyCount;
+    uint64_t        busyUntil[GENIE_SIM_DISPLAYS]; // when each display's last command is done
+    uint64_t        lineFree;       // when the last reply queued is all out
+    uint64_t        rxWire;         // when the last command received is all in
+    uint64_t        start;
+    uint64_t        eventsDue;
+    uint64_t        magicDue;
+    uint16_t        eventValue;
+    uint32_t        goodCommands;
+} GenieSim;
+
+    int         genieSimOpenPty          (GenieSim *sim, const GenieSimConfig *config, char *slave, size_t size);
+    void        genieSimAttach           (GenieSim *sim, int fd, const GenieSimConfig *config);
+    int         genieSimStep             (GenieSim *sim, int timeoutMs);
+    uint64_t    genieSimMicros           (void);
+
+#endif
@@ -0,0 +1,109 @@
+/////////////////////// genieSimMain ///////////////////////
+//
+//      Runs the simulated display on a pty and prints the slave's
+//      path for the host to open, e.g. with geniePosixOpen.
+//
+//      Usage:  genieSim [-d ackDelayUs] [-e events/s] [-o object]
+//                       [-i index] [-m magic/s] [-l length] [-w]
+//                       [-n nakEvery] [-x loseEvery] [-b baud]
+//                       [-t seconds] [-a displays] [-f firstAddress]
+//
+//      -w sends the magic reports as double bytes. -b models the
+//      time commands and replies take on a line of that rate. -a
+//      stands in for several displays on a multidrop line, at
+//      addresses from -f on, 1 by default. Statistics are
+//      printed when the host closes the port, -t runs out, or on
+//      Ctrl-C.
+//
+/*********************************************************************
+ * This file is part of visiGenieSerial:
+ *    visiGenieSerial is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU Lesser General Public License as
+ *    published by the Free Software Foundation, either version 3 of the
+ *    License, or (at your option) any later version.
+ *
+ *    visiGenieSerial is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU Lesser General Public License for more details.
+ *
+ *    You should have received a copy of the GNU Lesser General Public
+ *    License along with visiGenieSerial.
+ *    If not, see <http://www.gnu.org/licenses/>.
+ *********************************************************************/
+
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include "genieSim.h"
+
+static volatile sig_atomic_t stop;
+
+static void onSignal(int sig) {
+    (void)sig;
+    stop = 1;
+}
+
+int main(int argc, char **argv) {
+    static GenieSim sim;
+    GenieSimConfig config = { 0 };
+    char slave[128];
+    uint64_t end = 0;
+    int opt;
+
+    config.ackDelayUs = 1000;
+    config.eventObject = GENIE_OBJ_SLIDER;
+    config.magicLength = 8;
+    config.firstAddress = 1;
+
+    while ((opt = getopt(argc, argv, "d:e:o:i:m:l:wn:x:b:t:a:f:")) != -1) {
+        switch (opt) {
+            case 'd': config.ackDelayUs = (uint32_t)strtoul(optarg, NULL, 0); break;
+            case 'e': config.eventRate = (uint32_t)strtoul(optarg, NULL, 0); break;
+            case 'o': config.eventObject = (uint8_t)strtoul(optarg, NULL, 0); break;
+            case 'i': config.eventIndex = (uint8_t)strtoul(optarg, NULL, 0); break;
+            case 'm': config.magicRate = (uint32_t)strtoul(optarg, NULL, 0); break;
+            case 'l': config.magicLength = (uint8_t)strtoul(optarg, NULL, 0); break;
+            case 'w': config.magicDouble = true; break;
+            case 'n': config.nakEvery = (uint32_t)strtoul(optarg, NULL, 0); break;
+            case 'x': config.loseEvery = (uint32_t)strtoul(optarg, NULL, 0); break;
+            case 'b': config.baud = (uint32_t)strtoul(optarg, NULL, 0); break;
+            case 't': end = genieSimMicros() + strtoull(optarg, NULL, 0) * 1000000u; break;
+            case 'a': config.displays = (uint8_t)strtoul(optarg, NULL, 0); break;
+            case 'f': config.firstAddress = (uint8_t)strtoul(optarg, NULL, 0); break;
+            default:
+                fprintf(stderr, "usage: %s [-d ackDelayUs] [-e events/s] [-o object] [-i index] "
+                        "[-m magic/s] [-l length] [-w] [-n nakEvery] [-x loseEvery] [-b baud] [-t seconds] "
+                        "[-a displays] [-f firstAddress]\n", argv[0]);
+                return 2;
+        }
+    }
+
+    if (config.displays > GENIE_SIM_DISPLAYS) {
+        fprintf(stderr, "%s: at most %d displays\n", argv[0], GENIE_SIM_DISPLAYS);
+        return 2;
+    }
+
+    if (genieSimOpenPty(&sim, &config, slave, sizeof(slave)) < 0) {
+        perror("pty");
+        return 1;
+    }
+
+    signal(SIGINT, onSignal);
+    signal(SIGTERM, onSignal);
+    printf("%s\n", slave);
+    fflush(stdout);
+
+    while (!stop && (end == 0 || genieSimMicros() < end)) {
+        if (genieSimStep(&sim, 100) < 0) {
+            // nobody has the slave open, or the host closed it
+            usleep(10000);
+        }
+    }
+
+    fprintf(stderr, "commands %u acks %u naks %u lost %u reports %u events %u magic %u dropped %u bad checksums %u "
+            "junk %u\n", sim.stats.commands, sim.stats.acks, sim.stats.naks, sim.stats.lost, sim.stats.reports, sim.stats.events,
+            sim.stats.magic, sim.stats.dropped, sim.stats.badChecksums, sim.stats.junk);
+    return 0;
+}
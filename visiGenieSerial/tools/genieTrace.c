@@ -0,0 +1,260 @@
+/////////////////////// genieTrace ///////////////////////
+//
+//      Decodes a wire trace written by geniePosixTraceDump, or by
+//      any code that saves genieCtxTraceRead's records behind a
+//      GenieTraceFileHeader. The bytes each way are put back
+//      together into frames and printed one a line with the time
+//      they started, what they are and whether the checksum holds,
+//      in between the link state changes and errors.
+//
+//      Usage:  genieTrace trace.bin
+//
+/*********************************************************************
+ * This file is part of visiGenieSerial:
+ *    visiGenieSerial is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU Lesser General Public License as
+ *    published by the Free Software Foundation, either version 3 of the
+ *    License, or (at your option) any later version.
+ *
+ *    visiGenieSerial is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU Lesser General Public License for more details.
+ *
+ *    You should have received a copy of the GNU Lesser General Public
+ *    License along with visiGenieSerial.
+ *    If not, see <http://www.gnu.org/licenses/>.
+ *********************************************************************/
+
+#include <stdio.h>
+#include <string.h>
+#include "visiGenieSerialPosix.h"
+
+#define MAX_FRAME       (3 + 255 * 2 + 1)
+#define SHOW_BYTES      16
+
+typedef struct Stream {
+    const char     *dir;
+    bool            tx;
+    uint32_t        stamp;          // when the first byte went
+    uint8_t         bytes[MAX_FRAME];
+    size_t          len;
+} Stream;
+
+static const char *stateNames[] = {
+    "IDLE", "WFAN", "WF_RXREPORT", "RXREPORT", "RXEVENT", "SHDN", "RXMBYTES", "RXMDBYTES"
+};
+
+static const char *commandName(uint8_t cmd) {
+    switch (cmd) {
+        case GENIE_READ_OBJ:        return "READ_OBJ";
+        case GENIE_WRITE_OBJ:       return "WRITE_OBJ";
+        case GENIE_WRITE_STR:       return "WRITE_STR";
+        case GENIE_WRITE_STRU:      return "WRITE_STRU";
+        case GENIE_WRITE_CONTRAST:  return "WRITE_CONTRAST";
+        case GENIE_REPORT_OBJ:      return "REPORT_OBJ";
+        case GENIE_REPORT_EVENT:    return "REPORT_EVENT";
+        case GENIEM_WRITE_BYTES:    return "WRITE_BYTES";
+        case GENIEM_WRITE_DBYTES:   return "WRITE_DBYTES";
+        case GENIEM_REPORT_BYTES:   return "REPORT_BYTES";
+        case GENIEM_REPORT_DBYTES:  return "REPORT_DBYTES";
+        case GENIE_ACK:             return "ACK";
+        case GENIE_NAK:             return "NAK";
+        default:                    return "junk";
+    }
+}
+
+static const char *errorName(int8_t error) {
+    switch (error) {
+        case ERROR_NONE:        return "NONE";
+        case ERROR_TIMEOUT:     return "TIMEOUT";
+        case ERROR_NOHANDLER:   return "NOHANDLER";
+        case ERROR_NOCHAR:      return "NOCHAR";
+        case ERROR_NAK:         return "NAK";
+        case ERROR_REPLY_OVR:   return "REPLY_OVR";
+        case ERROR_RESYNC:      return "RESYNC";
+        case ERROR_NODISPLAY:   return "NODISPLAY";
+        case ERROR_BAD_CS:      return "BAD_CS";
+        default:                return "?";
+    }
+}
+
+static const char *stateName(uint8_t state) {
+    return (state < sizeof(stateNames) / sizeof(stateNames[0])) ? stateNames[state] : "?";
+}
+
+// Returns: the length of the frame at the front of s, 0 if it is
+//              not all there yet, 1 for a byte that starts nothing
+static size_t frameLength(const Stream *s) {
+    const uint8_t *b = s->bytes;
+    size_t need;
+    bool wide;
+
+    if (s->len == 0) {
+        return 0;
+    }
+
+    switch (b[0]) {
+        case GENIE_READ_OBJ:        need = s->tx ? 4 : 1; break;
+        case GENIE_WRITE_OBJ:       need = s->tx ? 6 : 1; break;
+        case GENIE_WRITE_CONTRAST:  need = s->tx ? 3 : 1; break;
+        case GENIE_REPORT_OBJ:
+        case GENIE_REPORT_EVENT:    need = s->tx ? 1 : GENIE_FRAME_SIZE; break;
+
+        case GENIE_WRITE_STR:
+        case GENIE_WRITE_STRU:
+        case GENIEM_WRITE_BYTES:
+        case GENIEM_WRITE_DBYTES:
+        case GENIEM_REPORT_BYTES:
+        case GENIEM_REPORT_DBYTES:
+            if (s->tx != (b[0] < GENIEM_REPORT_BYTES)) {
+                return 1;
+            }
+
+            if (s->len < 3) {
+                return 0;
+            }
+
+            wide = (b[0] == GENIE_WRITE_STRU || b[0] == GENIEM_WRITE_DBYTES || b[0] == GENIEM_REPORT_DBYTES);
+            need = (size_t)b[2] * (wide ? 2 : 1) + 4;
+            break;
+
+        default:
+            need = 1;
+            break;
+    }
+
+    return (s->len >= need) ? need : 0;
+}
+
+static void printFrame(const Stream *s, size_t len) {
+    const uint8_t *b = s->bytes;
+    uint8_t checksum = 0;
+    char detail[64] = "";
+    size_t i;
+
+    for (i = 0; i < len; i++) {
+        checksum ^= b[i];
+    }
+
+    switch (len > 1 ? b[0] : 0xFF) {
+        case GENIE_READ_OBJ:
+            snprintf(detail, sizeof(detail), "obj %u idx %u", b[1], b[2]);
+            break;
+
+        case GENIE_WRITE_OBJ:
+        case GENIE_REPORT_OBJ:
+        case GENIE_REPORT_EVENT:
+            snprintf(detail, sizeof(detail), "obj %u idx %u value %u", b[1], b[2], (b[3] << 8) | b[4]);
+            break;
+
+        case GENIE_WRITE_CONTRAST:
+            snprintf(detail, sizeof(detail), "value %u", b[1]);
+            break;
+
+        case 0xFF:
+            break;
+
+        default:
+            snprintf(detail, sizeof(detail), "idx %u len %u", b[1], b[2]);
+            break;
+    }
+
+    printf("%10u  %s  %-14s %-28s", s->stamp, s->dir, (len == 1 && b[0] != GENIE_ACK && b[0] != GENIE_NAK) ?
+           "junk" : commandName(b[0]), detail);
+
+    for (i = 0; i < len && i < SHOW_BYTES; i++) {
+        printf(" %02X", b[i]);
+    }
+
+    printf("%s%s\n", (len > SHOW_BYTES) ? " ..." : "", (len > 1 && checksum != 0) ? "  BAD CHECKSUM" : "");
+}
+
+// Print every frame s now holds whole, then keep what is left
+static void drain(Stream *s) {
+    size_t n;
+
+    while ((n = frameLength(s)) > 0) {
+        printFrame(s, n);
+        memmove(s->bytes, s->bytes + n, s->len - n);
+        s->len -= n;
+    }
+}
+
+static void add(Stream *s, const GenieTraceRecord *r) {
+    uint8_t i;
+
+    for (i = 0; i < r->len && i < GENIE_TRACE_DATA; i++) {
+        if (s->len == 0) {
+            s->stamp = r->stamp;
+        }
+
+        s->bytes[s->len++] = r->data[i];
+        drain(s);
+    }
+}
+
+int main(int argc, char **argv) {
+    Stream tx = { "TX", true, 0, { 0 }, 0 }, rx = { "RX", false, 0, { 0 }, 0 };
+    GenieTraceFileHeader header;
+    GenieTraceRecord r;
+    uint32_t i;
+    FILE *f;
+
+    if (argc != 2) {
+        fprintf(stderr, "usage: %s trace.bin\n", argv[0]);
+        return 2;
+    }
+
+    if ((f = fopen(argv[1], "rb")) == NULL) {
+        perror(argv[1]);
+        return 1;
+    }
+
+    if (fread(&header, sizeof(header), 1, f) != 1 || memcmp(header.magic, GENIE_TRACE_MAGIC, 4) != 0 ||
+            header.version != GENIE_TRACE_VERSION || header.recordSize != sizeof(GenieTraceRecord)) {
+        fprintf(stderr, "%s: not a version %u wire trace\n", argv[1], GENIE_TRACE_VERSION);
+        return 1;
+    }
+
+    for (i = 0; i < header.count && fread(&r, sizeof(r), 1, f) == 1; i++) {
+        switch (r.kind) {
+            case GENIE_TRACE_TX:
+                add(&tx, &r);
+                break;
+
+            case GENIE_TRACE_RX:
+                add(&rx, &r);
+                break;
+
+            case GENIE_TRACE_STATE:
+                printf("%10u  --  %s -> %s\n", r.stamp, stateName(r.data[0]), stateName(r.data[1]));
+                break;
+
+            case GENIE_TRACE_ERROR:
+                printf("%10u  !!  error %s\n", r.stamp, errorName((int8_t)r.data[0]));
+                break;
+
+            default:
+                printf("%10u  ??  record kind %u\n", r.stamp, r.kind);
+                break;
+        }
+    }
+
+    // a ring that wrapped can start part way into a frame, and one
+    // can be cut off at the end
+    if (tx.len > 0) {
+        printf("%10u  TX  %u bytes of an incomplete frame\n", tx.stamp, (unsigned)tx.len);
+    }
+
+    if (rx.len > 0) {
+        printf("%10u  RX  %u bytes of an incomplete frame\n", rx.stamp, (unsigned)rx.len);
+    }
+
+    if (i < header.count) {
+        fprintf(stderr, "%s: %u of %u records\n", argv[1], i, header.count);
+    }
+
+    fclose(f);
+    return 0;
+}
@@ -39,6 +39,7 @@
  *    If not, see <http://www.gnu.org/licenses/>.
  *********************************************************************/
 
+
 #include "visiGenieSerial.h"
 #include <math.h>
 #include <string.h>
@@ -56,52 +57,188 @@
   #endif
 #endif
 
-static void        flushEventQueue     (void);
-static void        handleError         (void);
-static void        setLinkState        (uint16_t newstate);
-static uint16_t    getLinkState        (void);
-static bool        enqueueEvent        (uint8_t * data);
-static uint8_t     getchar             (void);
-static uint16_t    getCharSerial       (void);
-static void        waitForIdle         (void);
-static void        pushLinkState       (uint8_t newstate);
-static void        popLinkState        (void);
-static void        fatalError          (void);
-static void        flushSerialInput    (void);
-static void        resync              (void);
-
-static EventQueueStruct EventQueue;
-static uint8_t LinkStates[MAX_LINK_STATES];
-static uint8_t *LinkState;
-static int Timeout;
-static int Error;
-static uint8_t rxframe_count;
-static int FatalErrors;
-static UserApiConfig  *deviceSerial;
-static UserApiConfig  *debugSerial;
-static UserEventHandlerPtr UserHandler;
-static UserBytePtr UserByteReader;
-static UserDoubleBytePtr UserDoubleByteReader;
+static void        flushEventQueue     (GenieContext *ctx);
+static void        handleError         (GenieContext *ctx);
+static void        setRxState          (GenieContext *ctx, uint8_t newstate);
+static uint16_t    getLinkState        (GenieContext *ctx);
+static bool        enqueueEvent        (GenieContext *ctx, uint8_t * data);
+static bool        eventPut            (GenieContext *ctx, EventQueueStruct *q, uint8_t * data);
+static bool        eventTake           (EventQueueStruct *q, GenieFrame * buff);
+static uint8_t     getchar             (GenieContext *ctx);
+static uint16_t    getCharSerial       (GenieContext *ctx);
+static uint16_t    processByte         (GenieContext *ctx, uint8_t c);
+static uint16_t    rxRefill            (GenieContext *ctx);
+static uint16_t    magicSpan           (GenieContext *ctx);
+static void        magicPayload        (GenieContext *ctx, const uint8_t *data, uint16_t len);
+static void        magicEnd            (GenieContext *ctx);
+#if (GENIE_RX_RING_SIZE > 0)
+static uint16_t    ringGet             (GenieContext *ctx);
+static void        busPump             (GenieBus *bus);
+static void        busRoute            (GenieBus *bus, uint8_t c);
+static void        busWaitForLine      (GenieBus *bus, GenieContext *ctx);
+static uint8_t     busInFlight         (GenieBus *bus);
+#endif
+static void        waitForWindow       (GenieContext *ctx, uint8_t maxPending);
+static void        waitForPort         (GenieContext *ctx, uint32_t maxMillis);
+static uint32_t    replyTimeLeft       (GenieContext *ctx);
+static void        replyTimedOut       (GenieContext *ctx);
+static bool        replySkipped        (GenieContext *ctx, uint8_t expect);
+static uint32_t    nowMicros           (GenieContext *ctx);
+static uint16_t    commandBytes        (uint8_t cmd, uint16_t len);
+static uint8_t     rttSlot             (uint8_t cmd, uint8_t object);
+static uint32_t    replyTimeout        (GenieContext *ctx, uint8_t slot, uint16_t bytes);
+static void        rttSample           (GenieContext *ctx, GeniePendingCommand *pc, int result, uint32_t now);
+static void        queueCommand        (GenieContext *ctx, uint8_t cmd, uint8_t object,
+                                        uint8_t index, uint16_t value, uint8_t expect);
+static void        completeCommand     (GenieContext *ctx, int result, uint16_t value);
+static void        frameBegin          (GenieContext *ctx, uint8_t cmd);
+static void        framePut            (GenieContext *ctx, uint8_t c);
+static void        frameEnd            (GenieContext *ctx);
+static void        framePutBytes       (GenieContext *ctx, const uint8_t *bytes, uint16_t len);
+static void        framePutShorts      (GenieContext *ctx, const uint16_t *shorts, uint16_t len);
+static uint8_t     xorBytes            (const uint8_t *bytes, uint16_t len);
+static uint16_t    writeMagicV         (GenieContext *ctx, uint8_t cmd, uint16_t index,
+                                        const GenieMagicVec *vec, uint8_t count);
+static uint16_t    writeStrDecimal     (GenieContext *ctx, uint16_t index, bool negative, uint32_t n,
+                                        uint8_t scale, uint8_t digits);
+static uint8_t     decimalLength       (uint32_t n);
+static uint8_t     utf8Decode          (const uint8_t *s, const uint8_t *end, uint16_t *c);
+static bool        utf8Length          (const uint8_t *s, uint16_t len, uint16_t *chars);
+static void        utf8Put             (GenieContext *ctx, const uint8_t *s, uint16_t len);
+static void        txFlush             (GenieContext *ctx);
+static void        txWrite             (GenieContext *ctx, const uint8_t *bytes, uint16_t len);
+static GenieShadowEntry *shadowFind    (GenieContext *ctx, uint8_t object, uint8_t index, bool insert);
+static void        shadowCompleted     (GenieContext *ctx, GeniePendingCommand *pc, int result);
+static void        shadowReported      (GenieContext *ctx, uint8_t * data);
+static void        readCacheStore      (GenieContext *ctx, uint8_t object, uint8_t index, uint16_t value,
+                                        bool insert);
+static void        readCacheForget     (GenieContext *ctx, uint8_t object, uint8_t index);
+static bool        readCacheLookup     (GenieContext *ctx, uint8_t object, uint8_t index, uint16_t *value);
+static GenieScheduleEntry *scheduleFind (GenieContext *ctx, uint8_t object, uint8_t index);
+static bool        scheduleWrite       (GenieContext *ctx, uint8_t object, uint8_t index, uint16_t data);
+static void        budgetRefill        (GenieContext *ctx, uint32_t now);
+static bool        dispatchEvent       (GenieContext *ctx);
+static void        fatalError          (GenieContext *ctx);
+static void        flushSerialInput    (GenieContext *ctx);
+static void        resync              (GenieContext *ctx);
+static void        relock              (GenieContext *ctx);
+static void        frameReceived       (GenieContext *ctx);
+static bool        reportAnswers       (GenieContext *ctx);
+#if (GENIE_TRACE_SIZE > 0)
+static GenieTraceRecord *traceNext     (GenieContext *ctx, uint8_t kind, uint32_t now);
+static void        traceBytes          (GenieContext *ctx, uint8_t kind, const uint8_t *bytes, uint16_t len);
+static void        traceState          (GenieContext *ctx, uint16_t before);
+
+// tracing costs a flag test when it is compiled in but switched off
+#define TRACE_BYTES(ctx, kind, bytes, len)  do { if ((ctx)->traceOn) traceBytes(ctx, kind, bytes, len); } while (0)
+#define TRACE_STATE_BEGIN(ctx)              uint16_t traceBefore = getLinkState(ctx)
+#define TRACE_STATE_END(ctx)                do { if ((ctx)->traceOn) traceState(ctx, traceBefore); } while (0)
+#else
+#define TRACE_BYTES(ctx, kind, bytes, len)
+#define TRACE_STATE_BEGIN(ctx)
+#define TRACE_STATE_END(ctx)
+#endif
 
-void genieInitWithConfig(UserApiConfig *config) {
+/* Two decimal digits for each of 0 to 99, see writeStrDecimal */
+static const char digitPairs[201] =
+    "0001020304050607080910111213141516171819"
+    "2021222324252627282930313233343536373839"
+    "4041424344454647484950515253545556575859"
+    "6061626364656667686970717273747576777879"
+    "8081828384858687888990919293949596979899";
+
+static const uint32_t powersOfTen[10] = {
+    1u, 10u, 100u, 1000u, 10000u, 100000u, 1000000u, 10000000u, 100000000u, 1000000000u
+};
+
+/* The default context backs the original single display API. Its handlers
+   take no arguments, so they are kept here and called through trampolines. */
+static GenieContext        defaultContext;
+static UserEventHandlerPtr UserHandler;
+static UserBytePtr         UserByteReader;
+static UserDoubleBytePtr   UserDoubleByteReader;
+static GenieHandlerEntry   defaultHandlers[GENIE_DEFAULT_HANDLERS];
+
+void genieCtxInitWithConfig(GenieContext *ctx, UserApiConfig *config) {
+
+    ctx->UserHandler = NULL;
+    ctx->UserByteReader = NULL;
+    ctx->UserDoubleByteReader = NULL;
+    ctx->UserMagicReader = NULL;
+    ctx->magicUserData = NULL;
+    ctx->debugSerial = NULL;
+    ctx->UserCompletion = NULL;
+    ctx->rxState = GENIE_LINK_IDLE;
+    ctx->Pending.rd_index = 0;
+    ctx->Pending.wr_index = 0;
+    ctx->Pending.n_pending = 0;
+    ctx->window = 1;
+    ctx->nextId = 0;
+    ctx->txLen = 0;
+    ctx->txChecksum = 0;
+    ctx->txHold = false;
+    ctx->address = 0;
+    ctx->bus = NULL;
+    ctx->rxHead = 0;
+    ctx->rxLen = 0;
+    ctx->rxFrames = 0;
+    ctx->txFlushes = 0;
+    ctx->syncWaiting = false;
+    ctx->readMaxAge = 0;
+#if (GENIE_READ_CACHE_SIZE > 0)
+    ctx->readCacheCount = 0;
+#endif
+    memset(ctx->rtt, 0, sizeof(ctx->rtt));
+    genieCtxSetTimeoutLimits(ctx, GENIE_RTO_FLOOR, TIMEOUT_PERIOD);
+    ctx->lastReplyMicros = 0;
+    ctx->rttSkip = false;
+#if (GENIE_TRACE_SIZE > 0)
+    genieCtxTraceEnable(ctx, false);
+#endif
+#if (GENIE_RX_RING_SIZE > 0)
+    ctx->useRing = false;
+    ctx->ringHead = 0;
+    ctx->ringTail = 0;
+    ctx->ringHighWater = 0;
+    ctx->ringOverflows = 0;
+#endif
+    genieCtxAttachShadow(ctx, NULL, 0);
+    genieCtxAttachDispatchTable(ctx, NULL, 0);
+    ctx->scheduling = false;
+    genieCtxAttachScheduler(ctx, NULL, 0, 0, 0);
+    ctx->Timeout = TIMEOUT_PERIOD;
+    ctx->Error = ERROR_NONE;
+    ctx->rxframe_count = 0;
+    ctx->checksum = 0;
+    ctx->replayHead = 0;
+    ctx->replayLen = 0;
+    ctx->recovering = false;
+    ctx->magicByte = 0;
+    ctx->magicLeft = 0;
+    ctx->FatalErrors = 0;
+    memset(&ctx->stats, 0, sizeof(ctx->stats));
+    ctx->deviceSerial = config;
+    ctx->EventQueue.high_water = 0;
+    ctx->EventQueue.coalesced = 0;
+    ctx->EventQueue.overflows = 0;
+    ctx->Unhandled.high_water = 0;
+    ctx->Unhandled.coalesced = 0;
+    ctx->Unhandled.overflows = 0;
+    flushEventQueue(ctx);
+}
 
-    UserHandler = NULL;
-    UserByteReader = NULL;
-    UserDoubleByteReader = NULL;
-    debugSerial = NULL;
-    LinkStates[0] = GENIE_LINK_IDLE;
-    LinkState = &LinkStates[0];
-    Timeout = TIMEOUT_PERIOD;
-    Error = ERROR_NONE;
-    rxframe_count = 0;
-    FatalErrors = 0;
-    deviceSerial = config;
-    pushLinkState(GENIE_LINK_IDLE);
-    flushEventQueue();
+void genieCtxAssignDebugPort(GenieContext *ctx, UserApiConfig *config) {
+    ctx->debugSerial = config;
 }
 
-void genieAssignDebugPort(UserApiConfig *config) {
-    debugSerial = config;
+/////////////////////// genieDefaultContext ////////////////////////
+//
+// Returns the context used by the functions that do not take one,
+// so code written for a single display can be mixed with the
+// context API.
+//
+GenieContext *genieDefaultContext(void) {
+    return &defaultContext;
 }
 
 ////////////////////// GetEventData ////////////////////////
@@ -121,11 +258,26 @@ uint16_t genieGetEventData (GenieFrame * e) {
 //
 // Read one byte from the serial device.  Blocking.
 //
-uint8_t genieGetNextByte() {
-    while (deviceSerial->available() < 1) {
-        continue;
+uint8_t genieCtxGetNextByte(GenieContext *ctx) {
+    uint8_t c;
+
+    for (;;) {
+        c = getchar(ctx);
+
+        if (ctx->Error != ERROR_NOCHAR) {
+            break;
+        }
+
+        waitForPort(ctx, ctx->Timeout);
+    }
+
+    // a byte or double byte reader is taking a magic report's
+    // payload, which still has to add up
+    if (ctx->magicByte == 3 && (ctx->rxState == GENIE_LINK_RXMBYTES || ctx->rxState == GENIE_LINK_RXMDBYTES)) {
+        ctx->magicChecksum ^= c;
     }
-    return deviceSerial->read();
+
+    return c;
 }
 
 //////////////////////// genieGetNextDoubleByte ///////////////////////////
@@ -133,13 +285,10 @@ uint8_t genieGetNextByte() {
 // Reads two bytes from the serial device and joins them into one
 // double byte.  Blocking.
 //
-uint16_t genieGetNextDoubleByte(void) {
+uint16_t genieCtxGetNextDoubleByte(GenieContext *ctx) {
     uint16_t out;
-    while (deviceSerial->available() < 1) {
-        continue;
-    }
-    out = (deviceSerial->read()) << 8;
-    out |= deviceSerial->read();
+    out = genieCtxGetNextByte(ctx) << 8;
+    out |= genieCtxGetNextByte(ctx);
     return out;
 }
 
@@ -151,81 +300,454 @@ uint16_t genieGetNextDoubleByte(void) {
 // Returns:     TRUE if all the fields match the caller's parms
 //              FALSE if any of them don't
 //
-static bool eventIs(GenieFrame * e, uint8_t cmd, uint8_t object, uint8_t index) {
+bool genieEventIs(GenieFrame * e, uint8_t cmd, uint8_t object, uint8_t index) {
     return (e->reportObject.cmd == cmd &&
             e->reportObject.object == object &&
             e->reportObject.index == index);
 }
 
-////////////////////// Genie::WaitForIdle ////////////////////////
+////////////////////// Genie::WaitForWindow ////////////////////////
 //
-// Wait for the link to become idle or for the timeout period,
-// whichever comes first.
+// Wait until no more than maxPending commands are waiting for a
+// reply. If the oldest command gets no reply within its timeout,
+// see replyTimeLeft, it is completed with ERROR_TIMEOUT and the
+// wait goes on for the next one.
 //
-static void waitForIdle (void) {
-    uint16_t do_event_result;
-    long timeout = deviceSerial->millis() + Timeout;
+static void waitForWindow (GenieContext *ctx, uint8_t maxPending) {
+    uint32_t start = ctx->deviceSerial->millis();
+    uint32_t left;
+    bool nochar;
 
-    for ( ; deviceSerial->millis() < timeout;) {
-        do_event_result = genieDoEvents(false);
+    if (ctx->Pending.n_pending <= maxPending) {
+        return;
+    }
 
-        // if there was a character received from the
-        // display restart the timeout because doEvents
-        // is in the process of receiving something
-        if (do_event_result == GENIE_EVENT_RXCHAR) {
-            timeout = deviceSerial->millis() + Timeout;
+    // commands still sitting in the transmit buffer will never
+    // be answered, send them before waiting
+    txFlush(ctx);
+
+    while (ctx->Pending.n_pending > maxPending) {
+        genieCtxDoEvents(ctx, false);
+        nochar = (ctx->Error == ERROR_NOCHAR);
+
+        // the deadline is checked between frames, so events
+        // streaming in can't hold off the timeout for ever
+        if (ctx->Pending.n_pending > maxPending && (nochar || ctx->rxState == GENIE_LINK_IDLE)) {
+            left = replyTimeLeft(ctx);
+
+            if (left == 0) {
+                // the oldest reply is lost, the display is not
+                // going to answer it now
+                replyTimedOut(ctx);
+            } else if (nochar) {
+                // nothing to do until the display answers
+                waitForPort(ctx, left);
+            }
         }
+    }
 
-        if (getLinkState() == GENIE_LINK_IDLE) {
-            return;
+    ctx->stats.blockedMillis += ctx->deviceSerial->millis() - start;
+}
+
+////////////////////// Genie::replyTimeLeft ////////////////////////
+//
+// The display works through commands one at a time, so the clock
+// for the oldest command starts when it was sent or when the one
+// before it was answered, whichever is later. Replies to earlier
+// commands and events coming in don't restart it.
+//
+// Returns: milliseconds until the oldest command is overdue,
+//              rounded up, or 0 if it already is
+//
+static uint32_t replyTimeLeft (GenieContext *ctx) {
+    GeniePendingCommand *pc = &ctx->Pending.cmds[ctx->Pending.rd_index];
+    uint32_t from = pc->sentMicros;
+    uint32_t elapsed, timeout;
+
+    if ((int32_t)(ctx->lastReplyMicros - from) > 0) {
+        from = ctx->lastReplyMicros;
+    }
+
+    elapsed = nowMicros(ctx) - from;
+    timeout = replyTimeout(ctx, rttSlot(pc->cmd, pc->object), commandBytes(pc->cmd, pc->value));
+
+    return (elapsed >= timeout) ? 0 : (timeout - elapsed + 999) / 1000;
+}
+
+////////////////////// Genie::replyTimedOut ////////////////////////
+//
+// Give up on the oldest command.
+//
+static void replyTimedOut (GenieContext *ctx) {
+    ctx->rxState = GENIE_LINK_IDLE;
+    completeCommand(ctx, ERROR_TIMEOUT, 0);
+    ctx->Error = ERROR_TIMEOUT;
+    handleError(ctx);
+}
+
+/////////////////////// CheckTimeout ////////////////////////
+//
+// Give up on commands whose reply is overdue, as the library does
+// while it waits for the window, for a loop that blocks on the
+// port itself instead, such as an I/O thread.
+//
+// Returns: milliseconds until the oldest command still waiting is
+//              overdue, or TIMEOUT_PERIOD if none is
+//
+uint32_t genieCtxCheckTimeout(GenieContext *ctx) {
+    uint32_t left;
+
+    while (ctx->Pending.n_pending > 0 && ctx->rxState == GENIE_LINK_IDLE) {
+        left = replyTimeLeft(ctx);
+
+        if (left > 0) {
+            return left;
+        }
+
+        replyTimedOut(ctx);
+    }
+
+    return TIMEOUT_PERIOD;
+}
+
+/////////////////////// SetTimeoutLimits ////////////////////////
+//
+// Bound the reply timeouts. With UserApiConfig.micros set each
+// timeout is the measured round trip plus four times its mean
+// deviation, as TCP works out its retransmit timer, but never
+// less than floorMillis or more than ceilingMillis. Without it,
+// or before anything has been measured, it is ceilingMillis.
+//
+void genieCtxSetTimeoutLimits(GenieContext *ctx, uint16_t floorMillis, uint16_t ceilingMillis) {
+    ctx->rtoFloor = (uint32_t)floorMillis * 1000;
+    ctx->rtoCeiling = (uint32_t)ceilingMillis * 1000;
+
+    if (ctx->rtoFloor > ctx->rtoCeiling) {
+        ctx->rtoFloor = ctx->rtoCeiling;
+    }
+}
+
+/////////////////////// GetReplyTimeout ////////////////////////
+//
+// Parms:   cmd, GENIE_WRITE_OBJ, GENIE_WRITE_STR, ...
+//          len, characters or bytes for the commands that carry
+//              them, else ignored
+//
+// Returns: how long the reply to such a command would now be
+//              waited for, in microseconds
+//
+uint32_t genieCtxGetReplyTimeout(GenieContext *ctx, uint8_t cmd, uint16_t len) {
+    return replyTimeout(ctx, rttSlot(cmd, 0), commandBytes(cmd, len));
+}
+
+////////////////////// Genie::replySkipped ////////////////////////
+//
+// The display answers in order, so a reply of the kind the second
+// command expects, but not the first, means the first one's reply
+// was lost. Time it out now rather than wait for the clock.
+//
+// Returns: TRUE if the oldest command was given up on
+//
+static bool replySkipped (GenieContext *ctx, uint8_t expect) {
+    PendingQueueStruct *q = &ctx->Pending;
+
+    if (q->n_pending < 2 || q->cmds[(q->rd_index + 1) & (GENIE_MAX_PENDING - 1)].expect != expect) {
+        return false;
+    }
+
+    replyTimedOut(ctx);
+    return true;
+}
+
+////////////////////// Genie::nowMicros ////////////////////////
+//
+// Returns: UserApiConfig.micros(), or millis() in microseconds
+//              if there is none
+//
+static uint32_t nowMicros (GenieContext *ctx) {
+    if (ctx->deviceSerial->micros != NULL) {
+        return ctx->deviceSerial->micros();
+    }
+
+    return ctx->deviceSerial->millis() * 1000;
+}
+
+////////////////////// Genie::commandBytes ////////////////////////
+//
+// Returns: the length of a command on the wire, checksum included
+//
+static uint16_t commandBytes (uint8_t cmd, uint16_t len) {
+    switch (cmd) {
+        case GENIE_READ_OBJ:        return 4;
+        case GENIE_WRITE_OBJ:       return 6;
+        case GENIE_WRITE_CONTRAST:  return 3;
+        case GENIE_WRITE_STRU:
+        case GENIEM_WRITE_DBYTES:   return 4 + len * 2;
+        default:                    return 4 + len;
+    }
+}
+
+////////////////////// Genie::rttSlot ////////////////////////
+//
+static uint8_t rttSlot (uint8_t cmd, uint8_t object) {
+    if (cmd >= GENIE_STATS_COMMANDS || (cmd == GENIE_WRITE_OBJ && object == GENIE_OBJ_FORM)) {
+        return GENIE_RTT_FORM;
+    }
+
+    return cmd;
+}
+
+////////////////////// Genie::replyTimeout ////////////////////////
+//
+// Returns: microseconds to wait for the reply to a command of
+//              bytes bytes, see genieCtxSetTimeoutLimits
+//
+static uint32_t replyTimeout (GenieContext *ctx, uint8_t slot, uint16_t bytes) {
+    GenieRtt *r = &ctx->rtt[slot];
+    uint32_t perByte;
+
+    if (ctx->deviceSerial->micros == NULL || r->srtt == 0) {
+        return ctx->rtoCeiling;
+    }
+
+    perByte = (r->srtt >> 3) + r->rttvar;
+
+    if (perByte >= ctx->rtoCeiling / bytes) {
+        return ctx->rtoCeiling;
+    }
+
+    perByte *= bytes;
+    return (perByte < ctx->rtoFloor) ? ctx->rtoFloor : perByte;
+}
+
+////////////////////// Genie::rttSample ////////////////////////
+//
+// Fold the time the display took over the command just completed
+// into the estimate for its kind, with the gains TCP uses: 1/8
+// for the mean and 1/4 for the deviation. A timeout doubles the
+// estimate instead, in case the display really has slowed down,
+// and the reply after it isn't timed as it may be the late one.
+//
+static void rttSample (GenieContext *ctx, GeniePendingCommand *pc, int result, uint32_t now) {
+    GenieRtt *r = &ctx->rtt[rttSlot(pc->cmd, pc->object)];
+    uint16_t bytes = commandBytes(pc->cmd, pc->value);
+    uint32_t from = pc->sentMicros;
+    int32_t sample, delta;
+
+    if ((int32_t)(ctx->lastReplyMicros - from) > 0) {
+        from = ctx->lastReplyMicros;
+    }
+
+    ctx->lastReplyMicros = now;
+
+    if (ctx->deviceSerial->micros == NULL || result == ERROR_RESYNC) {
+        return;
+    }
+
+    if (result == ERROR_TIMEOUT) {
+        // once for a run of timeouts, the ones after the first are
+        // usually replies lost behind it
+        if (!ctx->rttSkip && r->srtt != 0 && (r->srtt >> 3) < ctx->rtoCeiling / bytes) {
+            r->srtt <<= 1;
         }
+
+        ctx->rttSkip = true;
+        return;
+    }
+
+    if (ctx->rttSkip) {
+        ctx->rttSkip = false;
+        return;
+    }
+
+    // a whole microsecond a byte at least, so srtt 0 means unmeasured
+    sample = (int32_t)((now - from) / bytes) + 1;
+
+    if (r->srtt == 0) {
+        r->srtt = (uint32_t)sample << 3;
+        r->rttvar = (uint32_t)sample << 1;
+    } else {
+        delta = sample - (int32_t)(r->srtt >> 3);
+        r->srtt += delta;
+        delta = (delta < 0) ? -delta : delta;
+        r->rttvar += delta - (int32_t)(r->rttvar >> 2);
+    }
+}
+
+////////////////////// Genie::waitForPort ////////////////////////
+//
+// Nothing has arrived, let the transport block for a while rather
+// than have the caller spin, if it knows how to.
+//
+static void waitForPort (GenieContext *ctx, uint32_t maxMillis) {
+    if (ctx->deviceSerial->waitPort != NULL) {
+        ctx->deviceSerial->waitPort(ctx->deviceSerial->port, maxMillis);
+    }
+}
+
+////////////////////// Genie::queueCommand //////////////////////
+//
+// Record a command that has just been sent at the back of the
+// FIFO of expected replies. The display answers commands in the
+// order it receives them, so replies are matched from the front.
+//
+// Parms:   expect, GENIE_LINK_WFAN for commands answered with an
+//              ACK or NAK, GENIE_LINK_WF_RXREPORT for a read
+//
+static void queueCommand (GenieContext *ctx, uint8_t cmd, uint8_t object,
+                          uint8_t index, uint16_t value, uint8_t expect) {
+    PendingQueueStruct *q = &ctx->Pending;
+    GeniePendingCommand *pc;
+    TRACE_STATE_BEGIN(ctx);
+
+    if (q->n_pending >= GENIE_MAX_PENDING) {
+        resync(ctx);
+    }
+
+    pc = &q->cmds[q->wr_index];
+    pc->id = ctx->nextId++;
+    pc->flags = (ctx->txLen > 0) ? GENIE_PENDING_HELD : 0;
+    pc->cmd = cmd;
+    pc->object = object;
+    pc->index = index;
+    pc->expect = expect;
+    pc->value = value;
+    pc->sent = ctx->deviceSerial->millis();
+    pc->sentMicros = nowMicros(ctx);
+
+    // nothing ahead of it, the display can start on it straight away
+    if (q->n_pending == 0) {
+        ctx->lastReplyMicros = pc->sentMicros;
+    }
+
+    q->wr_index++;
+    q->wr_index &= GENIE_MAX_PENDING - 1;
+    q->n_pending++;
+
+    if (cmd < GENIE_STATS_COMMANDS) {
+        ctx->stats.sent[cmd]++;
     }
 
-    Error = ERROR_TIMEOUT;
-    handleError();
-    return;
+    TRACE_STATE_END(ctx);
 }
 
-////////////////////// Genie::pushLinkState //////////////////////
+
+////////////////////// Genie::completeCommand //////////////////////
+//
+// Remove the oldest command from the FIFO of expected replies and
+// tell the user's completion handler how it went.
 //
-// Push a link state onto a FILO stack
+// Parms:   result, ERROR_NONE, ERROR_NAK, ERROR_TIMEOUT,
+//              ERROR_BAD_CS or ERROR_RESYNC
+//          value, the reported value for a read, else ignored
 //
-int linkCount = 0;
-static void pushLinkState (uint8_t newstate) {
-    if (linkCount >= MAX_LINK_STATES) {
-        resync();
+static void completeCommand (GenieContext *ctx, int result, uint16_t value) {
+    PendingQueueStruct *q = &ctx->Pending;
+    GeniePendingCommand *pc;
+    TRACE_STATE_BEGIN(ctx);
+
+    if (q->n_pending == 0) {
+        return;
+    }
+
+    pc = &q->cmds[q->rd_index];
+    q->rd_index++;
+    q->rd_index &= GENIE_MAX_PENDING - 1;
+    q->n_pending--;
+    rttSample(ctx, pc, result, nowMicros(ctx));
+
+    if (pc->expect == GENIE_LINK_WF_RXREPORT && result == ERROR_NONE) {
+        pc->value = value;
+    }
+
+    TRACE_STATE_END(ctx);
+    shadowCompleted(ctx, pc, result);
+
+    // an ACKed write is what the object now shows, anything else
+    // leaves it in doubt
+    if (pc->cmd == GENIE_WRITE_OBJ) {
+        if (result == ERROR_NONE) {
+            readCacheStore(ctx, pc->object, pc->index, pc->value, false);
+        } else {
+            readCacheForget(ctx, pc->object, pc->index);
+        }
     }
 
-    linkCount++;
-    LinkState++;
-    //if (debugSerial) { *debugSerial << " newstate = " << newstate << " LinkState count = " << linkCount << ", Freemem = " << freeRam() << ", " << (unsigned long)&LinkState[0] << ", rxframe_count = " << rxframe_count << endl; } ;
-    setLinkState(newstate);
+    if (ctx->syncWaiting && pc->id == ctx->syncId) {
+        ctx->syncWaiting = false;
+        ctx->syncResult = result;
+        ctx->syncValue = pc->value;
+    }
+
+    if (ctx->UserCompletion != NULL) {
+        ctx->UserCompletion(ctx, pc, result);
+    }
 }
 
-////////////////////// Genie::popLinkState //////////////////////
+/////////////////////// SetWindow ////////////////////////
 //
-// Pop a link state from a FILO stack
+// Set how many commands may be sent before the first of them has
+// been answered. 1, the default, waits for every ACK before the
+// next command goes out. Larger values keep the link busy and
+// should match the SndBuf setting of the Workshop4 project.
 //
-static void popLinkState (void) {
-    //if (debugSerial) { *debugSerial << "popLinkState\n"; }
-    if (LinkState > &LinkStates[0]) {
-        *LinkState = 0xFF;
-        LinkState--;
-        linkCount--;
+void genieCtxSetWindow(GenieContext *ctx, uint8_t window) {
+    if (window < 1) {
+        window = 1;
+    } else if (window > GENIE_MAX_PENDING) {
+        window = GENIE_MAX_PENDING;
     }
+
+    ctx->window = window;
+}
+
+/////////////////////// WaitIdle ////////////////////////
+//
+// Wait until every command sent so far has been answered or has
+// timed out.
+//
+void genieCtxWaitIdle(GenieContext *ctx) {
+    waitForWindow(ctx, 0);
+}
+
+/////////////////////// PendingCount ////////////////////////
+//
+// Returns the number of commands still waiting for a reply.
+//
+uint8_t genieCtxPendingCount(GenieContext *ctx) {
+    return ctx->Pending.n_pending;
+}
+
+/////////////////////// LastCommandId ////////////////////////
+//
+// Returns the id given to the most recently sent command, the same
+// id the completion handler sees for it.
+//
+uint16_t genieCtxLastCommandId(GenieContext *ctx) {
+    return (uint16_t)(ctx->nextId - 1);
+}
+
+/////////////////// AttachCompletionHandler //////////////////////
+//
+// "Attaches" a pointer to a user's function that is called as each
+// command is answered, NAKed or given up on.
+//
+void genieCtxAttachCompletionHandler(GenieContext *ctx, GenieCtxCompletionPtr handler) {
+    ctx->UserCompletion = handler;
 }
 
 ///////////////////////// Genie::DoEvents /////////////////////////
 //
 // This is the heart of the Genie comms state machine.
 //
-uint16_t genieDoEvents (bool DoHandler) {
+uint16_t genieCtxDoEvents (GenieContext *ctx, bool DoHandler) {
     uint8_t c;
-    static uint8_t  rx_data[6];
-    static uint8_t  checksum = 0;
-    c = getchar();
-    static struct MagicReportHeader magicHeader;
-    static uint8_t magicByte = 0;
+
+    if (magicSpan(ctx) > 0) {
+        return GENIE_EVENT_RXCHAR;
+    }
+
+    c = getchar(ctx);
 
     //if (debugSerial && c != 0xFD) *debugSerial << _HEX(c)<<", "<<"["<<getLinkState()<<"], ";
     ////////////////////////////////////////////
@@ -233,9 +755,10 @@ uint16_t genieDoEvents (bool DoHandler) {
     // If there are no characters to process and we have
     // queued events call the user's handler function.
     //
-    if (Error == ERROR_NOCHAR) {
-        if ((EventQueue.n_events > 0) && (UserHandler != NULL) && DoHandler) {
-            (UserHandler)();
+    if (ctx->Error == ERROR_NOCHAR) {
+        if (DoHandler) {
+            dispatchEvent(ctx);
+            genieCtxRunScheduler(ctx);
         }
 
         return GENIE_EVENT_NONE;
@@ -244,34 +767,57 @@ uint16_t genieDoEvents (bool DoHandler) {
     //if (debugSerial) { *debugSerial << "Freemem = " << freeRam()<< endl; } ;
     //return GENIE_EVENT_RXCHAR; // debug
 
+    return processByte(ctx, c);
+}
+
+///////////////////////// Genie::processByte /////////////////////////
+//
+// Run one received byte through the state machine.
+//
+static uint16_t processByte (GenieContext *ctx, uint8_t c) {
+    uint16_t state = getLinkState(ctx);
+
+    // a byte given back by relock may only start a report or event
+    // frame, which is then taken only if its checksum holds. An ACK,
+    // NAK or magic report header among them is far more likely part
+    // of the frame that failed than a reply, and acting on one byte
+    // would complete a command or lose the frames behind it
+    if (ctx->replayLen != 0 &&
+        (state == GENIE_LINK_IDLE || state == GENIE_LINK_WFAN || state == GENIE_LINK_WF_RXREPORT) &&
+        c != GENIE_REPORT_EVENT && (c != GENIE_REPORT_OBJ || state != GENIE_LINK_WF_RXREPORT)) {
+        ctx->stats.rxDiscarded++;
+        return GENIE_EVENT_RXCHAR;
+    }
+
     ///////////////////////////////////////////
     //
     // Main state machine
     //
 
-    switch (getLinkState()) {
+    switch (state) {
         case GENIE_LINK_IDLE:
             switch (c) {
                 case GENIE_REPORT_EVENT:
                     // event frame out of the blue, set the link state
                     // and fall through to the frame-accumulate code
                     // at the end of this function
-                    pushLinkState(GENIE_LINK_RXEVENT);
+                    setRxState(ctx, GENIE_LINK_RXEVENT);
                     break;
 
                 case GENIEM_REPORT_BYTES:
-                    magicByte = 0;
-                    pushLinkState(GENIE_LINK_RXMBYTES);
+                    ctx->magicByte = 0;
+                    setRxState(ctx, GENIE_LINK_RXMBYTES);
                     break;
-   
+
                 case GENIEM_REPORT_DBYTES:
-                    magicByte = 0;
-                    pushLinkState(GENIE_LINK_RXMDBYTES);
+                    ctx->magicByte = 0;
+                    setRxState(ctx, GENIE_LINK_RXMDBYTES);
                     break;
 
                 default:
                     // error, bad character, no other character
                     // is acceptable in this state
+                    ctx->stats.rxDiscarded++;
                     return GENIE_EVENT_RXCHAR;
             }
 
@@ -280,35 +826,47 @@ uint16_t genieDoEvents (bool DoHandler) {
         case GENIE_LINK_WFAN:
             switch (c) {
                 case GENIE_ACK:
-                    popLinkState();
+                    frameReceived(ctx);
+                    ctx->stats.acks++;
+                    completeCommand(ctx, ERROR_NONE, 0);
                     return GENIE_EVENT_RXCHAR;
 
                 case GENIE_NAK:
-                    popLinkState();
-                    Error = ERROR_NAK;
-                    handleError();
+                    frameReceived(ctx);
+                    completeCommand(ctx, ERROR_NAK, 0);
+                    ctx->Error = ERROR_NAK;
+                    handleError(ctx);
                     return GENIE_EVENT_RXCHAR;
 
                 case GENIE_REPORT_EVENT:
                     // event frame out of the blue while waiting for an ACK
                     // save/set the link state and fall through to the
                     // frame-accumulate code at the end of this function
-                    pushLinkState(GENIE_LINK_RXEVENT);
+                    setRxState(ctx, GENIE_LINK_RXEVENT);
                     break;
 
                 case GENIEM_REPORT_BYTES:
-                    magicByte = 0;
-                    pushLinkState(GENIE_LINK_RXMBYTES);
+                    ctx->magicByte = 0;
+                    setRxState(ctx, GENIE_LINK_RXMBYTES);
                     break;
-   
+
                 case GENIEM_REPORT_DBYTES:
-                    magicByte = 0;
-                    pushLinkState(GENIE_LINK_RXMDBYTES);
+                    ctx->magicByte = 0;
+                    setRxState(ctx, GENIE_LINK_RXMDBYTES);
                     break;
 
                 case GENIE_REPORT_OBJ:
+                    if (replySkipped(ctx, GENIE_LINK_WF_RXREPORT)) {
+                        setRxState(ctx, GENIE_LINK_RXREPORT);
+                        break;
+                    }
+
+                    ctx->stats.rxDiscarded++;
+                    return GENIE_EVENT_RXCHAR;
+
                 default:
                     // error, bad character
+                    ctx->stats.rxDiscarded++;
                     return GENIE_EVENT_RXCHAR;
             }
 
@@ -321,32 +879,45 @@ uint16_t genieDoEvents (bool DoHandler) {
                     // byte of a report frame
                     // save/set the link state and fall through to the
                     // frame-accumulate code at the end of this function
-                    pushLinkState(GENIE_LINK_RXEVENT);
+                    setRxState(ctx, GENIE_LINK_RXEVENT);
                     break;
 
                 case GENIEM_REPORT_BYTES:
-                    magicByte = 0;
-                    pushLinkState(GENIE_LINK_RXMBYTES);
+                    ctx->magicByte = 0;
+                    setRxState(ctx, GENIE_LINK_RXMBYTES);
                     break;
-   
+
                 case GENIEM_REPORT_DBYTES:
-                    magicByte = 0;
-                    pushLinkState(GENIE_LINK_RXMDBYTES);
+                    ctx->magicByte = 0;
+                    setRxState(ctx, GENIE_LINK_RXMDBYTES);
                     break;
 
                 case GENIE_REPORT_OBJ:
-                    // first byte of a report frame
-                    // replace the GENIE_LINK_WF_RXREPORT link state
-                    // with GENIE_LINK_RXREPORT to indicate that we
-                    // are now receiving a report frame
-                    popLinkState();
-                    pushLinkState(GENIE_LINK_RXREPORT);
+                    // first byte of a report frame, the read stays at
+                    // the front of the FIFO until the whole frame is in
+                    setRxState(ctx, GENIE_LINK_RXREPORT);
                     break;
 
-                case GENIE_ACK:
                 case GENIE_NAK:
+                    // the display didn't take the read, an unknown
+                    // object or a bad checksum
+                    frameReceived(ctx);
+                    completeCommand(ctx, ERROR_NAK, 0);
+                    ctx->Error = ERROR_NAK;
+                    handleError(ctx);
+                    return GENIE_EVENT_RXCHAR;
+
+                case GENIE_ACK:
+                    if (replySkipped(ctx, GENIE_LINK_WFAN)) {
+                        return processByte(ctx, c);
+                    }
+
+                    ctx->stats.rxDiscarded++;
+                    return GENIE_EVENT_RXCHAR;
+
                 default:
                     // error, bad character
+                    ctx->stats.rxDiscarded++;
                     return GENIE_EVENT_RXCHAR;
                     //              break;
             }
@@ -365,76 +936,103 @@ uint16_t genieDoEvents (bool DoHandler) {
     // bytes into a local buffer then queue them as a frame
     // into the event queue
     //
-    if (getLinkState() == GENIE_LINK_RXREPORT ||
-            getLinkState() == GENIE_LINK_RXEVENT) {
-        checksum = (rxframe_count == 0) ? c : checksum ^ c;
-        rx_data[rxframe_count] = c;
+    if (getLinkState(ctx) == GENIE_LINK_RXREPORT ||
+            getLinkState(ctx) == GENIE_LINK_RXEVENT) {
+        ctx->checksum = (ctx->rxframe_count == 0) ? c : ctx->checksum ^ c;
+        ctx->rx_data[ctx->rxframe_count] = c;
 
-        if (rxframe_count == GENIE_FRAME_SIZE - 1) {
+        if (ctx->rxframe_count == GENIE_FRAME_SIZE - 1) {
             // all bytes received, if the CS is good
             // queue the frame and restore the link state
-            if (checksum == 0) {
-                enqueueEvent(rx_data);
-                rxframe_count = 0;
-                // revert the link state to whatever it was before
-                // we started accumulating this frame
-                popLinkState();
+            if (ctx->checksum != 0) {
+                ctx->Error = ERROR_BAD_CS;
+                handleError(ctx);
+                relock(ctx);
                 return GENIE_EVENT_RXCHAR;
-            } else {
-                Error = ERROR_BAD_CS;
-                handleError();
             }
+
+            if (ctx->rxState == GENIE_LINK_RXREPORT && !reportAnswers(ctx)) {
+                // a stray report, perhaps found while relocking,
+                // that doesn't answer the read waiting for one
+                ctx->stats.rxDiscarded += GENIE_FRAME_SIZE;
+                setRxState(ctx, GENIE_LINK_IDLE);
+                return GENIE_EVENT_RXCHAR;
+            }
+
+            frameReceived(ctx);
+            shadowReported(ctx, ctx->rx_data);
+            readCacheStore(ctx, ctx->rx_data[1], ctx->rx_data[2],
+                           (ctx->rx_data[3] << 8) | ctx->rx_data[4], true);
+            // the report for a synchronous read goes straight
+            // to the reader, not to the event queue
+            if (ctx->rxState != GENIE_LINK_RXREPORT ||
+                    !(ctx->Pending.cmds[ctx->Pending.rd_index].flags & GENIE_PENDING_SYNC)) {
+                enqueueEvent(ctx, ctx->rx_data);
+            }
+            ctx->rxframe_count = 0;
+            // a report answers the read at the front of the FIFO
+            if (ctx->rxState == GENIE_LINK_RXREPORT) {
+                completeCommand(ctx, ERROR_NONE,
+                                genieGetEventData((GenieFrame *)ctx->rx_data));
+            }
+            // revert the link state to whatever the FIFO of
+            // expected replies says it is
+            setRxState(ctx, GENIE_LINK_IDLE);
+            return GENIE_EVENT_RXCHAR;
         }
 
-        rxframe_count++;
+        ctx->rxframe_count++;
         return GENIE_EVENT_RXCHAR;
     }
 
     ///////////////////////////////////////////////////////
     // We get here if we are in the process of receiving
-    // a magic report.  When the header has been received
-    // trigger the byte or double-byte handler to receive
-    // the rest of the data.
+    // a magic report. The header is taken a byte at a time,
+    // then the payload is handed to the magic reader as it
+    // comes (magicSpan takes it in runs), then the checksum
+    // settles whether the report was good. Nothing here
+    // waits for bytes that have not arrived.
     //
-    if (getLinkState() == GENIE_LINK_RXMBYTES || 
-        getLinkState() == GENIE_LINK_RXMDBYTES) {
+    if (getLinkState(ctx) == GENIE_LINK_RXMBYTES ||
+        getLinkState(ctx) == GENIE_LINK_RXMDBYTES) {
 
-        switch(magicByte) {
+        switch(ctx->magicByte) {
             case 0:
-                magicHeader.cmd = c;
-                magicByte++;
+                ctx->magicHeader.cmd = c;
+                ctx->magicChecksum = c;
+                ctx->magicByte++;
                 break;
             case 1:
-                magicHeader.index = c;
-                magicByte++;
+                ctx->magicHeader.index = c;
+                ctx->magicChecksum ^= c;
+                ctx->magicByte++;
                 break;
             case 2:
-                magicHeader.length = c;
-                magicByte++;
-                if (magicHeader.cmd == GENIEM_REPORT_BYTES) {
-                    if (UserByteReader != NULL) {
-                        UserByteReader(magicHeader.index, magicHeader.length);
-                    } else {
-                        // No handler defined - we need to sink the bytes.
-                        while (--magicHeader.length > 0) {
-                            (void)genieGetNextByte();
-                        }
-                    }
-                } else if (magicHeader.cmd == GENIEM_REPORT_DBYTES) {
-                    if (UserDoubleByteReader != NULL) {
-                        UserDoubleByteReader(magicHeader.index, magicHeader.length);
-                    } else {
-                        // No handler defined - we need to sink the bytes.
-                        while (--magicHeader.length > 0) {
-                            (void)genieGetNextDoubleByte();
-                        }
+                ctx->magicHeader.length = c;
+                ctx->magicChecksum ^= c;
+                ctx->magicByte++;
+                ctx->magicLeft = (ctx->magicHeader.cmd == GENIEM_REPORT_DBYTES) ? c * 2 : c;
+                ctx->magicOffset = 0;
+
+                // the original readers pull the payload themselves
+                // and block until it is all in
+                if (ctx->UserMagicReader == NULL) {
+                    if (ctx->magicHeader.cmd == GENIEM_REPORT_BYTES && ctx->UserByteReader != NULL) {
+                        ctx->UserByteReader(ctx, ctx->magicHeader.index, ctx->magicHeader.length);
+                        ctx->magicLeft = 0;
+                    } else if (ctx->magicHeader.cmd == GENIEM_REPORT_DBYTES && ctx->UserDoubleByteReader != NULL) {
+                        ctx->UserDoubleByteReader(ctx, ctx->magicHeader.index, ctx->magicHeader.length);
+                        ctx->magicLeft = 0;
                     }
                 }
-                // Now we want to discard the checksum. We don't yet
-                // know what has been going on with the data, so we
-                // can't calculate the checksum.
-                (void)genieGetNextByte();
-                popLinkState();
+                break;
+            default:
+                if (ctx->magicLeft > 0) {
+                    magicPayload(ctx, &c, 1);
+                } else {
+                    ctx->magicChecksum ^= c;
+                    magicEnd(ctx);
+                }
                 break;
         }
         return GENIE_EVENT_RXCHAR;
@@ -452,10 +1050,47 @@ uint16_t genieDoEvents (bool DoHandler) {
 //          The char if there was one to get
 // Sets:    Error with any errors encountered
 //
-static uint8_t getchar() {
-    uint16_t result;
-    Error = ERROR_NONE;
-    return getCharSerial();
+static uint8_t getchar(GenieContext *ctx) {
+    uint8_t c;
+
+    ctx->Error = ERROR_NONE;
+
+    // bytes given back by relock come first, they were counted
+    // and traced the first time round
+    if (ctx->replayHead < ctx->replayLen) {
+        return ctx->replay[ctx->replayHead++];
+    }
+
+    // replayLen stays set until the last of them has been through
+    // processByte, which is how it tells them from new input
+    ctx->replayLen = 0;
+    c = getCharSerial(ctx);
+
+    if (ctx->Error != ERROR_NOCHAR) {
+        ctx->stats.rxBytes++;
+        TRACE_BYTES(ctx, GENIE_TRACE_RX, &c, 1);
+    }
+
+    return c;
+}
+
+////////////////////////// rxRefill //////////////////////////////
+//
+// Refill the empty receive buffer with whatever has arrived, for
+// ports read a block at a time.
+//
+// Returns: the number of bytes now buffered
+//
+static uint16_t rxRefill (GenieContext *ctx) {
+    ctx->rxHead = 0;
+
+    if (ctx->deviceSerial->readPort != NULL) {
+        ctx->rxLen = ctx->deviceSerial->readPort(ctx->deviceSerial->port, ctx->rxBuf, GENIE_RX_BUFFER_SIZE);
+    } else {
+        ctx->rxLen = ctx->deviceSerial->readBuf(ctx->rxBuf, GENIE_RX_BUFFER_SIZE);
+    }
+
+    return ctx->rxLen;
 }
 
 ///////////////////////////////////////////////////////////////////
@@ -463,645 +1098,2869 @@ static uint8_t getchar() {
 // Return ERROR_NOCHAR if no character or the char in the lower
 // byte if there is.
 //
-static uint16_t getCharSerial (void) {
+static uint16_t getCharSerial (GenieContext *ctx) {
 #ifdef SERIAL
 
-    if (deviceSerial->available() == 0) {
-        Error = ERROR_NOCHAR;
+    if (ctx->rxHead < ctx->rxLen) {
+        return ctx->rxBuf[ctx->rxHead++];
+    }
+
+#if (GENIE_RX_RING_SIZE > 0)
+    if (ctx->useRing) {
+        // on a bus, the line is read for every display at once
+        if (ctx->bus != NULL && ctx->ringHead == ctx->ringTail) {
+            busPump(ctx->bus);
+        }
+
+        return ringGet(ctx);
+    }
+#endif
+
+    if (ctx->deviceSerial->readPort != NULL || ctx->deviceSerial->readBuf != NULL) {
+        if (rxRefill(ctx) == 0) {
+            ctx->Error = ERROR_NOCHAR;
+            return ERROR_NOCHAR;
+        }
+
+        return ctx->rxBuf[ctx->rxHead++];
+    }
+
+    if (ctx->deviceSerial->available() == 0) {
+        ctx->Error = ERROR_NOCHAR;
         return ERROR_NOCHAR;
     }
 
-    return (uint16_t) deviceSerial->read() & 0xFF;
+    return (uint16_t) ctx->deviceSerial->read() & 0xFF;
 #endif
   return 0;
 }
 
-
-/////////////////// Genie::fatalError ///////////////////////
+/////////////////////////////////////////////////////////////////////
+// Receive ring
 //
-static void fatalError(void) {
-    if (FatalErrors++ > MAX_GENIE_FATALS) {
-        //      *LinkState = GENIE_LINK_SHDN;
-        //      Error = ERROR_NODISPLAY;
-    }
-}
+// A single producer, single consumer ring between the UART ISR (or
+// DMA complete handler) and the parser. The producer only writes
+// ringHead and the counters, the consumer only writes ringTail, so
+// no locks are needed. Both indexes run freely and are masked on
+// use.
+//
+#if (GENIE_RX_RING_SIZE > 0)
 
-///////////////// Genie::flushSerialInput ///////////////////
+#if defined(__GNUC__) || defined(__clang__)
+#define RING_LOAD_ACQUIRE(p)        __atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define RING_STORE_RELEASE(p, v)    __atomic_store_n((p), (v), __ATOMIC_RELEASE)
+#else
+// single core parts, the indexes are volatile so this is enough
+#define RING_LOAD_ACQUIRE(p)        (*(p))
+#define RING_STORE_RELEASE(p, v)    (*(p) = (v))
+#endif
+
+/////////////////////// RxIsrPush ////////////////////////
+//
+// Add one received byte to the ring. Call from the UART receive
+// interrupt. A byte that does not fit is dropped and counted.
 //
-// Removes and discards all characters from the currently
-// used serial port's Rx buffer.
+// Returns: TRUE if the byte was stored
 //
-static void flushSerialInput(void) {
-    while (deviceSerial->read() >= 0);
+bool genieRxIsrPush(GenieContext *ctx, uint8_t c) {
+    return genieRxIsrPushBytes(ctx, &c, 1) == 1;
 }
 
-/////////////////////// resync //////////////////////////
+/////////////////////// RxIsrPushBytes ////////////////////////
 //
-// This function does nothing for RESYNC_PERIOD to allow the display
-// time to stop talking, then it flushes everything so the link
-// can start again.
+// Add a block of received bytes to the ring, e.g. from a DMA
+// complete handler. Bytes that do not fit are dropped and counted.
 //
-// Untested, will need work I'm sure.
+// Returns: the number of bytes stored
 //
-static void resync (void) {
-    //for (long timeout = userConfig->millis() + RESYNC_PERIOD ; userConfig->millis() < timeout;) {};
-    flushSerialInput();
-    flushEventQueue();
-    linkCount = 0;
-    LinkState = &LinkStates[0];
-    *LinkState = GENIE_LINK_IDLE;
+uint16_t genieRxIsrPushBytes(GenieContext *ctx, const uint8_t *bytes, uint16_t len) {
+    uint16_t head = ctx->ringHead;
+    uint16_t tail = RING_LOAD_ACQUIRE(&ctx->ringTail);
+    uint16_t room = GENIE_RX_RING_SIZE - (uint16_t)(head - tail);
+    uint16_t n = (len < room) ? len : room;
+    uint16_t i, used;
+
+    for (i = 0; i < n; i++) {
+        ctx->ring[(uint16_t)(head + i) & (GENIE_RX_RING_SIZE - 1)] = bytes[i];
+    }
+
+    RING_STORE_RELEASE(&ctx->ringHead, (uint16_t)(head + n));
+
+    used = (uint16_t)(head + n - tail);
+    if (used > ctx->ringHighWater) {
+        ctx->ringHighWater = used;
+    }
+
+    ctx->ringOverflows += len - n;
+    return n;
 }
 
-///////////////////////// handleError /////////////////////////
+/////////////////////// UseRxRing ////////////////////////
 //
-// So far really just a debugging aid, but can be enhanced to
-// help recover from errors.
+// Take received bytes from the ring filled by genieRxIsrPush
+// instead of polling UserApiConfig.available/read.
 //
-static void handleError (void) {
-    //if (debugSerial) { *debugSerial << "Handle Error Called!\n"; }
+void genieCtxUseRxRing(GenieContext *ctx, bool use) {
+    ctx->useRing = use;
 }
 
-////////////////////// Genie::flushEventQueue ////////////////////
+/////////////////////// GetRxRingStats ////////////////////////
 //
-// Reset all the event queue variables and start from scratch.
+// Returns the most bytes the ring has held at once and, through
+// overflows, how many bytes were dropped because it was full.
 //
-static void flushEventQueue(void) {
-    EventQueue.rd_index = 0;
-    EventQueue.wr_index = 0;
-    EventQueue.n_events = 0;
+uint16_t genieCtxGetRxRingStats(GenieContext *ctx, uint32_t *overflows) {
+    if (overflows != NULL) {
+        *overflows = ctx->ringOverflows;
+    }
+
+    return ctx->ringHighWater;
 }
 
-////////////////////// DequeueEvent ///////////////////
+////////////////////// Genie::ringGet ////////////////////////
+//
+// Take one byte from the ring, consumer side.
+//
+static uint16_t ringGet (GenieContext *ctx) {
+    uint16_t tail = ctx->ringTail;
+    uint8_t c;
+
+    if (RING_LOAD_ACQUIRE(&ctx->ringHead) == tail) {
+        ctx->Error = ERROR_NOCHAR;
+        return ERROR_NOCHAR;
+    }
+
+    c = ctx->ring[tail & (GENIE_RX_RING_SIZE - 1)];
+    RING_STORE_RELEASE(&ctx->ringTail, (uint16_t)(tail + 1));
+    return c;
+}
+
+/////////////////////////////////////////////////////////////////////
+// Multidrop bus
+//
+// The displays on a bus share the transport. Whichever context
+// finds its ring empty reads the line for all of them, and each
+// frame is put into the ring of the display whose address comes
+// ahead of it.
+//
+
+/////////////////////// BusInit ////////////////////////
+//
+// Parms:   config, the transport of the shared line
+//          window, commands in flight on the line at once, all
+//              displays together. 1 on a half duplex line, such as
+//              RS-485, where two displays answering at once would
+//              collide.
+//
+void genieBusInit(GenieBus *bus, UserApiConfig *config, uint8_t window) {
+    memset(bus, 0, sizeof(*bus));
+    bus->deviceSerial = config;
+    bus->window = (window < 1) ? 1 : window;
+}
+
+/////////////////////// BusAdd ////////////////////////
+//
+// Initialise ctx for the display at address on the bus. Use it as
+// any other context afterwards, its events and handlers are its own.
+//
+// Parms:   address, the display's Destination in Workshop, 1 to 255
+//
+// Returns: FALSE if the bus is full or the address is taken
+//
+bool genieBusAdd(GenieBus *bus, GenieContext *ctx, uint8_t address) {
+    uint8_t i;
+
+    if (address == 0 || bus->count >= GENIE_BUS_MAX) {
+        return FALSE;
+    }
+
+    for (i = 0; i < bus->count; i++) {
+        if (bus->members[i]->address == address) {
+            return FALSE;
+        }
+    }
+
+    genieCtxInitWithConfig(ctx, bus->deviceSerial);
+    genieCtxUseRxRing(ctx, true);
+    ctx->address = address;
+    ctx->bus = bus;
+    bus->members[bus->count++] = ctx;
+    return TRUE;
+}
+
+/////////////////////// BusDoEvents ////////////////////////
+//
+// genieCtxDoEventsBudget for every display on the bus. Each call
+// starts with the next display along, so when the line is busy the
+// displays take turns at sending what their schedulers hold.
+//
+// Returns: the number of frames completed, all displays together
+//
+uint16_t genieBusDoEvents(GenieBus *bus, bool DoHandler) {
+    uint16_t frames = 0;
+    uint8_t i;
+
+    if (bus->count == 0) {
+        return 0;
+    }
+
+    for (i = 0; i < bus->count; i++) {
+        frames += genieCtxDoEventsBudget(bus->members[(bus->next + i) % bus->count], DoHandler, 0, 0);
+    }
+
+    bus->next = (bus->next + 1) % bus->count;
+    return frames;
+}
+
+/////////////////////// BusGetStats ////////////////////////
+//
+// Copy the bus counters to the caller's structure.
+//
+void genieBusGetStats(GenieBus *bus, GenieBusStats *stats) {
+    *stats = bus->stats;
+}
+
+////////////////////// Genie::busPump ////////////////////////
+//
+// Read what has arrived on the line and route it. Contexts drained
+// from here don't read the line themselves.
+//
+static void busPump (GenieBus *bus) {
+    UserApiConfig *port = bus->deviceSerial;
+
+    if (bus->pumping) {
+        return;
+    }
+
+    bus->pumping = true;
+    bus->rxHead = 0;
+
+    if (port->readPort != NULL) {
+        bus->rxLen = port->readPort(port->port, bus->rxBuf, GENIE_RX_BUFFER_SIZE);
+    } else if (port->readBuf != NULL) {
+        bus->rxLen = port->readBuf(bus->rxBuf, GENIE_RX_BUFFER_SIZE);
+    } else {
+        for (bus->rxLen = 0; bus->rxLen < GENIE_RX_BUFFER_SIZE && port->available(); bus->rxLen++) {
+            bus->rxBuf[bus->rxLen] = (uint8_t)port->read();
+        }
+    }
+
+    while (bus->rxHead < bus->rxLen) {
+        busRoute(bus, bus->rxBuf[bus->rxHead++]);
+    }
+
+    bus->pumping = false;
+}
+
+////////////////////// Genie::busRoute ////////////////////////
+//
+// Pass one byte from the line to the display it came from. Between
+// frames a byte should be an address, anything else is junk. The
+// length of the frame that follows comes from its command byte, or
+// from the length byte of a magic report. The address is taken out
+// of the checksum, the display's parser never sees it.
+//
+static void busRoute (GenieBus *bus, uint8_t c) {
+    GenieContext *m = bus->rxTo;
+    uint8_t i;
+
+    if (m == NULL) {
+        for (i = 0; i < bus->count; i++) {
+            if (bus->members[i]->address == c) {
+                bus->rxTo = bus->members[i];
+                bus->rxGot = 0;
+                bus->rxNeed = 0;
+                return;
+            }
+        }
+
+        bus->stats.junk++;
+        return;
+    }
+
+    if (bus->rxGot == 0) {
+        bus->rxCmd = c;
+
+        switch (c) {
+            case GENIE_REPORT_OBJ:
+            case GENIE_REPORT_EVENT:
+                bus->rxNeed = GENIE_FRAME_SIZE;
+                break;
+
+            case GENIEM_REPORT_BYTES:
+            case GENIEM_REPORT_DBYTES:
+                break;
+
+            default:
+                // ACK, NAK, or something the display's parser will
+                // have to resync after
+                bus->rxNeed = 1;
+                break;
+        }
+    } else if (bus->rxGot == 2 && bus->rxNeed == 0) {
+        bus->rxNeed = 4 + c * ((bus->rxCmd == GENIEM_REPORT_DBYTES) ? 2 : 1);
+    }
+
+    if (++bus->rxGot == bus->rxNeed) {
+        if (bus->rxNeed > 1) {
+            c ^= m->address;
+        }
+
+        bus->rxTo = NULL;
+        bus->stats.frames++;
+    }
+
+    // a display whose ring is full is made to catch up
+    if ((uint16_t)(m->ringHead - m->ringTail) >= GENIE_RX_RING_SIZE) {
+        genieCtxDoEventsBudget(m, false, 0, 0);
+    }
+
+    genieRxIsrPush(m, c);
+}
+
+////////////////////// Genie::busWaitForLine ////////////////////////
+//
+// Wait until the line has room for another command. Every display
+// with commands in flight is kept reading, and timed out, as
+// waitForWindow does for one.
+//
+static void busWaitForLine (GenieBus *bus, GenieContext *ctx) {
+    GenieContext *m;
+    uint32_t left, wait;
+    uint8_t i;
+
+    if (busInFlight(bus) < bus->window) {
+        return;
+    }
+
+    bus->stats.lineWaits++;
+
+    while (busInFlight(bus) >= bus->window) {
+        wait = TIMEOUT_PERIOD;
+
+        for (i = 0; i < bus->count; i++) {
+            m = bus->members[i];
+
+            if (m->Pending.n_pending == 0) {
+                continue;
+            }
+
+            // held in a burst, they would never be answered
+            txFlush(m);
+            genieCtxDoEventsBudget(m, false, 0, 0);
+
+            if (m->Pending.n_pending > 0 && m->rxState == GENIE_LINK_IDLE) {
+                left = replyTimeLeft(m);
+
+                if (left == 0) {
+                    replyTimedOut(m);
+                } else if (left < wait) {
+                    wait = left;
+                }
+            }
+        }
+
+        if (busInFlight(bus) >= bus->window) {
+            waitForPort(ctx, wait);
+        }
+    }
+}
+
+////////////////////// Genie::busInFlight ////////////////////////
+//
+// Returns: commands waiting for a reply, all displays together
+//
+static uint8_t busInFlight (GenieBus *bus) {
+    uint8_t i, n = 0;
+
+    for (i = 0; i < bus->count; i++) {
+        n += bus->members[i]->Pending.n_pending;
+    }
+
+    return n;
+}
+
+#endif
+
+////////////////////////// magicSpan //////////////////////////////
+//
+// While a magic report's payload is coming in, hand the reader a
+// run of it straight out of the receive buffer or ring, rather
+// than a byte at a time through the state machine. Bytes given
+// back by relock go the slow way, there are never many.
+//
+// Returns: the number of payload bytes taken, 0 if there were none
+//              to take this way
+//
+static uint16_t magicSpan (GenieContext *ctx) {
+    uint16_t n;
+
+    if (ctx->magicByte != 3 || ctx->magicLeft == 0 || ctx->replayHead < ctx->replayLen ||
+            (ctx->rxState != GENIE_LINK_RXMBYTES && ctx->rxState != GENIE_LINK_RXMDBYTES)) {
+        return 0;
+    }
+
+#if (GENIE_RX_RING_SIZE > 0)
+    if (ctx->useRing && ctx->rxHead == ctx->rxLen) {
+        uint16_t tail = ctx->ringTail, at = tail & (GENIE_RX_RING_SIZE - 1);
+
+        // up to the end of the array, the rest comes next time
+        n = (uint16_t)(RING_LOAD_ACQUIRE(&ctx->ringHead) - tail);
+        n = (n < GENIE_RX_RING_SIZE - at) ? n : GENIE_RX_RING_SIZE - at;
+        n = (n < ctx->magicLeft) ? n : ctx->magicLeft;
+
+        if (n > 0) {
+            ctx->stats.rxBytes += n;
+            TRACE_BYTES(ctx, GENIE_TRACE_RX, &ctx->ring[at], n);
+            magicPayload(ctx, &ctx->ring[at], n);
+
+            // only now can the ISR have the space back
+            RING_STORE_RELEASE(&ctx->ringTail, (uint16_t)(tail + n));
+        }
+
+        return n;
+    }
+#endif
+
+    if (ctx->rxHead == ctx->rxLen) {
+        if (ctx->deviceSerial->readPort == NULL && ctx->deviceSerial->readBuf == NULL) {
+            return 0;
+        }
+
+        rxRefill(ctx);
+    }
+
+    n = ctx->rxLen - ctx->rxHead;
+    n = (n < ctx->magicLeft) ? n : ctx->magicLeft;
+
+    if (n > 0) {
+        ctx->rxHead += n;
+        ctx->stats.rxBytes += n;
+        TRACE_BYTES(ctx, GENIE_TRACE_RX, &ctx->rxBuf[ctx->rxHead - n], n);
+        magicPayload(ctx, &ctx->rxBuf[ctx->rxHead - n], n);
+    }
+
+    return n;
+}
+
+///////////////////////// magicPayload //////////////////////////////
+//
+// Add some of a magic report's payload to its checksum and hand it
+// to the magic reader, if there is one.
+//
+static void magicPayload (GenieContext *ctx, const uint8_t *data, uint16_t len) {
+    GenieMagicChunk chunk;
+    uint16_t i;
+
+    for (i = 0; i < len; i++) {
+        ctx->magicChecksum ^= data[i];
+    }
+
+    if (ctx->UserMagicReader != NULL) {
+        chunk.header = ctx->magicHeader;
+        chunk.status = GENIE_MAGIC_MORE;
+        chunk.offset = ctx->magicOffset;
+        chunk.len = len;
+        chunk.data = data;
+        ctx->UserMagicReader(ctx, &chunk, ctx->magicUserData);
+    }
+
+    ctx->magicOffset += len;
+    ctx->magicLeft -= len;
+}
+
+/////////////////////////// magicEnd //////////////////////////////
+//
+// The checksum of a magic report has come in. Tell the magic reader
+// whether the report was good and go back to idle.
+//
+static void magicEnd (GenieContext *ctx) {
+    GenieMagicChunk chunk;
+    bool good = (ctx->magicChecksum == 0);
+
+    ctx->magicByte = 0;
+    setRxState(ctx, GENIE_LINK_IDLE);
+
+    if (ctx->UserMagicReader != NULL) {
+        chunk.header = ctx->magicHeader;
+        chunk.status = good ? GENIE_MAGIC_DONE : GENIE_MAGIC_BAD_CS;
+        chunk.offset = ctx->magicOffset;
+        chunk.len = 0;
+        chunk.data = NULL;
+        ctx->UserMagicReader(ctx, &chunk, ctx->magicUserData);
+    }
+
+    if (good) {
+        frameReceived(ctx);
+    } else {
+        // the header, payload and checksum
+        ctx->stats.rxDiscarded += 4 + ctx->magicOffset;
+        ctx->Error = ERROR_BAD_CS;
+        handleError(ctx);
+    }
+}
+
+/////////////////////// DoEventsBudget ////////////////////////
+//
+// Process everything that has been received, not just one byte,
+// but stop after maxBytes bytes or maxMillis milliseconds so the
+// time spent here stays bounded. 0 means no limit. Queued events
+// are then handed to the user's handler as genieCtxDoEvents does.
+//
+// Returns: the number of frames (replies, reports, events and
+//              magic reports) completed during the call
+//
+uint16_t genieCtxDoEventsBudget (GenieContext *ctx, bool DoHandler, uint16_t maxBytes, uint16_t maxMillis) {
+    uint16_t frames = ctx->rxFrames;
+    uint16_t bytes = 0, n;
+    uint32_t start = 0;
+    uint8_t c, n_events;
+
+    if (maxMillis != 0) {
+        start = ctx->deviceSerial->millis();
+    }
+
+    while (maxBytes == 0 || bytes < maxBytes) {
+        if (maxMillis != 0 && (uint32_t)(ctx->deviceSerial->millis() - start) >= maxMillis) {
+            break;
+        }
+
+        n = magicSpan(ctx);
+
+        if (n > 0) {
+            bytes += n;
+            continue;
+        }
+
+        c = getchar(ctx);
+
+        if (ctx->Error == ERROR_NOCHAR) {
+            break;
+        }
+
+        processByte(ctx, c);
+        bytes++;
+    }
+
+    // keep going while the handlers are taking events off the queue
+    if (DoHandler) {
+        while ((n_events = ctx->EventQueue.n_events) > 0) {
+            if (!dispatchEvent(ctx) || ctx->EventQueue.n_events >= n_events) {
+                break;
+            }
+        }
+
+        genieCtxRunScheduler(ctx);
+    }
+
+    return ctx->rxFrames - frames;
+}
+
+
+/////////////////// Genie::fatalError ///////////////////////
+//
+static void fatalError(GenieContext *ctx) {
+    if (ctx->FatalErrors++ > MAX_GENIE_FATALS) {
+        //      *LinkState = GENIE_LINK_SHDN;
+        //      Error = ERROR_NODISPLAY;
+    }
+}
+
+///////////////// Genie::flushSerialInput ///////////////////
+//
+// Removes and discards all characters that have arrived so far,
+// from whichever source the port is read through.
+//
+static void flushSerialInput(GenieContext *ctx) {
+    ctx->replayLen = 0;
+
+    for (;;) {
+        (void)getchar(ctx);
+
+        if (ctx->Error == ERROR_NOCHAR) {
+            break;
+        }
+
+        ctx->stats.rxDiscarded++;
+    }
+}
+
+/////////////////////// resync //////////////////////////
+//
+// Give up on every command still waiting for a reply, when the
+// FIFO of expected replies has lost track of the display. Input
+// that has arrived is discarded, as it answers those commands,
+// but events already queued are kept.
+//
+static void resync (GenieContext *ctx) {
+    ctx->stats.resyncs++;
+    flushSerialInput(ctx);
+    setRxState(ctx, GENIE_LINK_IDLE);
+    ctx->recovering = false;
+    while (ctx->Pending.n_pending > 0) {
+        completeCommand(ctx, ERROR_RESYNC, 0);
+    }
+}
+
+/////////////////////// Genie::relock //////////////////////////
+//
+// A report or event frame failed its checksum, so the receiver is
+// probably out of step with the display: a byte was lost or junk
+// made something look like the start of a frame. Drop the first
+// byte and give the other five back to the state machine, which
+// tries each byte that could start a frame in turn. Only a run
+// of bytes whose checksum holds is taken as a frame, so the next
+// good frame is found without throwing away anything after it.
+//
+// A frame is longer than the bytes given back, so by the time one
+// fails they have all been taken again and there are never more
+// than five to hold. Single byte replies and magic report headers
+// among them are passed over, see processByte.
+//
+static void relock (GenieContext *ctx) {
+    if (!ctx->recovering) {
+        ctx->recovering = true;
+        ctx->recoverStart = ctx->deviceSerial->millis();
+        ctx->stats.recoveries++;
+    }
+
+    // the damaged report for the read at the front answers it,
+    // rather than leave it to time out
+    if (ctx->rxState == GENIE_LINK_RXREPORT && reportAnswers(ctx)) {
+        setRxState(ctx, GENIE_LINK_IDLE);
+        completeCommand(ctx, ERROR_BAD_CS, 0);
+    }
+
+    setRxState(ctx, GENIE_LINK_IDLE);
+    ctx->stats.rxDiscarded++;
+    memcpy(ctx->replay, ctx->rx_data + 1, GENIE_FRAME_SIZE - 1);
+    ctx->replayHead = 0;
+    ctx->replayLen = GENIE_FRAME_SIZE - 1;
+}
+
+/////////////////////// Genie::frameReceived //////////////////////////
+//
+// A whole reply, report, event or magic report has come in. If
+// the receiver had lost its place it has found it again.
+//
+static void frameReceived (GenieContext *ctx) {
+    ctx->rxFrames++;
+
+    if (ctx->recovering) {
+        ctx->recovering = false;
+        ctx->stats.recoveryMillis += ctx->deviceSerial->millis() - ctx->recoverStart;
+    }
+}
+
+/////////////////////// Genie::reportAnswers //////////////////////////
+//
+// Returns: TRUE if the report just received is for the object the
+//              read at the front of the FIFO asked about
+//
+static bool reportAnswers (GenieContext *ctx) {
+    GeniePendingCommand *pc = &ctx->Pending.cmds[ctx->Pending.rd_index];
+
+    return (ctx->rx_data[1] == pc->object && ctx->rx_data[2] == pc->index);
+}
+
+///////////////////////// handleError /////////////////////////
+//
+// So far really just a debugging aid, but can be enhanced to
+// help recover from errors.
+//
+static void handleError (GenieContext *ctx) {
+    //if (debugSerial) { *debugSerial << "Handle Error Called!\n"; }
+#if (GENIE_TRACE_SIZE > 0)
+    if (ctx->traceOn) {
+        GenieTraceRecord *r = traceNext(ctx, GENIE_TRACE_ERROR, ctx->deviceSerial->millis());
+        r->data[0] = (uint8_t)ctx->Error;
+        r->len = 1;
+    }
+#endif
+
+    switch (ctx->Error) {
+        case ERROR_NAK:         ctx->stats.naks++; break;
+        case ERROR_TIMEOUT:     ctx->stats.timeouts++; break;
+        case ERROR_BAD_CS:      ctx->stats.badChecksums++; break;
+        case ERROR_REPLY_OVR:   ctx->stats.eventsDropped++; break;
+        default: break;
+    }
+}
+
+////////////////////// Genie::flushEventQueue ////////////////////
+//
+// Reset all the event queue variables and start from scratch.
+//
+static void flushEventQueue(GenieContext *ctx) {
+    ctx->EventQueue.rd_index = 0;
+    ctx->EventQueue.wr_index = 0;
+    ctx->EventQueue.n_events = 0;
+    memset(ctx->EventQueue.slots, 0, sizeof(ctx->EventQueue.slots));
+    ctx->Unhandled.rd_index = 0;
+    ctx->Unhandled.wr_index = 0;
+    ctx->Unhandled.n_events = 0;
+    memset(ctx->Unhandled.slots, 0, sizeof(ctx->Unhandled.slots));
+}
+
+////////////////////// Genie::eventHash ////////////////////
+//
+// Where the search for a frame's (cmd, object, index) starts in
+// the queue's slot index.
+//
+static uint16_t eventHash(uint8_t * data) {
+    uint32_t key = ((uint32_t)data[0] << 16) | ((uint32_t)data[1] << 8) | data[2];
+    return (uint16_t)((key * 2654435761u) >> 16) & (GENIE_EVENT_INDEX_SIZE - 1);
+}
+
+////////////////////// Genie::eventFind ////////////////////
+//
+// Look a frame's (cmd, object, index) up in the slot index, an
+// open addressed table kept at most half full so searches stay
+// short whatever the queue holds.
+//
+// Returns: the position in the index holding the queued frame
+//              with the same key, or the empty position where it
+//              would go
+//
+static uint16_t eventFind(EventQueueStruct *q, uint8_t * data) {
+    uint16_t h = eventHash(data);
+    GenieFrame *f;
+
+    while (q->slots[h] != 0) {
+        f = &q->frames[q->slots[h] - 1];
+
+        if (f->bytes[0] == data[0] && f->bytes[1] == data[1] && f->bytes[2] == data[2]) {
+            break;
+        }
+
+        h = (h + 1) & (GENIE_EVENT_INDEX_SIZE - 1);
+    }
+
+    return h;
+}
+
+////////////////////// Genie::eventForget ////////////////////
+//
+// Remove a position from the slot index, moving later entries of
+// the same probe run back so no search stops short.
+//
+static void eventForget(EventQueueStruct *q, uint16_t h) {
+    uint16_t j = h, k;
+
+    q->slots[h] = 0;
+
+    for (;;) {
+        j = (j + 1) & (GENIE_EVENT_INDEX_SIZE - 1);
+
+        if (q->slots[j] == 0) {
+            return;
+        }
+
+        k = eventHash(q->frames[q->slots[j] - 1].bytes);
+
+        // leave the entry where it is if its home lies cyclically
+        // in (h, j], otherwise it can fill the gap
+        if ((h <= j) ? (h < k && k <= j) : (h < k || k <= j)) {
+            continue;
+        }
+
+        q->slots[h] = q->slots[j];
+        q->slots[j] = 0;
+        h = j;
+    }
+}
+
+////////////////////// DequeueEvent ///////////////////
 //
 // Copy the bytes from a queued input event to a buffer supplied
-// by the caller.
+// by the caller. Events set aside as no genieCtxOn callback took
+// them come first.
+//
+// Parms:   GenieFrame * buff, a pointer to the user's buffer
+//
+// Returns: TRUE if there was an event to copy
+//          FALSE if not
+//
+bool genieCtxDequeueEvent(GenieContext *ctx, GenieFrame * buff) {
+    return eventTake(&ctx->Unhandled, buff) || eventTake(&ctx->EventQueue, buff);
+}
+
+////////////////////// Genie::eventTake ///////////////////
+//
+// Take the frame at the front of a queue.
+//
+static bool eventTake (EventQueueStruct *q, GenieFrame * buff) {
+    if (q->n_events > 0) {
+        eventForget(q, eventFind(q, q->frames[q->rd_index].bytes));
+        memcpy (buff, &q->frames[q->rd_index],
+                GENIE_FRAME_SIZE);
+        q->rd_index++;
+        q->rd_index &= MAX_GENIE_EVENTS - 1;
+        q->n_events--;
+        return TRUE;
+    }
+
+    return FALSE;
+}
+
+////////////////////// Genie::EnqueueEvent ///////////////////
+//
+// Copy the bytes from a buffer supplied by the caller
+// to the input queue. If a frame for the same cmd, object and
+// index is already queued its data is updated instead, so the
+// user only sees the latest value.
+//
+// Parms:   uint8_t * data, a pointer to the user's data
+//
+// Returns: TRUE if the data was queued or merged
+//          FALSE if not
+// Sets:    ERROR_REPLY_OVR if there was no room in the queue
+//
+static bool enqueueEvent (GenieContext *ctx, uint8_t * data) {
+    return eventPut(ctx, &ctx->EventQueue, data);
+}
+
+////////////////////// Genie::eventPut ///////////////////
+//
+// Queue a frame on q, or merge it into the one for the same cmd,
+// object and index, as EnqueueEvent describes.
+//
+static bool eventPut (GenieContext *ctx, EventQueueStruct *q, uint8_t * data) {
+    uint16_t h = eventFind(q, data);
+
+    if (q->slots[h] != 0) {
+        q->frames[q->slots[h] - 1].reportObject.data_msb = data[3] ;
+        q->frames[q->slots[h] - 1].reportObject.data_lsb = data[4] ;
+        q->coalesced++;
+        return TRUE;
+    }
+
+    if (q->n_events < MAX_GENIE_EVENTS) {
+        memcpy (&q->frames[q->wr_index], data,
+                GENIE_FRAME_SIZE);
+        q->slots[h] = q->wr_index + 1;
+        q->wr_index++;
+        q->wr_index &= MAX_GENIE_EVENTS - 1;
+        q->n_events++;
+
+        if (q->n_events > q->high_water) {
+            q->high_water = q->n_events;
+        }
+        //if (debugSerial) { *debugSerial << "Enque Event " << _HEX(*data) << ", count = " << EventQueue.n_events << endl; }
+        return TRUE;
+    } else {
+        q->overflows++;
+        ctx->Error = ERROR_REPLY_OVR;
+        handleError(ctx);
+        return FALSE;
+    }
+}
+
+/////////////////////// GetEventQueueStats ////////////////////////
+//
+// Copy the event queue counters to the caller's structure, to help
+// choose MAX_GENIE_EVENTS.
+//
+void genieCtxGetEventQueueStats(GenieContext *ctx, GenieQueueStats *stats) {
+    stats->capacity = MAX_GENIE_EVENTS;
+    stats->high_water = ctx->EventQueue.high_water;
+    stats->coalesced = ctx->EventQueue.coalesced + ctx->Unhandled.coalesced;
+    stats->overflows = ctx->EventQueue.overflows + ctx->Unhandled.overflows;
+}
+
+/////////////////////// GetStats ////////////////////////
+//
+// Copy the link counters to the caller's structure, for telemetry
+// to poll. With reset set they start again from zero, so each
+// snapshot covers the time since the last one.
+//
+void genieCtxGetStats(GenieContext *ctx, GenieStats *stats, bool reset) {
+    *stats = ctx->stats;
+    stats->eventHighWater = ctx->EventQueue.high_water;
+    stats->eventsCoalesced = ctx->EventQueue.coalesced + ctx->Unhandled.coalesced;
+
+    if (reset) {
+        memset(&ctx->stats, 0, sizeof(ctx->stats));
+        ctx->EventQueue.high_water = ctx->EventQueue.n_events;
+        ctx->EventQueue.coalesced = 0;
+        ctx->EventQueue.overflows = 0;
+        ctx->Unhandled.coalesced = 0;
+        ctx->Unhandled.overflows = 0;
+    }
+}
+
+#if (GENIE_TRACE_SIZE > 0)
+/////////////////////// TraceEnable ////////////////////////
+//
+// Start or stop recording the wire. Starting clears the ring.
+//
+void genieCtxTraceEnable(GenieContext *ctx, bool on) {
+    ctx->traceOn = false;
+    ctx->traceHead = 0;
+    ctx->traceCount = 0;
+    ctx->traceOn = on;
+}
+
+/////////////////////// TraceRead ////////////////////////
+//
+// Copy the newest records, oldest first, for the caller to save
+// or send somewhere. Stop the trace first if the link is running
+// from an interrupt.
+//
+// Returns: the number of records copied, at most max
+//
+uint16_t genieCtxTraceRead(GenieContext *ctx, GenieTraceRecord *records, uint16_t max) {
+    uint32_t n = ctx->traceCount;
+    uint16_t i, from;
+
+    if (n > GENIE_TRACE_SIZE) {
+        n = GENIE_TRACE_SIZE;
+    }
+
+    if (n > max) {
+        n = max;
+    }
+
+    from = (uint16_t)(ctx->traceHead - n) & (GENIE_TRACE_SIZE - 1);
+
+    for (i = 0; i < n; i++) {
+        records[i] = ctx->trace[(from + i) & (GENIE_TRACE_SIZE - 1)];
+    }
+
+    return (uint16_t)n;
+}
+
+////////////////////// Genie::traceNext ////////////////////////
+//
+// Claim the next record, overwriting the oldest once the ring
+// has wrapped.
+//
+static GenieTraceRecord *traceNext (GenieContext *ctx, uint8_t kind, uint32_t now) {
+    GenieTraceRecord *r = &ctx->trace[ctx->traceHead];
+
+    ctx->traceHead = (ctx->traceHead + 1) & (GENIE_TRACE_SIZE - 1);
+    ctx->traceCount++;
+    r->stamp = now;
+    r->kind = kind;
+    r->len = 0;
+    return r;
+}
+
+////////////////////// Genie::traceBytes ////////////////////////
+//
+// Record bytes on the wire. Bytes going the same way in the same
+// millisecond share records, so a byte at a time from getchar
+// costs no more room than a whole burst.
+//
+static void traceBytes (GenieContext *ctx, uint8_t kind, const uint8_t *bytes, uint16_t len) {
+    uint32_t now = ctx->deviceSerial->millis();
+    GenieTraceRecord *r = &ctx->trace[(ctx->traceHead - 1) & (GENIE_TRACE_SIZE - 1)];
+
+    if (ctx->traceCount == 0 || r->kind != kind || r->stamp != now || r->len == GENIE_TRACE_DATA) {
+        r = traceNext(ctx, kind, now);
+    }
+
+    while (len > 0) {
+        if (r->len == GENIE_TRACE_DATA) {
+            r = traceNext(ctx, kind, now);
+        }
+
+        r->data[r->len++] = *bytes++;
+        len--;
+    }
+}
+
+////////////////////// Genie::traceState ////////////////////////
+//
+// Record a change of link state, if there was one.
+//
+static void traceState (GenieContext *ctx, uint16_t before) {
+    uint16_t after = getLinkState(ctx);
+    GenieTraceRecord *r;
+
+    if (after != before) {
+        r = traceNext(ctx, GENIE_TRACE_STATE, ctx->deviceSerial->millis());
+        r->data[0] = (uint8_t)before;
+        r->data[1] = (uint8_t)after;
+        r->len = 2;
+    }
+}
+#endif
+
+////////////////////// Genie::frameBegin ////////////////////////
+//
+// Start a command. On a bus, wait for room on the line and put the
+// display's address first, so the checksum covers it too.
+//
+static void frameBegin (GenieContext *ctx, uint8_t cmd) {
+#if (GENIE_RX_RING_SIZE > 0)
+    if (ctx->bus != NULL) {
+        busWaitForLine(ctx->bus, ctx);
+    }
+#endif
+
+    if (ctx->address != 0) {
+        framePut(ctx, ctx->address);
+    }
+
+    framePut(ctx, cmd);
+}
+
+////////////////////// Genie::framePut ////////////////////////
+//
+// Add one byte of the command being built to the transmit buffer
+// and to its running checksum. A command that is longer than the
+// buffer is sent in pieces.
+//
+static void framePut (GenieContext *ctx, uint8_t c) {
+    if (ctx->txLen >= GENIE_TX_BUFFER_SIZE) {
+        txFlush(ctx);
+    }
+
+    ctx->txBuf[ctx->txLen++] = c;
+    ctx->txChecksum ^= c;
+}
+
+////////////////////////// framePutBytes //////////////////////////
+//
+// Add a run of bytes to the command being built. A run longer than
+// the transmit buffer is written to the port straight from the
+// caller's memory, unless a burst is being collected.
+//
+static void framePutBytes (GenieContext *ctx, const uint8_t *bytes, uint16_t len) {
+    uint16_t room, n;
+
+    ctx->txChecksum ^= xorBytes(bytes, len);
+
+    if (len > GENIE_TX_BUFFER_SIZE - ctx->txLen && !ctx->txHold &&
+            (ctx->deviceSerial->writePort != NULL || ctx->deviceSerial->writeBuf != NULL)) {
+        txFlush(ctx);
+        txWrite(ctx, bytes, len);
+        return;
+    }
+
+    while (len > 0) {
+        room = GENIE_TX_BUFFER_SIZE - ctx->txLen;
+
+        if (room == 0) {
+            txFlush(ctx);
+            room = GENIE_TX_BUFFER_SIZE;
+        }
+
+        n = (len < room) ? len : room;
+        memcpy(&ctx->txBuf[ctx->txLen], bytes, n);
+        ctx->txLen += n;
+        bytes += n;
+        len -= n;
+    }
+}
+
+////////////////////////// framePutShorts //////////////////////////
+//
+// Add a run of double bytes to the command being built, MSB first.
+// Two are swapped at a time as one 32-bit word. The XOR of the
+// bytes doesn't depend on their order, so the checksum is taken
+// from the words before they are swapped.
+//
+static void framePutShorts (GenieContext *ctx, const uint16_t *shorts, uint16_t len) {
+    uint32_t w, sum = 0;
+    uint16_t n;
+
+    while (len > 0) {
+        if (GENIE_TX_BUFFER_SIZE - ctx->txLen < 4) {
+            txFlush(ctx);
+        }
+
+        for (n = (GENIE_TX_BUFFER_SIZE - ctx->txLen) / 4; n > 0 && len >= 2; n--, len -= 2, shorts += 2) {
+            memcpy(&w, shorts, 4);
+            sum ^= w;
+#if !(defined(__BYTE_ORDER__) && (__BYTE_ORDER__ == __ORDER_BIG_ENDIAN__))
+            w = ((w & 0x00FF00FFu) << 8) | ((w >> 8) & 0x00FF00FFu);
+#endif
+            memcpy(&ctx->txBuf[ctx->txLen], &w, 4);
+            ctx->txLen += 4;
+        }
+
+        if (len == 1) {
+            if (GENIE_TX_BUFFER_SIZE - ctx->txLen < 2) {
+                txFlush(ctx);
+            }
+
+            ctx->txBuf[ctx->txLen++] = *shorts >> 8;
+            ctx->txBuf[ctx->txLen++] = *shorts & 0xFF;
+            sum ^= *shorts;
+            len = 0;
+        }
+    }
+
+    sum ^= sum >> 16;
+    ctx->txChecksum ^= (uint8_t)(sum ^ (sum >> 8));
+}
+
+///////////////////////////// xorBytes /////////////////////////////
+//
+// Returns: the XOR of a run of bytes, taken a 32-bit word at a time
+//
+static uint8_t xorBytes (const uint8_t *bytes, uint16_t len) {
+    uint32_t w, sum = 0;
+
+    for (; len >= 4; len -= 4, bytes += 4) {
+        memcpy(&w, bytes, 4);
+        sum ^= w;
+    }
+
+    while (len-- > 0) {
+        sum ^= *bytes++;
+    }
+
+    sum ^= sum >> 16;
+    return (uint8_t)(sum ^ (sum >> 8));
+}
+
+////////////////////// Genie::frameEnd ////////////////////////
+//
+// Finish the command being built by adding its checksum, then
+// send it unless a burst is being collected.
+//
+static void frameEnd (GenieContext *ctx) {
+    framePut(ctx, ctx->txChecksum);
+    ctx->txChecksum = 0;
+
+    if (!ctx->txHold) {
+        txFlush(ctx);
+    }
+}
+
+////////////////////// Genie::txFlush ////////////////////////
+//
+// Hand everything in the transmit buffer to the transport.
+//
+static void txFlush (GenieContext *ctx) {
+    GeniePendingCommand *pc;
+    uint16_t i;
+
+    if (ctx->txLen == 0) {
+        return;
+    }
+
+    txWrite(ctx, ctx->txBuf, ctx->txLen);
+    ctx->txLen = 0;
+    ctx->txFlushes++;
+
+    // the writes a later one could have updated are gone
+    for (i = 0; ctx->shadowQueued > 0 && i < ctx->shadowCount; i++) {
+        if (ctx->shadow[i].flags & GENIE_SHADOW_QUEUED) {
+            ctx->shadow[i].flags &= ~GENIE_SHADOW_QUEUED;
+            ctx->shadowQueued--;
+        }
+    }
+
+    // commands held for a burst are only on their way now
+    for (i = ctx->Pending.n_pending; i > 0; i--) {
+        pc = &ctx->Pending.cmds[(ctx->Pending.rd_index + i - 1) & (GENIE_MAX_PENDING - 1)];
+
+        if (!(pc->flags & GENIE_PENDING_HELD)) {
+            break;
+        }
+
+        pc->flags &= ~GENIE_PENDING_HELD;
+        pc->sentMicros = nowMicros(ctx);
+    }
+}
+
+////////////////////// Genie::txWrite ////////////////////////
+//
+// Hand bytes to the transport, in one call if the user supplied
+// writePort or writeBuf, else a byte at a time.
+//
+static void txWrite (GenieContext *ctx, const uint8_t *bytes, uint16_t len) {
+    uint16_t i;
+
+    if (ctx->deviceSerial->writePort != NULL) {
+        ctx->deviceSerial->writePort(ctx->deviceSerial->port, bytes, len);
+    } else if (ctx->deviceSerial->writeBuf != NULL) {
+        ctx->deviceSerial->writeBuf(bytes, len);
+    } else {
+        for (i = 0; i < len; i++) {
+            ctx->deviceSerial->write(bytes[i]);
+        }
+    }
+
+    ctx->stats.txBytes += len;
+    TRACE_BYTES(ctx, GENIE_TRACE_TX, bytes, len);
+
+    // everything sent counts against the budget, critical writes too
+    if (ctx->budgetRate != 0) {
+        ctx->budgetTokens -= (int32_t)len * 1000;
+
+        if (ctx->budgetTokens < -(int32_t)ctx->budgetRate * 1000) {
+            ctx->budgetTokens = -(int32_t)ctx->budgetRate * 1000;
+        }
+    }
+}
+
+/////////////////////// BeginBurst ////////////////////////
+//
+// Hold the commands that follow in the transmit buffer instead of
+// sending each one as it is written. genieCtxFlush sends them all
+// in one go. Commands are still sent early if the buffer fills or
+// a writer has to wait for a reply.
+//
+void genieCtxBeginBurst(GenieContext *ctx) {
+    ctx->txHold = true;
+}
+
+/////////////////////// Flush ////////////////////////
+//
+// Send anything held in the transmit buffer and end the burst.
+//
+void genieCtxFlush(GenieContext *ctx) {
+    ctx->txHold = false;
+    txFlush(ctx);
+}
+
+//////////////////////// Genie::ReadObject ///////////////////////
+//
+// Send a read object command to the Genie display. Note that this
+// function does not wait for the reply, that will be read in due
+// course by DoEvents() and subsequently by the user's event
+// handler.
+//
+bool genieCtxReadObject (GenieContext *ctx, uint16_t object, uint16_t index) {
+    // Discard any pending reply frames
+    //flushEventQueue();    // Removed due to preventing more than 2 readObjects being queued
+    waitForWindow(ctx, ctx->window - 1);
+    ctx->Error = ERROR_NONE;
+    frameBegin(ctx, GENIE_READ_OBJ);
+    framePut(ctx, object);
+    framePut(ctx, index);
+    frameEnd(ctx);
+    queueCommand(ctx, GENIE_READ_OBJ, object, index, 0, GENIE_LINK_WF_RXREPORT);
+    return TRUE;
+}
+
+/////////////////////// SetReadMaxAge ////////////////////////
+//
+// Let genieCtxReadObjectSync answer without asking the display when
+// the object's value was reported, sent as an event or ACKed less
+// than maxAge milliseconds ago. The last GENIE_READ_CACHE_SIZE
+// objects reported are remembered, as well as written objects in the
+// shadow table, see genieCtxAttachShadow. 0, the default, always
+// asks the display.
+//
+void genieCtxSetReadMaxAge(GenieContext *ctx, uint32_t maxAge) {
+    ctx->readMaxAge = maxAge;
+}
+
+////////////////////// Genie::readCacheStore ////////////////////////
+//
+// Remember the value an object was confirmed to have. With insert
+// clear only an object already cached is updated. A new object
+// takes the place of the one confirmed longest ago once the cache
+// is full.
+//
+static void readCacheStore (GenieContext *ctx, uint8_t object, uint8_t index, uint16_t value, bool insert) {
+#if (GENIE_READ_CACHE_SIZE > 0)
+    GenieReadCacheEntry *e, *oldest = NULL;
+    uint32_t now;
+    uint8_t i;
+
+    if (ctx->readMaxAge == 0) {
+        return;
+    }
+
+    now = ctx->deviceSerial->millis();
+
+    for (i = 0; i < ctx->readCacheCount; i++) {
+        e = &ctx->readCache[i];
+
+        if (e->object == object && e->index == index) {
+            e->value = value;
+            e->stamp = now;
+            return;
+        }
+
+        if (oldest == NULL || (uint32_t)(now - e->stamp) > (uint32_t)(now - oldest->stamp)) {
+            oldest = e;
+        }
+    }
+
+    if (!insert) {
+        return;
+    }
+
+    e = (ctx->readCacheCount < GENIE_READ_CACHE_SIZE) ? &ctx->readCache[ctx->readCacheCount++] : oldest;
+    e->object = object;
+    e->index = index;
+    e->value = value;
+    e->stamp = now;
+#else
+    (void)ctx; (void)object; (void)index; (void)value; (void)insert;
+#endif
+}
+
+////////////////////// Genie::readCacheForget ////////////////////////
+//
+static void readCacheForget (GenieContext *ctx, uint8_t object, uint8_t index) {
+#if (GENIE_READ_CACHE_SIZE > 0)
+    uint8_t i;
+
+    for (i = 0; i < ctx->readCacheCount; i++) {
+        if (ctx->readCache[i].object == object && ctx->readCache[i].index == index) {
+            ctx->readCache[i] = ctx->readCache[--ctx->readCacheCount];
+            return;
+        }
+    }
+#else
+    (void)ctx; (void)object; (void)index;
+#endif
+}
+
+////////////////////// Genie::readCacheLookup ////////////////////////
+//
+// Returns: TRUE with the cached value if it is younger than the
+//              context's readMaxAge
+//
+static bool readCacheLookup (GenieContext *ctx, uint8_t object, uint8_t index, uint16_t *value) {
+#if (GENIE_READ_CACHE_SIZE > 0)
+    GenieReadCacheEntry *e;
+    uint8_t i;
+
+    for (i = 0; i < ctx->readCacheCount; i++) {
+        e = &ctx->readCache[i];
+
+        if (e->object == object && e->index == index) {
+            if ((uint32_t)(ctx->deviceSerial->millis() - e->stamp) >= ctx->readMaxAge) {
+                return FALSE;
+            }
+
+            *value = e->value;
+            return TRUE;
+        }
+    }
+#else
+    (void)ctx; (void)object; (void)index; (void)value;
+#endif
+    return FALSE;
+}
+
+//////////////////////// ReadObjectSync ///////////////////////
+//
+// Read an object and wait for its value. Other replies and events
+// arriving in the meantime are processed and queued as usual, but
+// the report for this read is not put on the event queue.
+//
+// Parms:   value, where to store the value read
+//          timeout_ms, how long to wait for the report
+//
+// Returns: ERROR_NONE if value was set
+//          ERROR_NAK, ERROR_BAD_CS or ERROR_TIMEOUT if not
+//
+int genieCtxReadObjectSync (GenieContext *ctx, uint16_t object, uint16_t index, uint16_t *value, uint16_t timeout_ms) {
+    GenieShadowEntry *e = NULL;
+    GeniePendingCommand *pc;
+    uint32_t now, start, elapsed, left;
+    uint8_t i;
+
+    if (ctx->readMaxAge != 0 && readCacheLookup(ctx, object, index, value)) {
+        return ERROR_NONE;
+    }
+
+    // only written objects get an entry, reading must not use up
+    // the table
+    if (ctx->shadow != NULL) {
+        e = shadowFind(ctx, object, index, false);
+    }
+
+    if (e != NULL && ctx->readMaxAge != 0 && (e->flags & GENIE_SHADOW_ACKED)) {
+        now = ctx->deviceSerial->millis();
+
+        if ((uint32_t)(now - e->stamp) < ctx->readMaxAge) {
+            *value = e->acked;
+            return ERROR_NONE;
+        }
+    }
+
+    genieCtxReadObject(ctx, object, index);
+    ctx->Pending.cmds[(ctx->Pending.wr_index - 1) & (GENIE_MAX_PENDING - 1)].flags |= GENIE_PENDING_SYNC;
+    ctx->syncId = genieCtxLastCommandId(ctx);
+    ctx->syncWaiting = true;
+    txFlush(ctx);
+
+    start = ctx->deviceSerial->millis();
+
+    while (ctx->syncWaiting) {
+        genieCtxDoEvents(ctx, false);
+        elapsed = (uint32_t)(ctx->deviceSerial->millis() - start);
+
+        if (elapsed >= timeout_ms) {
+            ctx->syncWaiting = false;
+            ctx->stats.blockedMillis += elapsed;
+
+            // a late report is queued as an event, as for any read
+            for (i = 0; i < ctx->Pending.n_pending; i++) {
+                pc = &ctx->Pending.cmds[(ctx->Pending.rd_index + i) & (GENIE_MAX_PENDING - 1)];
+
+                if (pc->id == ctx->syncId) {
+                    pc->flags &= ~GENIE_PENDING_SYNC;
+                    break;
+                }
+            }
+
+            return ERROR_TIMEOUT;
+        }
+
+        if (!ctx->syncWaiting || (ctx->Error != ERROR_NOCHAR && ctx->rxState != GENIE_LINK_IDLE)) {
+            continue;
+        }
+
+        // commands ahead of the read, or the read itself, may
+        // have gone unanswered
+        left = replyTimeLeft(ctx);
+
+        if (left == 0) {
+            replyTimedOut(ctx);
+        } else if (ctx->Error == ERROR_NOCHAR) {
+            waitForPort(ctx, (left < timeout_ms - elapsed) ? left : timeout_ms - elapsed);
+        }
+    }
+
+    ctx->stats.blockedMillis += ctx->deviceSerial->millis() - start;
+
+    if (ctx->syncResult == ERROR_NONE) {
+        *value = ctx->syncValue;
+    }
+
+    return ctx->syncResult;
+}
+
+///////////////////// Genie::SetRxState ////////////////////////
+//
+// Set the receive state of the link to the display.
+//
+// Parms:   uint8_t newstate, GENIE_LINK_IDLE when not in the middle
+//              of a frame, or one of
+//      GENIE_LINK_RXREPORT     3 // receiving a report frame
+//      GENIE_LINK_RXEVENT      4 // receiving an event frame
+//      GENIE_LINK_RXMBYTES     6 // receiving magic bytes
+//      GENIE_LINK_RXMDBYTES    7 // receiving magic dbytes
+//
+static void setRxState (GenieContext *ctx, uint8_t newstate) {
+    TRACE_STATE_BEGIN(ctx);
+
+    ctx->rxState = newstate;
+    TRACE_STATE_END(ctx);
+
+    if (newstate == GENIE_LINK_RXREPORT || \
+            newstate == GENIE_LINK_RXEVENT) {
+        ctx->rxframe_count = 0;
+    }
+}
+
+/////////////////////// Genie::getLinkState //////////////////////
+//
+// Get the current logical state of the link to the display. A
+// frame being received comes first, then the reply expected by
+// the oldest command still outstanding.
+//
+static uint16_t getLinkState (GenieContext *ctx) {
+    if (ctx->rxState != GENIE_LINK_IDLE) {
+        return ctx->rxState;
+    }
+
+    if (ctx->Pending.n_pending > 0) {
+        return ctx->Pending.cmds[ctx->Pending.rd_index].expect;
+    }
+
+    return GENIE_LINK_IDLE;
+}
+
+////////////////////// Genie::shadowFind ////////////////////////
+//
+// Binary search the shadow table, which is kept sorted by object
+// then index.
+//
+// Parms:   insert, add an empty entry if there is none and the
+//              table has room
+//
+// Returns: the entry, or NULL
+//
+static GenieShadowEntry *shadowFind (GenieContext *ctx, uint8_t object, uint8_t index, bool insert) {
+    uint16_t key = (object << 8) | index;
+    uint16_t lo = 0, hi = ctx->shadowCount, mid;
+    GenieShadowEntry *e;
+
+    while (lo < hi) {
+        mid = (lo + hi) >> 1;
+        e = &ctx->shadow[mid];
+
+        if (((e->object << 8) | e->index) < key) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+
+    e = &ctx->shadow[lo];
+
+    if (lo < ctx->shadowCount && e->object == object && e->index == index) {
+        return e;
+    }
+
+    if (!insert || ctx->shadowCount >= ctx->shadowSize) {
+        return NULL;
+    }
+
+    memmove(e + 1, e, (ctx->shadowCount - lo) * sizeof(GenieShadowEntry));
+    ctx->shadowCount++;
+    e->object = object;
+    e->index = index;
+    e->flags = 0;
+    e->acked = 0;
+    e->latest = 0;
+    e->txOffset = 0;
+    e->stamp = 0;
+    return e;
+}
+
+////////////////////// Genie::shadowCompleted ////////////////////////
+//
+// Keep the shadow table in step with the replies to WriteObject.
+// An ACK confirms the value, anything else means the display may
+// not show what we think, so the next write must go out.
+//
+static void shadowCompleted (GenieContext *ctx, GeniePendingCommand *pc, int result) {
+    GenieShadowEntry *e;
+
+    if (ctx->shadow == NULL || pc->cmd != GENIE_WRITE_OBJ) {
+        return;
+    }
+
+    e = shadowFind(ctx, pc->object, pc->index, false);
+
+    if (e == NULL) {
+        return;
+    }
+
+    if (result == ERROR_NONE) {
+        e->acked = pc->value;
+        e->stamp = ctx->deviceSerial->millis();
+        e->flags |= GENIE_SHADOW_ACKED;
+    } else {
+        e->flags &= ~(GENIE_SHADOW_ACKED | GENIE_SHADOW_KNOWN);
+    }
+}
+
+////////////////////// Genie::shadowReported ////////////////////////
+//
+// A report or event carries the value an object really has, which
+// may have been changed on the display itself.
+//
+static void shadowReported (GenieContext *ctx, uint8_t * data) {
+    GenieShadowEntry *e;
+
+    if (ctx->shadow == NULL) {
+        return;
+    }
+
+    e = shadowFind(ctx, data[1], data[2], false);
+
+    if (e != NULL) {
+        e->acked = e->latest = (data[3] << 8) | data[4];
+        e->stamp = ctx->deviceSerial->millis();
+        e->flags |= GENIE_SHADOW_ACKED | GENIE_SHADOW_KNOWN;
+    }
+}
+
+/////////////////////// AttachShadow ////////////////////////
+//
+// Give the context a table in which to remember the value of each
+// object written with genieCtxWriteObject. Once attached:
+//   - a write of the value the object already has is dropped
+//   - a write to an object whose previous write is still held in
+//     a burst (see genieCtxBeginBurst) replaces the held value, so
+//     only the latest one is sent when the burst is flushed
+// Objects are added to the table as they are first written. When
+// the table is full other objects are written as usual.
+//
+// Parms:   table, storage for size entries, NULL to stop shadowing
+//
+void genieCtxAttachShadow(GenieContext *ctx, GenieShadowEntry *table, uint16_t size) {
+    ctx->shadow = table;
+    ctx->shadowSize = (table != NULL) ? size : 0;
+    ctx->shadowCount = 0;
+    ctx->shadowQueued = 0;
+    ctx->shadowSkipped = 0;
+    ctx->shadowCoalesced = 0;
+    ctx->shadowSent = 0;
+}
+
+/////////////////////// InvalidateShadow ////////////////////////
+//
+// Forget every value in the shadow table, for example after the
+// display has been reset, so the next write of each object is sent.
+//
+void genieCtxInvalidateShadow(GenieContext *ctx) {
+    uint16_t i;
+
+    // a write still in the transmit buffer can still be updated
+    for (i = 0; i < ctx->shadowCount; i++) {
+        ctx->shadow[i].flags &= GENIE_SHADOW_QUEUED;
+    }
+}
+
+/////////////////////// GetShadowStats ////////////////////////
+//
+// Copy the shadow table counters to the caller's structure.
+//
+void genieCtxGetShadowStats(GenieContext *ctx, GenieShadowStats *stats) {
+    stats->skipped = ctx->shadowSkipped;
+    stats->coalesced = ctx->shadowCoalesced;
+    stats->sent = ctx->shadowSent;
+    stats->entries = ctx->shadowCount;
+}
+
+/////////////////////// AttachScheduler ////////////////////////
+//
+// Put a scheduler between genieCtxWriteObject and the line. Each
+// entry of the table gives an object a priority and a shortest time
+// between writes. Once attached:
+//   - writes to GENIE_PRIORITY_CRITICAL objects, and to objects not
+//     in the table, are sent at once as before
+//   - writes to other objects are held in their entry, a newer value
+//     replacing one not sent yet, and sent by genieCtxRunScheduler
+//     most important first, then the one waiting longest, no more
+//     often than minInterval allows
+//   - with a window over 1, scheduled writes leave one slot free, so
+//     a critical write never waits behind more than the command the
+//     display is working on
+//   - scheduled writes stop while everything sent in the last 50ms
+//     or so is over budgetPercent of what the line carries at baud
+// genieCtxDoEvents and genieCtxDoEventsBudget run the scheduler
+// when asked to call the handlers.
+//
+// Parms:   table, the rules, sorted here, NULL to stop scheduling.
+//              Values still waiting are dropped.
+//          budgetPercent, 0 for no byte budget
+//
+void genieCtxAttachScheduler(GenieContext *ctx, GenieScheduleEntry *table, uint16_t size,
+                             uint32_t baud, uint8_t budgetPercent) {
+    GenieScheduleEntry e;
+    uint32_t now = 0;
+    uint16_t i, j;
+
+    if (table != NULL) {
+        now = ctx->deviceSerial->millis();
+
+        // small and sorted once, insertion sort will do
+        for (i = 1; i < size; i++) {
+            e = table[i];
+
+            for (j = i; j > 0 && ((table[j - 1].object << 8) | table[j - 1].index) > ((e.object << 8) | e.index); j--) {
+                table[j] = table[j - 1];
+            }
+
+            table[j] = e;
+        }
+
+        for (i = 0; i < size; i++) {
+            table[i].waiting = false;
+            table[i].lastSent = now - table[i].minInterval;
+        }
+    }
+
+    ctx->schedule = table;
+    ctx->scheduleSize = (table != NULL) ? size : 0;
+    ctx->scheduleWaiting = 0;
+    memset(&ctx->scheduleStats, 0, sizeof(ctx->scheduleStats));
+
+    // ten bits a byte on the line
+    ctx->budgetRate = (table != NULL) ? baud / 10 * budgetPercent / 100 : 0;
+    ctx->budgetTokens = 0;
+    ctx->budgetStamp = now;
+}
+
+/////////////////////// RunScheduler ////////////////////////
+//
+// Send as many of the writes held by the scheduler as the window,
+// the rate limits and the byte budget allow. Call it from the main
+// loop if genieCtxDoEvents isn't called there with DoHandler set.
+//
+void genieCtxRunScheduler(GenieContext *ctx) {
+    GenieScheduleEntry *e, *best;
+    uint8_t reserve = (ctx->window > 1) ? 1 : 0;
+    uint32_t now;
+    uint16_t i;
+
+    if (ctx->scheduleWaiting == 0 || ctx->scheduling) {
+        return;
+    }
+
+    now = ctx->deviceSerial->millis();
+
+    if (ctx->budgetRate != 0) {
+        budgetRefill(ctx, now);
+    }
+
+    ctx->scheduling = true;
+
+    while (ctx->scheduleWaiting > 0 && ctx->Pending.n_pending + reserve < ctx->window) {
+#if (GENIE_RX_RING_SIZE > 0)
+        // never wait for other displays on the line
+        if (ctx->bus != NULL && busInFlight(ctx->bus) + (ctx->bus->window > 1) >= ctx->bus->window) {
+            break;
+        }
+#endif
+
+        if (ctx->budgetRate != 0 && ctx->budgetTokens < GENIE_FRAME_SIZE * 1000) {
+            ctx->scheduleStats.budgetStalls++;
+            break;
+        }
+
+        best = NULL;
+
+        for (i = 0; i < ctx->scheduleSize; i++) {
+            e = &ctx->schedule[i];
+
+            if (!e->waiting || (uint32_t)(now - e->lastSent) < e->minInterval) {
+                continue;
+            }
+
+            if (best == NULL || e->priority < best->priority ||
+                    (e->priority == best->priority && (int32_t)(e->lastSent - best->lastSent) < 0)) {
+                best = e;
+            }
+        }
+
+        // everything waiting is rate limited
+        if (best == NULL) {
+            break;
+        }
+
+        best->waiting = false;
+        best->lastSent = now;
+        ctx->scheduleWaiting--;
+        ctx->scheduleStats.sent++;
+        genieCtxWriteObject(ctx, best->object, best->index, best->value);
+    }
+
+    ctx->scheduling = false;
+}
+
+/////////////////////// GetScheduleStats ////////////////////////
+//
+// Copy the scheduler counters to the caller's structure.
+//
+void genieCtxGetScheduleStats(GenieContext *ctx, GenieScheduleStats *stats) {
+    *stats = ctx->scheduleStats;
+    stats->waiting = ctx->scheduleWaiting;
+}
+
+////////////////////// Genie::scheduleFind ////////////////////////
+//
+// Binary search the scheduler table for an object's entry.
+//
+// Returns: the entry, or NULL
+//
+static GenieScheduleEntry *scheduleFind (GenieContext *ctx, uint8_t object, uint8_t index) {
+    uint16_t key = (object << 8) | index;
+    uint16_t lo = 0, hi = ctx->scheduleSize, mid, k;
+
+    while (lo < hi) {
+        mid = (lo + hi) >> 1;
+        k = (ctx->schedule[mid].object << 8) | ctx->schedule[mid].index;
+
+        if (k == key) {
+            return &ctx->schedule[mid];
+        }
+
+        if (k < key) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+
+    return NULL;
+}
+
+////////////////////// Genie::scheduleWrite ////////////////////////
+//
+// Hold a write to an object the scheduler looks after, and send
+// what can go now.
+//
+// Returns: true if the write was taken, false if it is to be sent
+//              at once
+//
+static bool scheduleWrite (GenieContext *ctx, uint8_t object, uint8_t index, uint16_t data) {
+    GenieScheduleEntry *e = scheduleFind(ctx, object, index);
+
+    if (e == NULL || e->priority == GENIE_PRIORITY_CRITICAL) {
+        return false;
+    }
+
+    if (e->waiting) {
+        ctx->scheduleStats.coalesced++;
+    } else {
+        e->waiting = true;
+        ctx->scheduleWaiting++;
+    }
+
+    e->value = data;
+    genieCtxRunScheduler(ctx);
+    return true;
+}
+
+////////////////////// Genie::budgetRefill ////////////////////////
+//
+// Add what the line may carry since the last call. The budget is
+// kept in thousandths of a byte so slow lines, under a byte a
+// millisecond, still fill it. It holds no more than 50ms worth, or
+// two frames, so a quiet spell can't be spent all at once later.
+//
+static void budgetRefill (GenieContext *ctx, uint32_t now) {
+    uint32_t elapsed = now - ctx->budgetStamp;
+    int32_t cap = (int32_t)ctx->budgetRate * 50;
+
+    if (cap < 2 * GENIE_FRAME_SIZE * 1000) {
+        cap = 2 * GENIE_FRAME_SIZE * 1000;
+    }
+
+    if (elapsed > 1000) {
+        elapsed = 1000;
+    }
+
+    ctx->budgetStamp = now;
+    ctx->budgetTokens += (int32_t)(elapsed * ctx->budgetRate);
+
+    if (ctx->budgetTokens > cap) {
+        ctx->budgetTokens = cap;
+    }
+}
+
+/////////////////////// FindObject ////////////////////////
+//
+// Look an object up in a table written by tools/genieGen, which
+// is sorted by object then index.
+//
+// Returns: the object's entry, or NULL if it is not in the project
+//
+const GenieObjectInfo *genieFindObject(const GenieObjectInfo *table, uint16_t count, uint8_t object, uint8_t index) {
+    uint16_t key = ((uint16_t)object << 8) | index;
+    uint16_t lo = 0, hi = count, mid, k;
+
+    while (lo < hi) {
+        mid = (lo + hi) >> 1;
+        k = ((uint16_t)table[mid].object << 8) | table[mid].index;
+
+        if (k == key) {
+            return &table[mid];
+        }
+
+        if (k < key) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+
+    return NULL;
+}
+
+///////////////////////// WriteObject //////////////////////
+//
+// Write data to an object on the display
+//
+uint16_t genieCtxWriteObject (GenieContext *ctx, uint16_t object, uint16_t index, uint16_t data) {
+    GenieShadowEntry *e = NULL;
+    uint16_t start, gen;
+    uint8_t *f;
+    int i;
+
+    if (ctx->schedule != NULL && !ctx->scheduling && scheduleWrite(ctx, object, index, data)) {
+        return 0;
+    }
+
+    if (ctx->shadow != NULL) {
+        e = shadowFind(ctx, object, index, true);
+    }
+
+    if (e != NULL) {
+        if ((e->flags & GENIE_SHADOW_KNOWN) && e->latest == data) {
+            // the display has, or is about to have, this value
+            ctx->shadowSkipped++;
+            return 0;
+        }
+
+        if (e->flags & GENIE_SHADOW_QUEUED) {
+            // the previous write has not left the transmit buffer
+            // yet, give it the new value instead of sending another
+            f = &ctx->txBuf[e->txOffset];
+            f[5] ^= f[3] ^ f[4] ^ highByte(data) ^ lowByte(data);
+            f[3] = highByte(data);
+            f[4] = lowByte(data);
+            e->latest = data;
+            ctx->shadowCoalesced++;
+
+            for (i = ctx->Pending.n_pending; i > 0; i--) {
+                GeniePendingCommand *pc = &ctx->Pending.cmds[(ctx->Pending.rd_index + i - 1) & (GENIE_MAX_PENDING - 1)];
+
+                if (pc->cmd == GENIE_WRITE_OBJ && pc->object == object && pc->index == index) {
+                    pc->value = data;
+                    break;
+                }
+            }
+
+            return 0;
+        }
+    }
+
+    waitForWindow(ctx, ctx->window - 1);
+    ctx->Error = ERROR_NONE;
+    gen = ctx->txFlushes;
+    frameBegin(ctx, GENIE_WRITE_OBJ);
+    start = ctx->txLen - 1;
+    framePut(ctx, object);
+    framePut(ctx, index);
+    framePut(ctx, highByte(data));
+    framePut(ctx, lowByte(data));
+    frameEnd(ctx);
+    /*
+    if (debugSerial) {
+        *debugSerial << "WriteObject: " <<  ", ";
+        *debugSerial << _HEX(object) << ", ";
+        *debugSerial << _HEX(index) << ", ";
+        *debugSerial << _HEX(msb) << ", ";
+        *debugSerial << _HEX(lsb) << ", ";
+        *debugSerial << _HEX(checksum) << endl;
+        *debugSerial << "Freemem = " << freeRam()<< endl;
+    }
+    */
+    queueCommand(ctx, GENIE_WRITE_OBJ, object, index, data, GENIE_LINK_WFAN);
+
+    if (e != NULL) {
+        ctx->shadowSent++;
+        e->latest = data;
+        e->flags |= GENIE_SHADOW_KNOWN;
+
+        // still held in the buffer, a later write may update it
+        // until txFlush clears the flag
+        if (gen == ctx->txFlushes) {
+            e->flags |= GENIE_SHADOW_QUEUED;
+            e->txOffset = start;
+            ctx->shadowQueued++;
+        }
+    }
+
+    return 0;
+}
+
+///////////////////////// BindObject //////////////////////
+//
+// Precompile the header of writes to an object, the run time
+// version of GENIE_HANDLE.
+//
+GenieObjectHandle genieBindObject (uint16_t object, uint16_t index) {
+    GenieObjectHandle h = GENIE_HANDLE(object, index);
+
+    return h;
+}
+
+///////////////////////// WriteHandle //////////////////////
+//
+// Write data to the object a handle was bound to. The header and
+// most of the checksum come ready made, the command is put straight
+// into the transmit buffer. With a shadow table or a scheduler
+// attached, or on a bus, this is just genieCtxWriteObject, so
+// skipped, merged, scheduled and addressed writes still work.
+//
+uint16_t genieCtxWriteHandle (GenieContext *ctx, const GenieObjectHandle *handle, uint16_t data) {
+    uint8_t *f;
+
+    if (ctx->shadow != NULL || ctx->schedule != NULL || ctx->address != 0) {
+        return genieCtxWriteObject(ctx, handle->header[1], handle->header[2], data);
+    }
+
+    waitForWindow(ctx, ctx->window - 1);
+    ctx->Error = ERROR_NONE;
+
+    if (GENIE_TX_BUFFER_SIZE - ctx->txLen < GENIE_FRAME_SIZE) {
+        txFlush(ctx);
+    }
+
+    f = &ctx->txBuf[ctx->txLen];
+    memcpy(f, handle->header, 3);
+    f[3] = highByte(data);
+    f[4] = lowByte(data);
+    f[5] = handle->checksum ^ f[3] ^ f[4];
+    ctx->txLen += GENIE_FRAME_SIZE;
+
+    if (!ctx->txHold) {
+        txFlush(ctx);
+    }
+
+    queueCommand(ctx, GENIE_WRITE_OBJ, handle->header[1], handle->header[2], data, GENIE_LINK_WFAN);
+    return 0;
+}
+
+/////////////////////// WriteContrast //////////////////////
+//
+// Alter the display contrast (backlight)
+//
+// Parms:   uint8_t value: The required contrast setting, only
+//      values from 0 to 15 are valid. 0 or 1 for most displays
+//      and 0 to 15 for the uLCD-43, uLCD-70, uLCD-35, uLCD-220RD
+//
+void genieCtxWriteContrast (GenieContext *ctx, uint16_t value) {
+    waitForWindow(ctx, ctx->window - 1);
+    frameBegin(ctx, GENIE_WRITE_CONTRAST);
+    framePut(ctx, value);
+    frameEnd(ctx);
+    queueCommand(ctx, GENIE_WRITE_CONTRAST, 0, 0, value, GENIE_LINK_WFAN);
+}
+
+/////////////////////// WriteStr ////////////////////////
+//
+// Write a string to the display (ASCII)
+// ASCII characters are 1 byte each
+//
+uint16_t genieCtxWriteStr (GenieContext *ctx, uint16_t index, char *string) {
+    char *p;
+    int len = strlen (string);
+
+    if (len > 255) {
+        return -1;
+    }
+
+    waitForWindow(ctx, ctx->window - 1);
+    frameBegin(ctx, GENIE_WRITE_STR);
+    framePut(ctx, index);
+    framePut(ctx, (unsigned char)len);
+
+    for (p = string ; *p ; ++p) {
+        framePut(ctx, *p);
+    }
+
+    frameEnd(ctx);
+    queueCommand(ctx, GENIE_WRITE_STR, GENIE_OBJ_STRINGS, index, len, GENIE_LINK_WFAN);
+    return 0;
+}
+
+#ifdef AVR
+uint16_t genieWriteStr(uint16_t index, const __FlashStringHelper *ifsh){
+	PGM_P p = reinterpret_cast<PGM_P>(ifsh);
+	PGM_P p2 = reinterpret_cast<PGM_P>(ifsh);
+	size_t n = 0;
+	int len = 0;
+	while (1) {
+		unsigned char d = pgm_read_byte(p2++);
+		len++;
+		if (d == 0) break;
+	}
+  
+ 
+	char arr[len];
+	int x = 0;
+	while (1) {
+		unsigned char c = pgm_read_byte(p++);
+		arr[x] = c;
+		x++;
+		if (c == 0) break;
+	}
+	WriteStr(index, arr);
+	return 0;	
+}
+#endif
+
+#if (ARDUINO_BASED == 1)
+uint16_t genieWriteStr(uint16_t index, const String &s){
+	//s.c_str(), s.length()
+	int len = s.length();
+	char arr[len + 1];
+	s.toCharArray(arr,len + 1);
+	WriteStr(index, arr);
+	return 0;
+}
+#endif
+
+//////////////////// WriteStrInt, Uint, Fixed ////////////////////
+//
+// Write a number to a string object, in decimal. Fixed writes
+// value / 10^scale with digits decimals, rounded half away from
+// zero, so 12345 with a scale of 3 and 2 digits shows "12.35".
+// scale and digits go up to 9.
+//
+uint16_t genieCtxWriteStrInt (GenieContext *ctx, uint16_t index, int32_t n) {
+    return genieCtxWriteStrFixed(ctx, index, n, 0, 0);
+}
+
+uint16_t genieCtxWriteStrUint (GenieContext *ctx, uint16_t index, uint32_t n) {
+    return writeStrDecimal(ctx, index, false, n, 0, 0);
+}
+
+uint16_t genieCtxWriteStrFixed (GenieContext *ctx, uint16_t index, int32_t value, uint8_t scale, uint8_t digits) {
+    if (scale > 9 || digits > 9) {
+        return -1;
+    }
+
+    // negated as unsigned, so INT32_MIN comes out right
+    return writeStrDecimal(ctx, index, value < 0, value < 0 ? 0u - (uint32_t)value : (uint32_t)value,
+                           scale, digits);
+}
+
+//////////////////////// writeStrDecimal ////////////////////////
+//
+// Write n / 10^scale to a string object with digits decimals,
+// straight into the transmit buffer. The digits are made from the
+// right two at a time, dividing by 100 with a multiply and a shift,
+// as a Cortex-M0 or AVR has no divide instruction. Rounding adds
+// half of the last place shown, and the digits after it are made
+// but left beyond the end of the frame, to be overwritten.
+//
+static uint16_t writeStrDecimal (GenieContext *ctx, uint16_t index, bool negative, uint32_t n,
+                                 uint8_t scale, uint8_t digits) {
+    uint8_t drop = 0, pad = 0, len, count = 0, i;
+    uint32_t q;
+    uint8_t *p, *end;
+
+    if (digits < scale) {
+        drop = scale - digits;
+        n += 5 * powersOfTen[drop - 1];
+    } else {
+        pad = digits - scale;
+    }
+
+    // no "-0.00" for a value that rounds to nothing
+    negative = negative && n >= powersOfTen[drop];
+    len = decimalLength(n);
+    len = negative + (len > scale ? len - scale : 1) + (digits > 0 ? 1 + digits : 0);
+
+    waitForWindow(ctx, ctx->window - 1);
+    frameBegin(ctx, GENIE_WRITE_STR);
+    framePut(ctx, index);
+    framePut(ctx, len);
+
+    if (GENIE_TX_BUFFER_SIZE - ctx->txLen < len + drop + 1) {
+        txFlush(ctx);
+    }
+
+    p = end = &ctx->txBuf[ctx->txLen + len + drop - pad];
+
+#define DECIMAL_PUT(c)  do { *--p = (c); if (++count == scale && digits > 0) *--p = '.'; } while (0)
+
+    // only padding after the point
+    if (scale == 0 && digits > 0) {
+        *--p = '.';
+    }
+
+    while (n >= 100) {
+        q = (uint32_t)(((uint64_t)n * 0x51EB851Fu) >> 37);
+        i = (uint8_t)(n - q * 100) * 2;
+        DECIMAL_PUT(digitPairs[i + 1]);
+        DECIMAL_PUT(digitPairs[i]);
+        n = q;
+    }
+
+    if (n >= 10) {
+        DECIMAL_PUT(digitPairs[n * 2 + 1]);
+        DECIMAL_PUT(digitPairs[n * 2]);
+    } else {
+        DECIMAL_PUT('0' + n);
+    }
+
+    // a fraction with nothing before the point
+    while (count <= scale) {
+        DECIMAL_PUT('0');
+    }
+
+#undef DECIMAL_PUT
+
+    if (negative) {
+        *--p = '-';
+    }
+
+    memset(end, '0', pad);
+
+    for (i = 0; i < len; i++) {
+        ctx->txChecksum ^= p[i];
+    }
+
+    ctx->txLen += len;
+    frameEnd(ctx);
+    queueCommand(ctx, GENIE_WRITE_STR, GENIE_OBJ_STRINGS, index, len, GENIE_LINK_WFAN);
+    return 0;
+}
+
+//////////////////////// decimalLength ////////////////////////
+//
+// Returns: the number of decimal digits in n, 1 for 0
+//
+static uint8_t decimalLength (uint32_t n) {
+    uint8_t d = 1;
+
+    while (d < 10 && n >= powersOfTen[d]) {
+        d++;
+    }
+
+    return d;
+}
+
+/////////////////////// WriteStrU ////////////////////////
+//
+// Write a string to the display (Unicode)
+// Unicode characters are 2 bytes each
+//
+uint16_t genieCtxWriteStrU (GenieContext *ctx, uint16_t index, uint16_t *string) {
+    uint16_t *p;
+    int len = 0;
+    p = string;
+
+    while (*p++) {
+        len++;
+    }
+
+    if (len > 255) {
+        return -1;
+    }
+
+    waitForWindow(ctx, ctx->window - 1);
+    frameBegin(ctx, GENIE_WRITE_STRU);
+    framePut(ctx, index);
+    framePut(ctx, (unsigned char)(len));
+    p = string;
+
+    while (*p) {
+        framePut(ctx, *p >> 8);
+        framePut(ctx, *p++ & 0xff);
+    }
+
+    frameEnd(ctx);
+    queueCommand(ctx, GENIE_WRITE_STRU, GENIE_OBJ_STRINGS, index, len, GENIE_LINK_WFAN);
+    return 0;
+}
+
+/////////////////////// WriteStrUtf8 ////////////////////////
+//
+// Write len bytes of UTF-8 text to the display, as WriteStrU does.
+// The text is transcoded to 16-bit characters as it is put in the
+// transmit buffer, so no UCS-2 copy is needed. Characters beyond
+// U+FFFF, which the display cannot show, become U+FFFD.
+//
+// Returns: -1 if the text is not valid UTF-8 or is over 255
+//              characters, and nothing is sent
+//
+uint16_t genieCtxWriteStrUtf8 (GenieContext *ctx, uint16_t index, const char *string, uint16_t len) {
+    uint16_t chars;
+
+    // the length goes ahead of the text, so it is counted first
+    if (!utf8Length((const uint8_t *)string, len, &chars) || chars > 255) {
+        return -1;
+    }
+
+    waitForWindow(ctx, ctx->window - 1);
+    frameBegin(ctx, GENIE_WRITE_STRU);
+    framePut(ctx, index);
+    framePut(ctx, (uint8_t)chars);
+    utf8Put(ctx, (const uint8_t *)string, len);
+    frameEnd(ctx);
+    queueCommand(ctx, GENIE_WRITE_STRU, GENIE_OBJ_STRINGS, index, chars, GENIE_LINK_WFAN);
+    return 0;
+}
+
+/////////////////////////// utf8Decode ////////////////////////////
+//
+// Decode the character at s, rejecting overlong forms, surrogates,
+// code points past U+10FFFF and sequences cut short.
+//
+// Returns: the bytes it took, or 0 if they are not valid UTF-8
+//
+static uint8_t utf8Decode (const uint8_t *s, const uint8_t *end, uint16_t *c) {
+    uint8_t n, i, lo = 0x80, hi = 0xBF;
+    uint32_t cp;
+
+    if (s[0] < 0x80) {
+        *c = s[0];
+        return 1;
+    } else if (s[0] >= 0xC2 && s[0] <= 0xDF) {
+        n = 2;
+        cp = s[0] & 0x1F;
+    } else if (s[0] >= 0xE0 && s[0] <= 0xEF) {
+        n = 3;
+        cp = s[0] & 0x0F;
+        lo = (s[0] == 0xE0) ? 0xA0 : 0x80;
+        hi = (s[0] == 0xED) ? 0x9F : 0xBF;
+    } else if (s[0] >= 0xF0 && s[0] <= 0xF4) {
+        n = 4;
+        cp = s[0] & 0x07;
+        lo = (s[0] == 0xF0) ? 0x90 : 0x80;
+        hi = (s[0] == 0xF4) ? 0x8F : 0xBF;
+    } else {
+        return 0;
+    }
+
+    if (end - s < n || s[1] < lo || s[1] > hi) {
+        return 0;
+    }
+
+    for (i = 1; i < n; i++) {
+        if ((s[i] & 0xC0) != 0x80) {
+            return 0;
+        }
+
+        cp = (cp << 6) | (s[i] & 0x3F);
+    }
+
+    *c = (cp > 0xFFFF) ? 0xFFFD : (uint16_t)cp;
+    return n;
+}
+
+/////////////////////////// utf8Length ////////////////////////////
+//
+// Check len bytes of UTF-8 and count the characters in them, up to
+// a little over 255. Runs of ASCII are taken 4 bytes at a time.
+//
+// Returns: FALSE if the text is not valid UTF-8
+//
+static bool utf8Length (const uint8_t *s, uint16_t len, uint16_t *chars) {
+    const uint8_t *end = s + len;
+    uint32_t w;
+    uint16_t c;
+    uint8_t n;
+
+    *chars = 0;
+
+    while (s < end && *chars <= 255) {
+        if (end - s >= 4) {
+            memcpy(&w, s, 4);
+
+            if ((w & 0x80808080u) == 0) {
+                s += 4;
+                *chars += 4;
+                continue;
+            }
+        }
+
+        if ((n = utf8Decode(s, end, &c)) == 0) {
+            return false;
+        }
+
+        s += n;
+        (*chars)++;
+    }
+
+    return true;
+}
+
+//////////////////////////// utf8Put //////////////////////////////
+//
+// Add text already checked by utf8Length to the command being
+// built, as big-endian 16-bit characters. An ASCII character's high
+// byte is 0 and adds nothing to the checksum, so 4 of them are
+// checked and summed as one word.
+//
+static void utf8Put (GenieContext *ctx, const uint8_t *s, uint16_t len) {
+    const uint8_t *end = s + len;
+    uint8_t *f;
+    uint32_t w;
+    uint16_t c;
+
+    while (s < end) {
+        if (GENIE_TX_BUFFER_SIZE - ctx->txLen < 8) {
+            txFlush(ctx);
+        }
+
+        f = &ctx->txBuf[ctx->txLen];
+
+        if (end - s >= 4) {
+            memcpy(&w, s, 4);
+
+            if ((w & 0x80808080u) == 0) {
+                f[0] = 0;
+                f[1] = s[0];
+                f[2] = 0;
+                f[3] = s[1];
+                f[4] = 0;
+                f[5] = s[2];
+                f[6] = 0;
+                f[7] = s[3];
+                w ^= w >> 16;
+                ctx->txChecksum ^= (uint8_t)(w ^ (w >> 8));
+                ctx->txLen += 8;
+                s += 4;
+                continue;
+            }
+        }
+
+        s += utf8Decode(s, end, &c);
+        f[0] = c >> 8;
+        f[1] = c & 0xFF;
+        ctx->txChecksum ^= f[0] ^ f[1];
+        ctx->txLen += 2;
+    }
+}
+
+/////////////////// AttachEventHandler //////////////////////
+//
+// "Attaches" a pointer to the users event handler by writing
+// the pointer into the variable used by doEVents(). With a
+// dispatch table attached it becomes the catch-all for events
+// that have no handler of their own.
+//
+void genieCtxAttachEventHandler (GenieContext *ctx, GenieCtxEventHandlerPtr handler) {
+    ctx->UserHandler = handler;
+}
+
+////////////////////// Genie::handlerKey ////////////////////////
+//
+static uint32_t handlerKey (uint8_t cmd, uint8_t object, uint8_t index) {
+    return ((uint32_t)cmd << 16) | ((uint32_t)object << 8) | index;
+}
+
+////////////////////// Genie::handlerFind ////////////////////////
+//
+// Binary search the dispatch table, which is kept sorted by cmd,
+// object then index.
+//
+// Returns: the position of the entry for the key, or where it
+//              would be inserted
+//
+static uint16_t handlerFind (GenieContext *ctx, uint32_t key) {
+    uint16_t lo = 0, hi = ctx->handlerCount, mid;
+    GenieHandlerEntry *e;
+
+    while (lo < hi) {
+        mid = (lo + hi) >> 1;
+        e = &ctx->handlers[mid];
+
+        if (handlerKey(e->cmd, e->object, e->index) < key) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+
+    return lo;
+}
+
+////////////////////// Genie::handlerLookup ////////////////////////
+//
+// Find the handler for an event, one for its exact index first,
+// then one registered for any index of its object.
+//
+static GenieHandlerEntry *handlerLookup (GenieContext *ctx, GenieFrame * e) {
+    uint32_t key = handlerKey(e->reportObject.cmd, e->reportObject.object, e->reportObject.index);
+    uint16_t pos = handlerFind(ctx, key);
+    GenieHandlerEntry *h;
+
+    if (pos < ctx->handlerCount) {
+        h = &ctx->handlers[pos];
+
+        if (handlerKey(h->cmd, h->object, h->index) == key) {
+            return h;
+        }
+    }
+
+    // wildcards sort after every real index of the same object
+    key |= GENIE_ANY_INDEX;
+    pos = handlerFind(ctx, key);
+
+    if (pos < ctx->handlerCount) {
+        h = &ctx->handlers[pos];
+
+        if (handlerKey(h->cmd, h->object, h->index) == key) {
+            return h;
+        }
+    }
+
+    return NULL;
+}
+
+////////////////////// Genie::dispatchEvent ////////////////////////
 //
-// Parms:   GenieFrame * buff, a pointer to the user's buffer
+// Hand the event at the front of the queue to its handler. Events
+// with no handler of their own go to the catch-all handler, which
+// takes them off the queue itself. Without one they are left for
+// genieCtxDequeueEvent: on a queue of their own once callbacks are
+// registered, so they don't hold up the events that have one.
 //
-// Returns: TRUE if there was an event to copy
-//          FALSE if not
+// Returns: TRUE if something was done with an event
 //
-bool genieDequeueEvent(GenieFrame * buff) {
-    if (EventQueue.n_events > 0) {
-        memcpy (buff, &EventQueue.frames[EventQueue.rd_index],
-                GENIE_FRAME_SIZE);
-        EventQueue.rd_index++;
-        EventQueue.rd_index &= MAX_GENIE_EVENTS - 1;
-        EventQueue.n_events--;
+static bool dispatchEvent (GenieContext *ctx) {
+    EventQueueStruct *q = &ctx->EventQueue;
+    GenieHandlerEntry *h = NULL;
+    GenieFrame event;
+
+    if (q->n_events == 0) {
+        return FALSE;
+    }
+
+    if (ctx->handlerCount > 0) {
+        h = handlerLookup(ctx, &q->frames[q->rd_index]);
+    }
+
+    if (h != NULL) {
+        eventTake(q, &event);
+        h->callback(ctx, &event, h->userData);
+        return TRUE;
+    }
+
+    if (ctx->UserHandler != NULL) {
+        (ctx->UserHandler)(ctx);
+        return TRUE;
+    }
+
+    if (ctx->handlerCount > 0) {
+        // dropped and counted if that queue is full too
+        eventTake(q, &event);
+        eventPut(ctx, &ctx->Unhandled, event.bytes);
         return TRUE;
     }
 
     return FALSE;
 }
 
-////////////////////// Genie::EnqueueEvent ///////////////////
-//
-// Copy the bytes from a buffer supplied by the caller
-// to the input queue
+/////////////////// AttachDispatchTable //////////////////////
 //
-// Parms:   uint8_t * data, a pointer to the user's data
+// Give the context storage for the handlers registered with
+// genieCtxOn.
 //
-// Returns: TRUE if there was an empty location in the queue
-//              to copy the data into
-//          FALSE if not
-// Sets:    ERROR_REPLY_OVR if there was no room in the queue
+// Parms:   table, storage for size entries
 //
-static bool enqueueEvent (uint8_t * data) {
-    if (EventQueue.n_events < MAX_GENIE_EVENTS - 2) {
-        int i, j ;
-        bool fnd=false ;
-        j = EventQueue.wr_index ;
-        for (i = EventQueue.n_events; i > 0; i--) 
-        {
-            j-- ;
-            if (j < 0)
-                j = MAX_GENIE_EVENTS - 1;
-            if (   (EventQueue.frames[j].reportObject.cmd == data[0])
-                && (EventQueue.frames[j].reportObject.object == data[1])
-                && (EventQueue.frames[j].reportObject.index == data[2])  )
-            {
-                EventQueue.frames[j].reportObject.data_msb = data[3] ;
-                EventQueue.frames[j].reportObject.data_lsb = data[4] ;
-                fnd = true ;
-                break ;
-            }
-        }
-        if (!fnd)
-        {
-            memcpy (&EventQueue.frames[EventQueue.wr_index], data,
-                    GENIE_FRAME_SIZE);
-            EventQueue.wr_index++;
-            EventQueue.wr_index &= MAX_GENIE_EVENTS - 1;
-            EventQueue.n_events++;
-            //if (debugSerial) { *debugSerial << "Enque Event " << _HEX(*data) << ", count = " << EventQueue.n_events << endl; }
-            return TRUE;
-        }
-    } else {
-        Error = ERROR_REPLY_OVR;
-        handleError();
-        return FALSE;
-    }
+void genieCtxAttachDispatchTable (GenieContext *ctx, GenieHandlerEntry *table, uint16_t size) {
+    ctx->handlers = table;
+    ctx->handlerSize = (table != NULL) ? size : 0;
+    ctx->handlerCount = 0;
 }
 
-//////////////////////// Genie::ReadObject ///////////////////////
+/////////////////////////// On //////////////////////////////
 //
-// Send a read object command to the Genie display. Note that this
-// function does not wait for the reply, that will be read in due
-// course by DoEvents() and subsequently by the user's event
-// handler.
+// Register a handler for one kind of event. The table stays
+// sorted, so an event finds its handler with a binary search
+// rather than a chain of if statements. Registering the same
+// cmd, object and index again replaces the handler.
 //
-bool genieReadObject (uint16_t object, uint16_t index) {
-    uint8_t checksum;
-    // Discard any pending reply frames
-    //flushEventQueue();    // Removed due to preventing more than 2 readObjects being queued
-    waitForIdle();
-    Error = ERROR_NONE;
-    deviceSerial->write((uint8_t)GENIE_READ_OBJ);
-    checksum   = GENIE_READ_OBJ ;
-    deviceSerial->write(object);
-    checksum  ^= object ;
-    deviceSerial->write(index);
-    checksum  ^= index ;
-    deviceSerial->write(checksum);
-    pushLinkState(GENIE_LINK_WF_RXREPORT);
+// Parms:   cmd, GENIE_REPORT_EVENT or GENIE_REPORT_OBJ
+//          index, the object's index or GENIE_ANY_INDEX
+//          userData, passed back to the callback
+//
+// Returns: TRUE if the handler was registered
+//          FALSE if the dispatch table is full
+//
+bool genieCtxOn (GenieContext *ctx, uint8_t cmd, uint8_t object, uint8_t index,
+                 GenieCtxEventCallbackPtr callback, void *userData) {
+    uint32_t key = handlerKey(cmd, object, index);
+    uint16_t pos = handlerFind(ctx, key);
+    GenieHandlerEntry *h = &ctx->handlers[pos];
+
+    if (pos >= ctx->handlerCount || handlerKey(h->cmd, h->object, h->index) != key) {
+        if (ctx->handlerCount >= ctx->handlerSize) {
+            return FALSE;
+        }
+
+        memmove(h + 1, h, (ctx->handlerCount - pos) * sizeof(GenieHandlerEntry));
+        ctx->handlerCount++;
+        h->cmd = cmd;
+        h->object = object;
+        h->index = index;
+    }
+
+    h->callback = callback;
+    h->userData = userData;
     return TRUE;
 }
 
-///////////////////// Genie::SetLinkState ////////////////////////
-//
-// Set the logical state of the link to the display.
+/////////////////////////// Off //////////////////////////////
 //
-// Parms:   uint16_t newstate, a value to be written to the
-//              link's Genie::LinkState variable. Valid values are
-//      GENIE_LINK_IDLE         0
-//      GENIE_LINK_WFAN         1 // waiting for Ack or Nak
-//      GENIE_LINK_WF_RXREPORT  2 // waiting for a report frame
-//      GENIE_LINK_RXREPORT     3 // receiving a report frame
-//      GENIE_LINK_RXEVENT      4 // receiving an event frame
-//      GENIE_LINK_SHDN         5
+// Remove a handler registered with genieCtxOn.
 //
-static void setLinkState (uint16_t newstate) {
-    *LinkState = newstate;
+void genieCtxOff (GenieContext *ctx, uint8_t cmd, uint8_t object, uint8_t index) {
+    uint32_t key = handlerKey(cmd, object, index);
+    uint16_t pos = handlerFind(ctx, key);
+    GenieHandlerEntry *h = &ctx->handlers[pos];
 
-    if (newstate == GENIE_LINK_RXREPORT || \
-            newstate == GENIE_LINK_RXEVENT) {
-        rxframe_count = 0;
+    if (pos < ctx->handlerCount && handlerKey(h->cmd, h->object, h->index) == key) {
+        memmove(h, h + 1, (ctx->handlerCount - pos - 1) * sizeof(GenieHandlerEntry));
+        ctx->handlerCount--;
     }
 }
 
-/////////////////////// Genie::getLinkState //////////////////////
+/////////////////// AttachMagicByteReader //////////////////////
 //
-// Get the current logical state of the link to the display.
+// "Attaches" a pointer to a user's function for receiving
+// GenieMagic byte reports. It reads the payload itself with
+// genieCtxGetNextByte, which waits for each byte.
 //
-static uint16_t getLinkState (void) {
-    return *LinkState;
+void genieCtxAttachMagicByteReader(GenieContext *ctx, GenieCtxBytePtr handler) {
+    ctx->UserByteReader = handler;
 }
 
-///////////////////////// WriteObject //////////////////////
+/////////////////// AttachMagicDoubleByteReader//////////////////////
 //
-// Write data to an object on the display
+// "Attaches" a pointer to a user's function for receiving
+// GenieMagic doublebyte reports.
 //
-uint16_t genieWriteObject (uint16_t object, uint16_t index, uint16_t data) {
-    uint16_t msb, lsb ;
-    uint8_t checksum ;
-    waitForIdle();
-    lsb = lowByte(data);
-    msb = highByte(data);
-    Error = ERROR_NONE;
-    deviceSerial->write(GENIE_WRITE_OBJ) ;
-    checksum  = GENIE_WRITE_OBJ ;
-    deviceSerial->write(object) ;
-    checksum ^= object ;
-    deviceSerial->write(index) ;
-    checksum ^= index ;
-    deviceSerial->write(msb) ;
-    checksum ^= msb;
-    deviceSerial->write(lsb) ;
-    checksum ^= lsb;
-    deviceSerial->write(checksum) ;
-    /*
-    if (debugSerial) {
-        *debugSerial << "WriteObject: " <<  ", ";
-        *debugSerial << _HEX(object) << ", ";
-        *debugSerial << _HEX(index) << ", ";
-        *debugSerial << _HEX(msb) << ", ";
-        *debugSerial << _HEX(lsb) << ", ";
-        *debugSerial << _HEX(checksum) << endl;
-        *debugSerial << "Freemem = " << freeRam()<< endl;
-    }
-    */
-    pushLinkState(GENIE_LINK_WFAN);
+void genieCtxAttachMagicDoubleByteReader(GenieContext *ctx, GenieCtxDoubleBytePtr handler) {
+    ctx->UserDoubleByteReader = handler;
 }
 
-/////////////////////// WriteContrast //////////////////////
+////////////////////// AttachMagicReader //////////////////////
 //
-// Alter the display contrast (backlight)
-//
-// Parms:   uint8_t value: The required contrast setting, only
-//      values from 0 to 15 are valid. 0 or 1 for most displays
-//      and 0 to 15 for the uLCD-43, uLCD-70, uLCD-35, uLCD-220RD
+// Attaches a function that is given GenieMagic byte and double
+// byte reports a chunk at a time as they arrive, see
+// GenieMagicChunk. Unlike the byte and double byte readers it
+// never waits for the rest of a report, and it is told whether
+// the checksum held. While it is attached they are not called.
 //
-void genieWriteContrast (uint16_t value) {
-    unsigned int checksum ;
-    waitForIdle();
-    deviceSerial->write(GENIE_WRITE_CONTRAST) ;
-    checksum  = GENIE_WRITE_CONTRAST ;
-    deviceSerial->write(value) ;
-    checksum ^= value ;
-    deviceSerial->write(checksum) ;
-    pushLinkState(GENIE_LINK_WFAN);
+void genieCtxAttachMagicReader(GenieContext *ctx, GenieCtxMagicReaderPtr reader, void *userData) {
+    ctx->UserMagicReader = reader;
+    ctx->magicUserData = userData;
 }
 
-/////////////////////// WriteStr ////////////////////////
+/////////////////////// WriteMagicBytes ////////////////////////
 //
-// Write a string to the display (ASCII)
-// ASCII characters are 1 byte each
+// Write an array of bytes to a Magic object
 //
-uint16_t genieWriteStr (uint16_t index, char *string) {
-    char *p;
-    unsigned int checksum;
-    int len = strlen (string);
+// Returns: -1 if there are over 255 bytes, which one frame cannot
+//              carry, and nothing is sent. genieCtxWriteMagicBytesV
+//              splits longer runs.
+//
+uint16_t genieCtxWriteMagicBytes (GenieContext *ctx, uint16_t index, uint8_t *bytes, uint16_t len) {
+    GenieMagicVec vec = { bytes, len };
 
-    if (len > 255) {
+    if (len > GENIE_MAGIC_FRAME_MAX) {
         return -1;
     }
 
-    waitForIdle();
-    deviceSerial->write(GENIE_WRITE_STR);
-    checksum  = GENIE_WRITE_STR;
-    deviceSerial->write(index);
-    checksum ^= index;
-    deviceSerial->write((unsigned char)len);
-    checksum ^= len;
+    return writeMagicV(ctx, GENIEM_WRITE_BYTES, index, &vec, 1);
+}
 
-    for (p = string ; *p ; ++p) {
-        deviceSerial->write(*p);
-        checksum ^= *p;
+/////////////////////// WriteMagicDBytes ////////////////////////
+//
+// Write an array of 16-bit short values to a Magic object
+//
+// Returns: -1 if there are over 255 values, as genieCtxWriteMagicBytes
+//
+uint16_t genieCtxWriteMagicDBytes (GenieContext *ctx, uint16_t index, uint16_t *shorts, uint16_t len) {
+    GenieMagicVec vec = { shorts, len };
+
+    if (len > GENIE_MAGIC_FRAME_MAX) {
+        return -1;
     }
 
-    deviceSerial->write(checksum);
-    pushLinkState(GENIE_LINK_WFAN);
-    return 0;
+    return writeMagicV(ctx, GENIEM_WRITE_DBYTES, index, &vec, 1);
 }
 
-#ifdef AVR
-uint16_t genieWriteStr(uint16_t index, const __FlashStringHelper *ifsh){
-	PGM_P p = reinterpret_cast<PGM_P>(ifsh);
-	PGM_P p2 = reinterpret_cast<PGM_P>(ifsh);
-	size_t n = 0;
-	int len = 0;
-	while (1) {
-		unsigned char d = pgm_read_byte(p2++);
-		len++;
-		if (d == 0) break;
-	}
-  
- 
-	char arr[len];
-	int x = 0;
-	while (1) {
-		unsigned char c = pgm_read_byte(p++);
-		arr[x] = c;
-		x++;
-		if (c == 0) break;
-	}
-	WriteStr(index, arr);
-	return 0;	
+/////////////////////// WriteMagicBytesV ////////////////////////
+//
+// Write several arrays of bytes to a Magic object as one run.
+// Anything over GENIE_MAGIC_FRAME_MAX bytes goes as more than one
+// command, each ACKed on its own.
+//
+uint16_t genieCtxWriteMagicBytesV (GenieContext *ctx, uint16_t index, const GenieMagicVec *vec, uint8_t count) {
+    return writeMagicV(ctx, GENIEM_WRITE_BYTES, index, vec, count);
 }
-#endif
 
-#if (ARDUINO_BASED == 1)
-uint16_t genieWriteStr(uint16_t index, const String &s){
-	//s.c_str(), s.length()
-	int len = s.length();
-	char arr[len + 1];
-	s.toCharArray(arr,len + 1);
-	WriteStr(index, arr);
-	return 0;
+/////////////////////// WriteMagicDBytesV ////////////////////////
+//
+// Write several arrays of 16-bit short values to a Magic object as
+// one run, split into commands as genieCtxWriteMagicBytesV does.
+//
+uint16_t genieCtxWriteMagicDBytesV (GenieContext *ctx, uint16_t index, const GenieMagicVec *vec, uint8_t count) {
+    return writeMagicV(ctx, GENIEM_WRITE_DBYTES, index, vec, count);
 }
-#endif
 
-/* I need to port these later on. Use existing Arduino writeStr demo for testing
-uint16_t Genie::WriteStr (uint16_t index, long n) { 
-	char buf[8 * sizeof(long) + 1]; // Assumes 8-bit chars plus zero byte.
-	char *str = &buf[sizeof(buf) - 1];
-	
-	long N = n;
-	n = abs(n);
-
-	*str = '\0';
-
-	do {
-		unsigned long m = n;
-		n /= 10;
-		char c = m - 10 * n;
-		*--str = c < 10 ? c + '0' : c + 'A' - 10;
-	} while(n);
-	
-	if (N < 0) {
-		*--str = '-';
-	}
-	
-	WriteStr(index, str);
+/////////////////////////// writeMagicV ////////////////////////////
+//
+// Send the buffers of a vectored magic write as frames of at most
+// GENIE_MAGIC_FRAME_MAX elements. A frame can take in the end of
+// one buffer and the start of the next. Each one waits for room in
+// the window, so with a window over 1 the next frame is on its way
+// while the display works on the last.
+//
+// Returns: 0
+//
+static uint16_t writeMagicV (GenieContext *ctx, uint8_t cmd, uint16_t index,
+                             const GenieMagicVec *vec, uint8_t count) {
+    uint32_t total = 0;
+    uint16_t at = 0, left, take, n;
+    uint8_t v;
 
-	
+    for (v = 0; v < count; v++) {
+        total += vec[v].len;
+    }
 
-	return 0;
-}
+    v = 0;
 
-uint16_t Genie::WriteStr (uint16_t index, long n, int base) { 
-	char buf[8 * sizeof(long) + 1]; // Assumes 8-bit chars plus zero byte.
-	char *str = &buf[sizeof(buf) - 1];
-	
-	long N;
-	*str = '\0';
-	if(n>=0)
-	{
-		// prevent crash if called with base == 1
-		if (base < 2) base = 10;
-		if(base == 10)
-		{
-			N = n;
-			n = abs(n);
-		}
-	
-		do {
-			unsigned long m = n;
-			n /= base;
-			char c = m - base * n;
-			*--str = c < 10 ? c + '0' : c + 'A' - 10;
-		} while(n);
-		
-		if(base == 10)
-		{
-			if (N < 0) {
-				*--str = '-';
-			}
-		}
-			
-	}
-	
-	else if(n<0)
-	{
-		unsigned long n2 = (unsigned long)n;
-		uint8_t base2 = base;
-		do {
-		unsigned long m = n2;
-		n2 /= base2;
-		char c = m - base2 * n2;
-		*--str = c < 10 ? c + '0' : c + 'A' - 10;
-		} while(n2);
-		
-	}
-	
-	
-    WriteStr(index, str);
-	return 0;
+    // an empty write still sends an empty frame, as it always has
+    do {
+        n = (total > GENIE_MAGIC_FRAME_MAX) ? GENIE_MAGIC_FRAME_MAX : (uint16_t)total;
+        waitForWindow(ctx, ctx->window - 1);
+        frameBegin(ctx, cmd);
+        framePut(ctx, index);
+        framePut(ctx, (uint8_t)n);
+
+        for (left = n; left > 0; left -= take) {
+            while (at == vec[v].len) {
+                v++;
+                at = 0;
+            }
+
+            take = vec[v].len - at;
+            take = (take < left) ? take : left;
+
+            if (cmd == GENIEM_WRITE_BYTES) {
+                framePutBytes(ctx, (const uint8_t *)vec[v].data + at, take);
+            } else {
+                framePutShorts(ctx, (const uint16_t *)vec[v].data + at, take);
+            }
+
+            at += take;
+        }
+
+        frameEnd(ctx);
+        queueCommand(ctx, cmd, 0, index, n, GENIE_LINK_WFAN);
+        total -= n;
+    } while (total > 0);
+
+    return 0;
 }
 
-uint16_t Genie::WriteStr (uint16_t index, int n) { 
-	WriteStr (index, (long) n);
-	return 0;
+/////////////////////////////////////////////////////////////////////
+// Default context
+//
+// The original single display API. Each function forwards to its
+// genieCtx* counterpart using the default context, so existing
+// applications keep working unchanged.
+//
+static void defaultEventHandler(GenieContext *ctx) {
+    if (UserHandler != NULL) {
+        UserHandler();
+    }
 }
 
-uint16_t Genie::WriteStr (uint16_t index, int n, int base) { 
-	WriteStr (index, (long) n, base);
-	return 0;
+static void defaultByteReader(GenieContext *ctx, uint8_t index, uint8_t length) {
+    if (UserByteReader != NULL) {
+        UserByteReader(index, length);
+    }
 }
 
-uint16_t Genie::WriteStr (uint16_t index, unsigned long n) { 
-	char buf[8 * sizeof(long) + 1]; // Assumes 8-bit chars plus zero byte.
-	char *str = &buf[sizeof(buf) - 1];
-	
-	long N = n;
-	n = abs(n);
+static void defaultDoubleByteReader(GenieContext *ctx, uint8_t index, uint8_t length) {
+    if (UserDoubleByteReader != NULL) {
+        UserDoubleByteReader(index, length);
+    }
+}
 
-	*str = '\0';
+void genieInitWithConfig(UserApiConfig *config) {
+    UserHandler = NULL;
+    UserByteReader = NULL;
+    UserDoubleByteReader = NULL;
+    genieCtxInitWithConfig(&defaultContext, config);
+    genieCtxAttachDispatchTable(&defaultContext, defaultHandlers, GENIE_DEFAULT_HANDLERS);
+}
 
-	do {
-		unsigned long m = n;
-		n /= 10;
-		char c = m - 10 * n;
-		*--str = c < 10 ? c + '0' : c + 'A' - 10;
-	} while(n);
-	
-	WriteStr(index, str);
-	return 0;
+void genieAssignDebugPort(UserApiConfig *config) {
+    genieCtxAssignDebugPort(&defaultContext, config);
 }
 
-uint16_t Genie::WriteStr (uint16_t index, unsigned long n, int base) { 
-	char buf[8 * sizeof(long) + 1]; // Assumes 8-bit chars plus zero byte.
-	char *str = &buf[sizeof(buf) - 1];
-	
-	*str = '\0';
-
-	// prevent crash if called with base == 1
-	if (base < 2) base = 10;
-	do {
-		unsigned long m = n;
-		n /= base;
-		char c = m - base * n;
-		*--str = c < 10 ? c + '0' : c + 'A' - 10;
-	} while(n);
-				
-    WriteStr(index, str);
-	return 0;
+uint8_t genieGetNextByte(void) {
+    return genieCtxGetNextByte(&defaultContext);
 }
 
-uint16_t Genie::WriteStr (uint16_t index, unsigned int n) { 
-	WriteStr (index, (unsigned long) n);
-	return 0;
+uint16_t genieGetNextDoubleByte(void) {
+    return genieCtxGetNextDoubleByte(&defaultContext);
 }
 
-uint16_t Genie::WriteStr (uint16_t index, unsigned n, int base) { 
-	WriteStr (index, (unsigned long) n, base);
-	return 0;
+uint16_t genieDoEvents(bool DoHandler) {
+    return genieCtxDoEvents(&defaultContext, DoHandler);
 }
 
-uint16_t Genie::WriteStr (uint16_t index, double number, int digits) { 
-	char buf[8 * sizeof(long) + 1]; // Assumes 8-bit chars plus zero byte.
-	char *str = &buf[sizeof(buf) - 1];
-	*str = '\0';  
+bool genieDequeueEvent(GenieFrame * buff) {
+    return genieCtxDequeueEvent(&defaultContext, buff);
+}
 
-	double number2 = number;
-	if (number < 0.0)
-	{
-	number = -number;
-	}
+bool genieReadObject(uint16_t object, uint16_t index) {
+    return genieCtxReadObject(&defaultContext, object, index);
+}
 
-	// Round correctly so that print(1.999, 2) prints as "2.00"
-	double rounding = 0.5;
-	for (int i=0; i<digits; ++i)
-	rounding /= 10.0;
-
-	number += rounding;
-
-	unsigned long int_part = (unsigned long)number;
-	double remainder = number - (double)int_part;
-
-	// Extract digits from the remainder one at a time
-	int digits2 = digits;
-	str = &buf[sizeof(buf) - 1 - digits2];
-	while (digits2-- > 0)
-	{
-	remainder *= 10.0;
-	int toPrint = int(remainder);
-	char c = toPrint + 48;
-	*str++ = c;
-	remainder -= toPrint; 
-	}
-	str = &buf[sizeof(buf) - 1 - digits];
-	if (digits > 0) {
-	*--str = '.';
-	}
-	// Extract the integer part of the number and print it  
-	do {
-	unsigned long m = int_part;
-	int_part /= 10;
-	char c = m - 10 * int_part;
-	*--str = c < 10 ? c + '0' : c + 'A' - 10;
-	} while(int_part);
-
-	// Handle negative numbers
-	if (number2 < 0.0)
-	{
-	 *--str = '-';
-	}
+int genieReadObjectSync(uint16_t object, uint16_t index, uint16_t *value, uint16_t timeout_ms) {
+    return genieCtxReadObjectSync(&defaultContext, object, index, value, timeout_ms);
+}
 
-	WriteStr(index, str);
+uint16_t genieWriteObject(uint16_t object, uint16_t index, uint16_t data) {
+    return genieCtxWriteObject(&defaultContext, object, index, data);
+}
 
-	return 0;
+uint16_t genieWriteHandle(const GenieObjectHandle *handle, uint16_t data) {
+    return genieCtxWriteHandle(&defaultContext, handle, data);
 }
 
-uint16_t Genie::WriteStr (uint16_t index, double n){
-	WriteStr(index, n, 2);
+void genieWriteContrast(uint16_t value) {
+    genieCtxWriteContrast(&defaultContext, value);
+}
 
+uint16_t genieWriteStr(uint16_t index, char *string) {
+    return genieCtxWriteStr(&defaultContext, index, string);
 }
-*/
-/////////////////////// WriteStrU ////////////////////////
-//
-// Write a string to the display (Unicode)
-// Unicode characters are 2 bytes each
-//
-uint16_t genieWriteStrU (uint16_t index, uint16_t *string) {
-    uint16_t *p;
-    unsigned int checksum;
-    int len = 0;
-    p = string;
 
-    while (*p++) {
-        len++;
-    }
+uint16_t genieWriteStrUtf8(uint16_t index, const char *string, uint16_t len) {
+    return genieCtxWriteStrUtf8(&defaultContext, index, string, len);
+}
 
-    if (len > 255) {
-        return -1;
-    }
+uint16_t genieWriteStrInt(uint16_t index, int32_t n) {
+    return genieCtxWriteStrInt(&defaultContext, index, n);
+}
 
-    waitForIdle();
-    deviceSerial->write(GENIE_WRITE_STRU);
-    checksum  = GENIE_WRITE_STRU;
-    deviceSerial->write(index);
-    checksum ^= index;
-    deviceSerial->write((unsigned char)(len));
-    checksum ^= (len);
-    p = string;
+uint16_t genieWriteStrUint(uint16_t index, uint32_t n) {
+    return genieCtxWriteStrUint(&defaultContext, index, n);
+}
 
-    while (*p) {
-        deviceSerial->write (*p >> 8);
-        checksum ^= *p >> 8;
-        deviceSerial->write (*p);
-        checksum ^= *p++ & 0xff;
-    }
+uint16_t genieWriteStrFixed(uint16_t index, int32_t value, uint8_t scale, uint8_t digits) {
+    return genieCtxWriteStrFixed(&defaultContext, index, value, scale, digits);
+}
 
-    deviceSerial->write(checksum);
-    pushLinkState(GENIE_LINK_WFAN);
-    return 0;
+uint16_t genieWriteStrU(uint16_t index, uint16_t *string) {
+    return genieCtxWriteStrU(&defaultContext, index, string);
 }
 
-/////////////////// AttachEventHandler //////////////////////
-//
-// "Attaches" a pointer to the users event handler by writing
-// the pointer into the variable used by doEVents()
-//
-void genieAttachEventHandler (UserEventHandlerPtr handler) {
+void genieAttachEventHandler(UserEventHandlerPtr handler) {
     UserHandler = handler;
+    genieCtxAttachEventHandler(&defaultContext, handler ? defaultEventHandler : NULL);
+}
+
+bool genieOn(uint8_t cmd, uint8_t object, uint8_t index, GenieCtxEventCallbackPtr callback, void *userData) {
+    return genieCtxOn(&defaultContext, cmd, object, index, callback, userData);
+}
+
+void genieOff(uint8_t cmd, uint8_t object, uint8_t index) {
+    genieCtxOff(&defaultContext, cmd, object, index);
+}
+
+void genieGetStats(GenieStats *stats, bool reset) {
+    genieCtxGetStats(&defaultContext, stats, reset);
 }
 
-/////////////////// AttachMagicByteReader //////////////////////
-//
-// "Attaches" a pointer to a user's function for receiving
-// GenieMagic byte reports.
-//
 void genieAttachMagicByteReader(UserBytePtr handler) {
     UserByteReader = handler;
+    genieCtxAttachMagicByteReader(&defaultContext, handler ? defaultByteReader : NULL);
 }
 
-/////////////////// AttachMagicDoubleByteReader//////////////////////
-//
-// "Attaches" a pointer to a user's function for receiving
-// GenieMagic doublebyte reports.
-//
 void genieAttachMagicDoubleByteReader(UserDoubleBytePtr handler) {
     UserDoubleByteReader = handler;
+    genieCtxAttachMagicDoubleByteReader(&defaultContext, handler ? defaultDoubleByteReader : NULL);
 }
 
-/////////////////////// WriteMagicBytes ////////////////////////
-//
-// Write an array of bytes to a Magic object
-//
-uint16_t genieWriteMagicBytes (uint16_t index, uint8_t *bytes, uint16_t len) {
-    unsigned int checksum;
-
-    if (len > 255) {
-        return -1;
-    }
-
-    waitForIdle();
-    deviceSerial->write(GENIEM_WRITE_BYTES);
-    checksum  = GENIEM_WRITE_BYTES;
-    deviceSerial->write(index);
-    checksum ^= index;
-    deviceSerial->write((unsigned char)len);
-    checksum ^= len;
-
-    for (int i = 0; i < len; i++) {
-        deviceSerial->write(bytes[i]);
-        checksum ^= bytes[i];
-    }
-
-    deviceSerial->write(checksum);
-    pushLinkState(GENIE_LINK_WFAN);
-    return 0;
+uint16_t genieWriteMagicBytes(uint16_t index, uint8_t *bytes, uint16_t len) {
+    return genieCtxWriteMagicBytes(&defaultContext, index, bytes, len);
 }
 
-/////////////////////// WriteMagicDBytes ////////////////////////
-//
-// Write an array of 16-bit short values to a Magic object
-//
-uint16_t genieWriteMagicDBytes (uint16_t index, uint16_t *shorts, uint16_t len) {
-    unsigned int checksum;
-
-    if (len > 255) {
-        return -1;
-    }
-
-    waitForIdle();
-    deviceSerial->write(GENIEM_WRITE_DBYTES);
-    checksum  = GENIEM_WRITE_DBYTES;
-    deviceSerial->write(index);
-    checksum ^= index;
-    deviceSerial->write((unsigned char)(len));
-    checksum ^= (len);
-
-    for (int i = 0; i < len; i++) {
-        deviceSerial->write (shorts[i] >> 8);
-        checksum ^= shorts[i] >> 8;
-        deviceSerial->write (shorts[i] & 0xFF);
-        checksum ^= shorts[i] & 0xff;
-    }
+uint16_t genieWriteMagicDBytes(uint16_t index, uint16_t *shorts, uint16_t len) {
+    return genieCtxWriteMagicDBytes(&defaultContext, index, shorts, len);
+}
 
-    deviceSerial->write(checksum);
-    pushLinkState(GENIE_LINK_WFAN);
-    return 0;
+uint16_t genieWriteMagicBytesV(uint16_t index, const GenieMagicVec *vec, uint8_t count) {
+    return genieCtxWriteMagicBytesV(&defaultContext, index, vec, count);
 }
 
+uint16_t genieWriteMagicDBytesV(uint16_t index, const GenieMagicVec *vec, uint8_t count) {
+    return genieCtxWriteMagicDBytesV(&defaultContext, index, vec, count);
+}
@@ -59,6 +59,7 @@
 #endif
 
 #include <inttypes.h>
+#include <stddef.h>
 #include <stdint.h>
 #include <stdbool.h>
 
@@ -141,12 +142,34 @@ typedef bool     (*UserUartAvailFn)(void);
 typedef uint8_t  (*UserUartReadFn)(void);
 typedef void     (*UserUartWriteFn)(uint32_t val);
 typedef uint32_t (*UserRtcMillisFn)(void);
+/* Optional. Sends a whole buffer in one go, e.g. through a driver call or DMA. When it is NULL the library falls back
+   to write() for every byte. */
+typedef void     (*UserUartWriteBufFn)(const uint8_t *buf, size_t len);
+/* Optional. Copies up to max received bytes into buf without blocking and returns how many there were. When it is set
+   the library uses it instead of available() and read(). */
+typedef size_t   (*UserUartReadBufFn)(uint8_t *buf, size_t max);
+/* Optional. The same as writeBuf and readBuf but also given the config's port pointer, so one pair of functions can
+   serve several ports (see visiGenieSerialPosix.h). They take priority over the other transport functions. */
+typedef void     (*UserPortWriteFn)(void *port, const uint8_t *buf, size_t len);
+typedef size_t   (*UserPortReadFn)(void *port, uint8_t *buf, size_t max);
+/* Optional. Blocks for up to maxMillis or until more bytes may have arrived, so waiting for a reply doesn't spin. */
+typedef void     (*UserPortWaitFn)(void *port, uint32_t maxMillis);
+/* Optional. A free running microsecond count that wraps at 2^32. When it is set reply timeouts follow the measured
+   round trip time, see genieCtxSetTimeoutLimits, instead of always being TIMEOUT_PERIOD. */
+typedef uint32_t (*UserMicrosFn)(void);
 
 typedef struct UserApiConfig {
 	UserUartAvailFn  available;
 	UserUartReadFn   read;
 	UserUartWriteFn  write;
 	UserRtcMillisFn  millis;
+	UserUartWriteBufFn writeBuf;
+	UserUartReadBufFn  readBuf;
+	void            *port;
+	UserPortWriteFn  writePort;
+	UserPortReadFn   readPort;
+	UserPortWaitFn   waitPort;
+	UserMicrosFn     micros;
 } UserApiConfig;
 
 typedef struct FrameReportObj {
@@ -163,6 +186,40 @@ typedef struct MagicReportHeader {
     uint8_t         length;
 } MagicReportHeader;
 
+/////////////////////////////////////////////////////////////////////
+// A piece of a magic report, as handed to a reader attached with
+// genieCtxAttachMagicReader. The payload is passed on as it
+// arrives, pointing into the receive buffer where it can, so data
+// is only good until the reader returns. Double bytes come MSB
+// first and a chunk can end between the two halves of one.
+//
+// The last call for a report has no data and says whether the
+// checksum held. If it did not, what was handed over is suspect.
+//
+#define GENIE_MAGIC_MORE        0   // payload, more to come
+#define GENIE_MAGIC_DONE        1   // the report is complete and its checksum holds
+#define GENIE_MAGIC_BAD_CS      2   // the report is complete but corrupt
+
+typedef struct GenieMagicChunk {
+    MagicReportHeader   header;     // length is in bytes or double bytes, as sent
+    uint8_t             status;     // GENIE_MAGIC_MORE, _DONE or _BAD_CS
+    uint16_t            offset;     // payload bytes handed over before this chunk
+    uint16_t            len;
+    const uint8_t      *data;
+} GenieMagicChunk;
+
+/////////////////////////////////////////////////////////////////////
+// One buffer of a vectored magic write, see genieCtxWriteMagicBytesV.
+// len counts bytes or double bytes. The buffers are sent as if they
+// were one, split into frames of at most GENIE_MAGIC_FRAME_MAX.
+//
+#define GENIE_MAGIC_FRAME_MAX   255
+
+typedef struct GenieMagicVec {
+    const void         *data;
+    uint16_t            len;
+} GenieMagicVec;
+
 /////////////////////////////////////////////////////////////////////
 // The Genie frame definition
 //
@@ -180,52 +237,457 @@ typedef union GenieFrame {
     FrameReportObj      reportObject;
 } GenieFrame;
 
-#define MAX_GENIE_EVENTS    16    // MUST be a power of 2
+#ifndef MAX_GENIE_EVENTS
+#define MAX_GENIE_EVENTS    16    // MUST be a power of 2, at most 128
+#endif
+#define GENIE_EVENT_INDEX_SIZE (MAX_GENIE_EVENTS * 2)
 #define MAX_GENIE_FATALS    10
-#define MAX_LINK_STATES     20
+
+// Commands that may be waiting for a reply at once, see genieCtxSetWindow
+#ifndef GENIE_MAX_PENDING
+#define GENIE_MAX_PENDING   4     // MUST be a power of 2
+#endif
+
+// Bytes held by the transmit buffer, longer commands are sent in pieces.
+// Numbers written with genieCtxWriteStrFixed are built in place and
+// need 32.
+#ifndef GENIE_TX_BUFFER_SIZE
+#define GENIE_TX_BUFFER_SIZE 64
+#endif
+
+#if GENIE_TX_BUFFER_SIZE < 32
+#error "GENIE_TX_BUFFER_SIZE must be at least 32"
+#endif
+
+// Bytes fetched per UserApiConfig.readBuf call
+#ifndef GENIE_RX_BUFFER_SIZE
+#define GENIE_RX_BUFFER_SIZE 32
+#endif
+
+// Bytes held by the interrupt fed receive ring, 0 leaves it out
+#ifndef GENIE_RX_RING_SIZE
+#define GENIE_RX_RING_SIZE  64    // MUST be a power of 2, at most 32768
+#endif
+
+// Shortest reply timeout in milliseconds, however fast the display
+// has been answering. The longest is TIMEOUT_PERIOD.
+#ifndef GENIE_RTO_FLOOR
+#define GENIE_RTO_FLOOR     20
+#endif
+
+// Objects whose last reported value genieCtxReadObjectSync can answer
+// from, see genieCtxSetReadMaxAge. 0 leaves the cache out
+#ifndef GENIE_READ_CACHE_SIZE
+#define GENIE_READ_CACHE_SIZE 8
+#endif
+
+// Records held by the wire trace, 0 (the default) leaves it out
+#ifndef GENIE_TRACE_SIZE
+#define GENIE_TRACE_SIZE    0     // MUST be a power of 2, at most 32768
+#endif
 
 typedef struct EventQueueStruct {
     GenieFrame    frames[MAX_GENIE_EVENTS];
+    uint8_t        slots[GENIE_EVENT_INDEX_SIZE];  // (cmd, object, index) -> frame + 1
     uint8_t        rd_index;
     uint8_t        wr_index;
     uint8_t        n_events;
+    uint8_t        high_water;
+    uint32_t       coalesced;
+    uint32_t       overflows;
 } EventQueueStruct;
 
+typedef struct GenieQueueStats {
+    uint8_t        capacity;
+    uint8_t        high_water;  // most events queued at once
+    uint32_t       coalesced;   // events merged into one already queued
+    uint32_t       overflows;   // events dropped as the queue was full
+} GenieQueueStats;
+
+/////////////////////////////////////////////////////////////////////
+// Wire trace record. Records are copied raw, nothing is formatted
+// until tools/genieTrace decodes a dump.
+//
+#define GENIE_TRACE_TX          1     // data holds bytes sent
+#define GENIE_TRACE_RX          2     // data holds bytes received
+#define GENIE_TRACE_STATE       3     // data[0] old, data[1] new link state
+#define GENIE_TRACE_ERROR       4     // data[0] the ERROR_* code
+#define GENIE_TRACE_DATA        10
+
+typedef struct GenieTraceRecord {
+    uint32_t        stamp;      // millis()
+    uint8_t         kind;
+    uint8_t         len;        // bytes of data used
+    uint8_t         data[GENIE_TRACE_DATA];
+} GenieTraceRecord;
+
+/////////////////////////////////////////////////////////////////////
+// Link health counters, see genieCtxGetStats. Each is a plain
+// increment where the event happens.
+//
+#define GENIE_STATS_COMMANDS    (GENIEM_WRITE_DBYTES + 1)
+
+typedef struct GenieStats {
+    uint32_t        sent[GENIE_STATS_COMMANDS]; // commands sent, by command byte
+    uint32_t        acks;
+    uint32_t        naks;
+    uint32_t        timeouts;       // replies given up on
+    uint32_t        badChecksums;   // report, event or magic frames dropped
+    uint32_t        resyncs;
+    uint8_t         eventHighWater; // most events queued at once
+    uint32_t        eventsCoalesced;
+    uint32_t        eventsDropped;  // the event queue was full
+    uint32_t        txBytes;
+    uint32_t        rxBytes;
+    uint32_t        blockedMillis;  // spent waiting for replies
+    uint32_t        rxDiscarded;    // bytes that were not part of a good frame
+    uint32_t        recoveries;     // times the receiver lost its place
+    uint32_t        recoveryMillis; // from losing its place to the next good frame
+} GenieStats;
+
+/////////////////////////////////////////////////////////////////////
+// Round trip estimate for one kind of command, kept the way TCP
+// keeps its own: a smoothed mean and mean deviation, in fixed
+// point, per byte of the command so that strings of any length
+// share one estimate. Form changes redraw the screen and are
+// timed apart from other object writes.
+//
+#define GENIE_RTT_FORM          GENIE_STATS_COMMANDS
+#define GENIE_RTT_SLOTS         (GENIE_STATS_COMMANDS + 1)
+
+typedef struct GenieRtt {
+    uint32_t        srtt;       // microseconds a byte, times 8, 0 until measured
+    uint32_t        rttvar;     // microseconds a byte, times 4
+} GenieRtt;
+
+/////////////////////////////////////////////////////////////////////
+// A command that has been sent and is waiting for its reply.
+// Replies come back in command order so these are kept in a FIFO.
+//
+#define GENIE_PENDING_SYNC      0x01  // a genieCtxReadObjectSync is waiting for it
+#define GENIE_PENDING_HELD      0x02  // still in the transmit buffer
+
+typedef struct GeniePendingCommand {
+    uint16_t        id;         // see genieCtxLastCommandId
+    uint8_t         flags;
+    uint8_t         cmd;        // GENIE_WRITE_OBJ, GENIE_READ_OBJ, ...
+    uint8_t         object;
+    uint8_t         index;
+    uint8_t         expect;     // GENIE_LINK_WFAN or GENIE_LINK_WF_RXREPORT
+    uint16_t        value;      // value written, or read back for a report
+    uint32_t        sent;       // millis() when the command was sent
+    uint32_t        sentMicros; // when it left the transmit buffer
+} GeniePendingCommand;
+
+typedef struct PendingQueueStruct {
+    GeniePendingCommand cmds[GENIE_MAX_PENDING];
+    uint8_t        rd_index;
+    uint8_t        wr_index;
+    uint8_t        n_pending;
+} PendingQueueStruct;
+
+/////////////////////////////////////////////////////////////////////
+// Shadow table entry, the last known value of one object. The
+// application supplies the storage, see genieCtxAttachShadow.
+//
+#define GENIE_SHADOW_KNOWN      0x01  // latest is what the display will show
+#define GENIE_SHADOW_ACKED      0x02  // acked holds a confirmed value
+#define GENIE_SHADOW_QUEUED     0x04  // a write is still in the transmit buffer
+
+typedef struct GenieShadowEntry {
+    uint8_t         object;
+    uint8_t         index;
+    uint8_t         flags;
+    uint16_t        acked;      // last value ACKed or reported by the display
+    uint16_t        latest;     // last value written
+    uint16_t        txOffset;   // where the queued write sits in the buffer
+    uint32_t        stamp;      // millis() when acked was last confirmed
+} GenieShadowEntry;
+
+typedef struct GenieShadowStats {
+    uint32_t        skipped;    // writes dropped as the value was unchanged
+    uint32_t        coalesced;  // writes merged into one still buffered
+    uint32_t        sent;       // writes that went out
+    uint16_t        entries;    // objects in the table
+} GenieShadowStats;
+
+/////////////////////////////////////////////////////////////////////
+// Read cache entry, the value an object was last reported, sent as
+// an event or ACKed with.
+//
+typedef struct GenieReadCacheEntry {
+    uint8_t         object;
+    uint8_t         index;
+    uint16_t        value;
+    uint32_t        stamp;      // millis() when value was last confirmed
+} GenieReadCacheEntry;
+
+/////////////////////////////////////////////////////////////////////
+// Scheduler table entry, the rule for writes to one object. The
+// application fills in the first four fields and supplies the
+// storage, see genieCtxAttachScheduler:
+//
+//      static GenieScheduleEntry rules[] = {
+//          { GENIE_OBJ_COOL_GAUGE, 0, GENIE_PRIORITY_COSMETIC, 50 },
+//          { GENIE_OBJ_USER_LED,   0, GENIE_PRIORITY_CRITICAL, 0 }
+//      };
+//
+#define GENIE_PRIORITY_CRITICAL 0   // sent at once, with a window slot kept free for it
+#define GENIE_PRIORITY_NORMAL   1
+#define GENIE_PRIORITY_COSMETIC 2   // sent when nothing more important is waiting
+
+typedef struct GenieScheduleEntry {
+    uint8_t         object;
+    uint8_t         index;
+    uint8_t         priority;
+    uint16_t        minInterval;    // milliseconds between writes, 0 for no limit
+    bool            waiting;        // value is still to be sent
+    uint16_t        value;
+    uint32_t        lastSent;       // millis()
+} GenieScheduleEntry;
+
+typedef struct GenieScheduleStats {
+    uint32_t        sent;           // writes the scheduler sent
+    uint32_t        coalesced;      // writes replaced by a newer value before they went
+    uint32_t        budgetStalls;   // times waiting writes were held back by the byte budget
+    uint16_t        waiting;        // objects with a value still to send
+} GenieScheduleStats;
+
+/////////////////////////////////////////////////////////////////////
+// One object of a Workshop project, as listed in the header that
+// tools/genieGen writes from a .4DGenie file. The generated table is
+// sorted by object then index, see genieFindObject.
+//
+typedef struct GenieObjectInfo {
+    uint8_t         object;
+    uint8_t         index;
+    uint8_t         form;       // index of the form the object is on
+    uint16_t        min;        // value range from the project
+    uint16_t        max;
+} GenieObjectInfo;
+
 typedef void        (*UserEventHandlerPtr) (void);
 typedef void        (*UserBytePtr)(uint8_t, uint8_t);
 typedef void        (*UserDoubleBytePtr)(uint8_t, uint8_t);
 
+struct GenieContext;
+struct GenieBus;
+
+typedef void        (*GenieCtxEventHandlerPtr) (struct GenieContext *);
+typedef void        (*GenieCtxBytePtr)(struct GenieContext *, uint8_t, uint8_t);
+typedef void        (*GenieCtxDoubleBytePtr)(struct GenieContext *, uint8_t, uint8_t);
+typedef void        (*GenieCtxCompletionPtr)(struct GenieContext *, GeniePendingCommand *, int);
+typedef void        (*GenieCtxEventCallbackPtr)(struct GenieContext *, GenieFrame *, void *);
+typedef void        (*GenieCtxMagicReaderPtr)(struct GenieContext *, const GenieMagicChunk *, void *);
+
+/////////////////////////////////////////////////////////////////////
+// A precompiled object for genieWriteHandle. It holds the header of
+// a WRITE_OBJ command and the header's XOR, so a write only has to
+// add the value. GENIE_HANDLE takes an object and index, or one of
+// the names genieGen writes, and is a constant initialiser, so a
+// table of handles can be const and live in flash:
+//
+//      static const GenieObjectHandle gauge = GENIE_HANDLE(GENIE_COOLGAUGE0);
+//
+typedef struct GenieObjectHandle {
+    uint8_t         header[3];      // GENIE_WRITE_OBJ, object, index
+    uint8_t         checksum;       // of the header
+} GenieObjectHandle;
+
+#define GENIE_HANDLE(...)               GENIE_HANDLE_OF(__VA_ARGS__)
+#define GENIE_HANDLE_OF(object, index)  { { GENIE_WRITE_OBJ, (uint8_t)(object), (uint8_t)(index) }, \
+                                          (uint8_t)(GENIE_WRITE_OBJ ^ (object) ^ (index)) }
+
+/////////////////////////////////////////////////////////////////////
+// Dispatch table entry, one handler registered with genieCtxOn.
+// The application supplies the storage for a context, see
+// genieCtxAttachDispatchTable. The default context has room for
+// GENIE_DEFAULT_HANDLERS.
+//
+#define GENIE_ANY_INDEX         0xFF  // matches every index of an object
+
+#ifndef GENIE_DEFAULT_HANDLERS
+#define GENIE_DEFAULT_HANDLERS  8
+#endif
+
+typedef struct GenieHandlerEntry {
+    uint8_t                  cmd;
+    uint8_t                  object;
+    uint8_t                  index;
+    GenieCtxEventCallbackPtr callback;
+    void                    *userData;
+} GenieHandlerEntry;
+
+/////////////////////////////////////////////////////////////////////
+// The Genie context
+//
+// Holds everything needed to talk to one display: the transport,
+// the commands waiting for a reply, the receive parser and the
+// event queue.
+// Declare one per display and pass it to the genieCtx* functions.
+// The functions without a context use a built in default one.
+//
+typedef struct GenieContext {
+    UserApiConfig          *deviceSerial;
+    UserApiConfig          *debugSerial;
+    EventQueueStruct        EventQueue;
+    EventQueueStruct        Unhandled;    // events no genieCtxOn callback took, see dispatchEvent
+    PendingQueueStruct      Pending;
+    uint8_t                 rxState;      // frame being received, or GENIE_LINK_IDLE
+    uint8_t                 window;       // commands allowed in flight
+    uint16_t                nextId;
+    uint8_t                 txBuf[GENIE_TX_BUFFER_SIZE];
+    uint16_t                txLen;
+    uint8_t                 txChecksum;   // of the command being built
+    bool                    txHold;       // collecting a burst, see genieCtxBeginBurst
+    uint8_t                 address;      // sent ahead of each command on a bus, 0 for none
+    struct GenieBus        *bus;          // the line shared with other displays, see genieBusAdd
+    uint8_t                 rxBuf[GENIE_RX_BUFFER_SIZE];
+    uint16_t                rxHead;
+    uint16_t                rxLen;
+    uint16_t                rxFrames;     // frames completed, wraps
+    uint16_t                txFlushes;    // times the transmit buffer was sent
+    GenieShadowEntry       *shadow;       // sorted by object, index
+    uint16_t                shadowSize;
+    uint16_t                shadowCount;
+    uint16_t                shadowQueued; // entries flagged GENIE_SHADOW_QUEUED
+    uint32_t                shadowSkipped;
+    uint32_t                shadowCoalesced;
+    uint32_t                shadowSent;
+    GenieHandlerEntry      *handlers;     // sorted by cmd, object, index
+    uint16_t                handlerSize;
+    uint16_t                handlerCount;
+    uint32_t                readMaxAge;   // see genieCtxSetReadMaxAge
+#if (GENIE_READ_CACHE_SIZE > 0)
+    GenieReadCacheEntry     readCache[GENIE_READ_CACHE_SIZE];
+    uint8_t                 readCacheCount;
+#endif
+    GenieScheduleEntry     *schedule;     // sorted by object, index
+    uint16_t                scheduleSize;
+    uint16_t                scheduleWaiting;
+    bool                    scheduling;   // the scheduler is sending, don't defer
+    GenieScheduleStats      scheduleStats;
+    uint32_t                budgetRate;   // bytes a second, 0 for no budget
+    int32_t                 budgetTokens; // thousandths of a byte that may be sent now
+    uint32_t                budgetStamp;
+    GenieRtt                rtt[GENIE_RTT_SLOTS];
+    uint32_t                rtoFloor;     // microseconds, see genieCtxSetTimeoutLimits
+    uint32_t                rtoCeiling;
+    uint32_t                lastReplyMicros; // when the display finished the last command
+    bool                    rttSkip;      // the next reply may be a late one, don't time it
+    bool                    syncWaiting;  // genieCtxReadObjectSync in progress
+    uint16_t                syncId;
+    int                     syncResult;
+    uint16_t                syncValue;
+#if (GENIE_RX_RING_SIZE > 0)
+    bool                    useRing;      // see genieCtxUseRxRing
+    uint8_t                 ring[GENIE_RX_RING_SIZE];
+    volatile uint16_t       ringHead;     // written by the ISR only
+    volatile uint16_t       ringTail;     // written by the parser only
+    volatile uint16_t       ringHighWater;
+    volatile uint32_t       ringOverflows;
+#endif
+#if (GENIE_TRACE_SIZE > 0)
+    bool                    traceOn;      // see genieCtxTraceEnable
+    uint16_t                traceHead;
+    uint32_t                traceCount;   // records written since enabled
+    GenieTraceRecord        trace[GENIE_TRACE_SIZE];
+#endif
+    int                     Timeout;
+    int                     Error;
+    int                     FatalErrors;
+    GenieStats              stats;
+    uint8_t                 rxframe_count;
+    uint8_t                 rx_data[GENIE_FRAME_SIZE];
+    uint8_t                 checksum;
+    uint8_t                 replay[GENIE_FRAME_SIZE - 1]; // see relock
+    uint8_t                 replayHead;
+    uint8_t                 replayLen;
+    bool                    recovering;
+    uint32_t                recoverStart;
+    MagicReportHeader       magicHeader;
+    uint8_t                 magicByte;    // header bytes taken, 3 once into the payload
+    uint16_t                magicLeft;    // payload bytes still to come
+    uint16_t                magicOffset;
+    uint8_t                 magicChecksum;
+    GenieCtxMagicReaderPtr  UserMagicReader;
+    void                   *magicUserData;
+    GenieCtxEventHandlerPtr UserHandler;
+    GenieCtxBytePtr         UserByteReader;
+    GenieCtxDoubleBytePtr   UserDoubleByteReader;
+    GenieCtxCompletionPtr   UserCompletion;
+    void                   *userData;     // free for the application's use
+} GenieContext;
+
+/////////////////////////////////////////////////////////////////////
+// Multidrop bus
+//
+// Several displays on one line, each with an address of its own
+// (Workshop's Destination) and a context of its own for its pending
+// commands, events and handlers. Each command goes out with the
+// address of its display ahead of it, covered by the checksum, and
+// the displays answer the same way. The bus reads the line and
+// hands each reply, report and event to the context of the display
+// that sent it, through its receive ring.
+//
+#ifndef GENIE_BUS_MAX
+#define GENIE_BUS_MAX       8
+#endif
+
+typedef struct GenieBusStats {
+    uint32_t        frames;         // frames handed to a display
+    uint32_t        junk;           // bytes with no display to go to
+    uint32_t        lineWaits;      // commands that waited for the line
+} GenieBusStats;
+
+typedef struct GenieBus {
+    UserApiConfig  *deviceSerial;
+    GenieContext   *members[GENIE_BUS_MAX];
+    uint8_t         count;
+    uint8_t         window;         // commands in flight on the line, all displays together
+    uint8_t         next;           // display genieBusDoEvents starts with
+    bool            pumping;        // reading the line, see busPump
+    uint8_t         rxBuf[GENIE_RX_BUFFER_SIZE];
+    uint16_t        rxHead;
+    uint16_t        rxLen;
+    GenieContext   *rxTo;           // display the frame coming in is from, NULL between frames
+    uint8_t         rxCmd;
+    uint16_t        rxGot;          // bytes of the frame so far
+    uint16_t        rxNeed;         // and in all, 0 until known
+    GenieBusStats   stats;
+} GenieBus;
+
 /////////////////////////////////////////////////////////////////////
 // User API functions
 // These function prototypes are the user API to the library
 //
     void        genieInitWithConfig (UserApiConfig *config);
     bool        genieReadObject          (uint16_t object, uint16_t index);
+    int         genieReadObjectSync      (uint16_t object, uint16_t index, uint16_t *value, uint16_t timeout_ms);
     uint16_t    genieWriteObject         (uint16_t object, uint16_t index, uint16_t data);
+    GenieObjectHandle genieBindObject    (uint16_t object, uint16_t index);
+    uint16_t    genieWriteHandle         (const GenieObjectHandle *handle, uint16_t data);
     void        genieWriteContrast       (uint16_t value);
     uint16_t    genieWriteStr            (uint16_t index, char *string);
+    uint16_t    genieWriteStrInt         (uint16_t index, int32_t n);
+    uint16_t    genieWriteStrUint        (uint16_t index, uint32_t n);
+    uint16_t    genieWriteStrFixed       (uint16_t index, int32_t value, uint8_t scale, uint8_t digits);
     /* These need to be ported. I'll get to them later
-	uint16_t	WriteStr			(uint16_t index, long n) ;
-	uint16_t	WriteStr			(uint16_t index, long n, int base) ;
-	uint16_t	WriteStr			(uint16_t index, unsigned long n) ;
-	uint16_t	WriteStr			(uint16_t index, unsigned long n, int base) ;
-	uint16_t	WriteStr			(uint16_t index, int n) ;
-	uint16_t	WriteStr			(uint16_t index, int n, int base) ;
-	uint16_t	WriteStr			(uint16_t index, unsigned int n) ;
-	uint16_t	WriteStr			(uint16_t index, unsigned int n, int base) ;
 	uint16_t	WriteStr			(uint16_t index, const String &s);
 #ifdef AVR
 	uint16_t	WriteStr			(uint16_t index, const __FlashStringHelper *ifsh);
 #endif
-	uint16_t	WriteStr			(uint16_t index, double n, int digits);
-	uint16_t	WriteStr			(uint16_t index, double n);
      */
     uint16_t    genieWriteStrU           (uint16_t index, uint16_t *string);
+    uint16_t    genieWriteStrUtf8        (uint16_t index, const char *string, uint16_t len);
     bool        genieEventIs             (GenieFrame * e, uint8_t cmd, uint8_t object, uint8_t index);
     uint16_t    genieGetEventData        (GenieFrame * e);
     bool        genieDequeueEvent        (GenieFrame * buff);
     uint16_t    genieDoEvents            (bool DoHandler);
     void        genieAttachEventHandler  (UserEventHandlerPtr userHandler);
+    void        genieGetStats            (GenieStats *stats, bool reset);
+    bool        genieOn                  (uint8_t cmd, uint8_t object, uint8_t index, GenieCtxEventCallbackPtr callback, void *userData);
+    void        genieOff                 (uint8_t cmd, uint8_t object, uint8_t index);
     void        genieAttachMagicByteReader (UserBytePtr userHandler);
     void        genieAttachMagicDoubleByteReader (UserDoubleBytePtr userHandler);
     void        geniePulse               (int32_t pin);
@@ -235,10 +697,102 @@ typedef void        (*UserDoubleBytePtr)(uint8_t, uint8_t);
 
     uint16_t    genieWriteMagicBytes     (uint16_t index, uint8_t *bytes, uint16_t len);
     uint16_t    genieWriteMagicDBytes    (uint16_t index, uint16_t *bytes, uint16_t len);
+    uint16_t    genieWriteMagicBytesV    (uint16_t index, const GenieMagicVec *vec, uint8_t count);
+    uint16_t    genieWriteMagicDBytesV   (uint16_t index, const GenieMagicVec *vec, uint8_t count);
 
     uint8_t     genieGetNextByte         (void);
     uint16_t    genieGetNextDoubleByte   (void);
 
+/////////////////////////////////////////////////////////////////////
+// Context API
+// The same functions as above for a specific display. Several
+// contexts can be driven side by side from the same host.
+//
+    GenieContext *genieDefaultContext    (void);
+    void        genieCtxInitWithConfig   (GenieContext *ctx, UserApiConfig *config);
+    bool        genieCtxReadObject       (GenieContext *ctx, uint16_t object, uint16_t index);
+    int         genieCtxReadObjectSync   (GenieContext *ctx, uint16_t object, uint16_t index, uint16_t *value, uint16_t timeout_ms);
+    uint16_t    genieCtxWriteObject      (GenieContext *ctx, uint16_t object, uint16_t index, uint16_t data);
+    uint16_t    genieCtxWriteHandle      (GenieContext *ctx, const GenieObjectHandle *handle, uint16_t data);
+    void        genieCtxWriteContrast    (GenieContext *ctx, uint16_t value);
+    uint16_t    genieCtxWriteStr         (GenieContext *ctx, uint16_t index, char *string);
+    uint16_t    genieCtxWriteStrU        (GenieContext *ctx, uint16_t index, uint16_t *string);
+    uint16_t    genieCtxWriteStrUtf8     (GenieContext *ctx, uint16_t index, const char *string, uint16_t len);
+    uint16_t    genieCtxWriteStrInt      (GenieContext *ctx, uint16_t index, int32_t n);
+    uint16_t    genieCtxWriteStrUint     (GenieContext *ctx, uint16_t index, uint32_t n);
+    uint16_t    genieCtxWriteStrFixed    (GenieContext *ctx, uint16_t index, int32_t value, uint8_t scale, uint8_t digits);
+    bool        genieCtxDequeueEvent     (GenieContext *ctx, GenieFrame * buff);
+    uint16_t    genieCtxDoEvents         (GenieContext *ctx, bool DoHandler);
+    uint16_t    genieCtxDoEventsBudget   (GenieContext *ctx, bool DoHandler, uint16_t maxBytes, uint16_t maxMillis);
+    void        genieCtxGetEventQueueStats (GenieContext *ctx, GenieQueueStats *stats);
+    void        genieCtxGetStats         (GenieContext *ctx, GenieStats *stats, bool reset);
+    void        genieCtxAttachEventHandler (GenieContext *ctx, GenieCtxEventHandlerPtr userHandler);
+    void        genieCtxAttachDispatchTable (GenieContext *ctx, GenieHandlerEntry *table, uint16_t size);
+    bool        genieCtxOn               (GenieContext *ctx, uint8_t cmd, uint8_t object, uint8_t index,
+                                          GenieCtxEventCallbackPtr callback, void *userData);
+    void        genieCtxOff              (GenieContext *ctx, uint8_t cmd, uint8_t object, uint8_t index);
+    void        genieCtxAttachMagicByteReader (GenieContext *ctx, GenieCtxBytePtr userHandler);
+    void        genieCtxAttachMagicDoubleByteReader (GenieContext *ctx, GenieCtxDoubleBytePtr userHandler);
+    void        genieCtxAttachMagicReader (GenieContext *ctx, GenieCtxMagicReaderPtr reader, void *userData);
+    void        genieCtxAssignDebugPort  (GenieContext *ctx, UserApiConfig *config);
+    uint16_t    genieCtxWriteMagicBytes  (GenieContext *ctx, uint16_t index, uint8_t *bytes, uint16_t len);
+    uint16_t    genieCtxWriteMagicDBytes (GenieContext *ctx, uint16_t index, uint16_t *bytes, uint16_t len);
+    uint16_t    genieCtxWriteMagicBytesV (GenieContext *ctx, uint16_t index, const GenieMagicVec *vec, uint8_t count);
+    uint16_t    genieCtxWriteMagicDBytesV (GenieContext *ctx, uint16_t index, const GenieMagicVec *vec, uint8_t count);
+    uint8_t     genieCtxGetNextByte      (GenieContext *ctx);
+    uint16_t    genieCtxGetNextDoubleByte (GenieContext *ctx);
+
+    // Pipelining, several commands in flight with replies matched in order
+    void        genieCtxSetWindow        (GenieContext *ctx, uint8_t window);
+    void        genieCtxWaitIdle         (GenieContext *ctx);
+    uint8_t     genieCtxPendingCount     (GenieContext *ctx);
+    uint16_t    genieCtxLastCommandId    (GenieContext *ctx);
+    void        genieCtxAttachCompletionHandler (GenieContext *ctx, GenieCtxCompletionPtr userHandler);
+    void        genieCtxSetTimeoutLimits (GenieContext *ctx, uint16_t floorMillis, uint16_t ceilingMillis);
+    uint32_t    genieCtxGetReplyTimeout  (GenieContext *ctx, uint8_t cmd, uint16_t len);
+    uint32_t    genieCtxCheckTimeout     (GenieContext *ctx);
+
+    // Buffered transmission, several commands sent as one burst
+    void        genieCtxBeginBurst       (GenieContext *ctx);
+    void        genieCtxFlush            (GenieContext *ctx);
+
+    // Shadow table, skips redundant object writes
+    void        genieCtxAttachShadow     (GenieContext *ctx, GenieShadowEntry *table, uint16_t size);
+    void        genieCtxInvalidateShadow (GenieContext *ctx);
+    void        genieCtxGetShadowStats   (GenieContext *ctx, GenieShadowStats *stats);
+    void        genieCtxSetReadMaxAge    (GenieContext *ctx, uint32_t maxAge);
+
+    // Scheduler, object writes sent by priority within a rate and byte budget
+    void        genieCtxAttachScheduler  (GenieContext *ctx, GenieScheduleEntry *table, uint16_t size,
+                                          uint32_t baud, uint8_t budgetPercent);
+    void        genieCtxRunScheduler     (GenieContext *ctx);
+    void        genieCtxGetScheduleStats (GenieContext *ctx, GenieScheduleStats *stats);
+
+    // Generated project tables
+    const GenieObjectInfo *genieFindObject (const GenieObjectInfo *table, uint16_t count, uint8_t object, uint8_t index);
+
+#if (GENIE_RX_RING_SIZE > 0)
+    // Interrupt fed receive ring, genieRxIsrPush* are safe to call from an ISR
+    bool        genieRxIsrPush           (GenieContext *ctx, uint8_t c);
+    uint16_t    genieRxIsrPushBytes      (GenieContext *ctx, const uint8_t *bytes, uint16_t len);
+    void        genieCtxUseRxRing        (GenieContext *ctx, bool use);
+    uint16_t    genieCtxGetRxRingStats   (GenieContext *ctx, uint32_t *overflows);
+#endif
+
+#if (GENIE_RX_RING_SIZE > 0)
+    // Multidrop, several displays sharing one line
+    void        genieBusInit             (GenieBus *bus, UserApiConfig *config, uint8_t window);
+    bool        genieBusAdd              (GenieBus *bus, GenieContext *ctx, uint8_t address);
+    uint16_t    genieBusDoEvents         (GenieBus *bus, bool DoHandler);
+    void        genieBusGetStats         (GenieBus *bus, GenieBusStats *stats);
+#endif
+
+#if (GENIE_TRACE_SIZE > 0)
+    // Wire trace, see tools/genieTrace
+    void        genieCtxTraceEnable      (GenieContext *ctx, bool on);
+    uint16_t    genieCtxTraceRead        (GenieContext *ctx, GenieTraceRecord *records, uint16_t max);
+#endif
+
 #ifndef TRUE
 #define TRUE    (1==1)
 #define FALSE    (!TRUE)
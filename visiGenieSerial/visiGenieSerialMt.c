@@ -0,0 +1,646 @@
+/////////////////////// visiGenieSerialMt ///////////////////////
+//
+//      Thread safe access to one display through a command queue
+//      and an I/O task, see visiGenieSerialMt.h.
+//
+/*********************************************************************
+ * This file is part of visiGenieSerial:
+ *    visiGenieSerial is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU Lesser General Public License as
+ *    published by the Free Software Foundation, either version 3 of the
+ *    License, or (at your option) any later version.
+ *
+ *    visiGenieSerial is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU Lesser General Public License for more details.
+ *
+ *    You should have received a copy of the GNU Lesser General Public
+ *    License along with visiGenieSerial.
+ *    If not, see <http://www.gnu.org/licenses/>.
+ *********************************************************************/
+
+#if defined(__unix__) || defined(__APPLE__)
+#ifndef _DEFAULT_SOURCE
+#define _DEFAULT_SOURCE
+#endif
+#endif
+
+#include "visiGenieSerialMt.h"
+#include <string.h>
+
+#if defined(__GNUC__) || defined(__clang__)
+#define MT_LOAD(p)                  __atomic_load_n((p), __ATOMIC_RELAXED)
+#define MT_LOAD_ACQUIRE(p)          __atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define MT_STORE(p, v)              __atomic_store_n((p), (v), __ATOMIC_SEQ_CST)
+#define MT_STORE_RELEASE(p, v)      __atomic_store_n((p), (v), __ATOMIC_RELEASE)
+#define MT_CAS(p, expected, v)      __atomic_compare_exchange_n((p), (expected), (v), true, \
+                                                                __ATOMIC_RELAXED, __ATOMIC_RELAXED)
+#define MT_EXCHANGE(p, v)           __atomic_exchange_n((p), (v), __ATOMIC_SEQ_CST)
+#define MT_ADD(p, v)                __atomic_fetch_add((p), (v), __ATOMIC_RELAXED)
+#define MT_FENCE()                  __atomic_thread_fence(__ATOMIC_SEQ_CST)
+#else
+// a single core part could do with volatile, but several tasks
+// racing for a slot need a compare and swap
+#error "visiGenieSerialMt needs the __atomic builtins of GCC or clang"
+#endif
+
+static GenieMtCell *mtReserve          (GenieMt *mt, uint32_t *pos);
+static int         mtSubmit            (GenieMt *mt, GenieMtCell *cell, uint32_t pos, GenieMtWaiter *w);
+static int         mtPutData           (GenieMt *mt, uint8_t kind, uint16_t index, const void *data,
+                                        uint16_t len, uint16_t size, bool wait);
+static void        mtRun               (GenieMt *mt, GenieMtCommand *cmd);
+static void        mtFinish            (GenieMt *mt, GenieMtWaiter *w, int result, uint16_t value);
+static void        mtCompleted         (GenieContext *ctx, GeniePendingCommand *pc, int result);
+
+/////////////////////// MtInit ////////////////////////
+//
+// Initialise the context, the queue and hooks that do nothing. The
+// context's completion handler is taken, it is how waiting
+// producers hear of their replies.
+//
+void genieMtInit(GenieMt *mt, UserApiConfig *config) {
+    uint32_t i;
+
+    memset(mt, 0, sizeof(*mt));
+    genieCtxInitWithConfig(&mt->ctx, config);
+    genieCtxAttachCompletionHandler(&mt->ctx, mtCompleted);
+
+    for (i = 0; i < GENIE_MT_QUEUE_SIZE; i++) {
+        mt->cells[i].seq = i;
+    }
+}
+
+/////////////////////// MtSetHooks ////////////////////////
+//
+void genieMtSetHooks(GenieMt *mt, const GenieMtHooks *hooks) {
+    mt->hooks = *hooks;
+}
+
+/////////////////////// MtContext ////////////////////////
+//
+// Only the I/O task can take events off the context's queue, so
+// give it an event handler, or callbacks with genieCtxOn for every
+// event the display sends.
+//
+// Returns: the context, to be set up before the producers start
+//              and used by the I/O task alone after that, in event
+//              handlers for instance
+//
+GenieContext *genieMtContext(GenieMt *mt) {
+    return &mt->ctx;
+}
+
+/////////////////////// MtWriteObject ////////////////////////
+//
+// genieCtxWriteObject from any task. A write the shadow table
+// skips or merges into one still buffered, or that the scheduler
+// holds, is answered at once: wait then means the library took it,
+// not that the display shows it yet.
+//
+// Returns: ERROR_NONE once queued, or the reply if wait is set, or
+//              ERROR_MT_FULL
+//
+int genieMtWriteObject(GenieMt *mt, uint16_t object, uint16_t index, uint16_t data, bool wait) {
+    GenieMtWaiter w;
+    GenieMtCell *cell;
+    uint32_t pos;
+
+    if ((cell = mtReserve(mt, &pos)) == NULL) {
+        return ERROR_MT_FULL;
+    }
+
+    cell->cmd.kind = GENIE_WRITE_OBJ;
+    cell->cmd.object = (uint8_t)object;
+    cell->cmd.index = (uint8_t)index;
+    cell->cmd.value = data;
+    return mtSubmit(mt, cell, pos, wait ? &w : NULL);
+}
+
+/////////////////////// MtWriteContrast ////////////////////////
+//
+int genieMtWriteContrast(GenieMt *mt, uint16_t value, bool wait) {
+    GenieMtWaiter w;
+    GenieMtCell *cell;
+    uint32_t pos;
+
+    if ((cell = mtReserve(mt, &pos)) == NULL) {
+        return ERROR_MT_FULL;
+    }
+
+    cell->cmd.kind = GENIE_WRITE_CONTRAST;
+    cell->cmd.value = value;
+    return mtSubmit(mt, cell, pos, wait ? &w : NULL);
+}
+
+/////////////////////// MtWriteStr ////////////////////////
+//
+// genieCtxWriteStr from any task. The text is copied, so it may be
+// changed as soon as the call returns.
+//
+// Returns: as genieMtWriteObject, or ERROR_MT_TOO_LONG for text
+//              over GENIE_MT_DATA_SIZE
+//
+int genieMtWriteStr(GenieMt *mt, uint16_t index, const char *string, bool wait) {
+    size_t len = strlen(string);
+
+    if (len > GENIE_MT_DATA_SIZE) {
+        return ERROR_MT_TOO_LONG;
+    }
+
+    return mtPutData(mt, GENIE_WRITE_STR, index, string, (uint16_t)len, (uint16_t)len, wait);
+}
+
+/////////////////////// MtWriteStrUtf8 ////////////////////////
+//
+// genieCtxWriteStrUtf8 from any task, len bytes of UTF-8.
+//
+// Returns: as genieMtWriteStr, or ERROR_MT_REFUSED if wait is set
+//              and the text is not valid UTF-8 or is over 255
+//              characters. Without wait such text is dropped.
+//
+int genieMtWriteStrUtf8(GenieMt *mt, uint16_t index, const char *string, uint16_t len, bool wait) {
+    return mtPutData(mt, GENIE_WRITE_STRU, index, string, len, len, wait);
+}
+
+/////////////////////// MtWriteMagicBytes ////////////////////////
+//
+int genieMtWriteMagicBytes(GenieMt *mt, uint16_t index, const uint8_t *bytes, uint16_t len, bool wait) {
+    return mtPutData(mt, GENIEM_WRITE_BYTES, index, bytes, len, len, wait);
+}
+
+/////////////////////// MtWriteMagicDBytes ////////////////////////
+//
+int genieMtWriteMagicDBytes(GenieMt *mt, uint16_t index, const uint16_t *shorts, uint16_t len, bool wait) {
+    if (len > GENIE_MT_DATA_SIZE / 2) {
+        return ERROR_MT_TOO_LONG;
+    }
+
+    return mtPutData(mt, GENIEM_WRITE_DBYTES, index, shorts, len, len * 2, wait);
+}
+
+/////////////////////// MtReadObject ////////////////////////
+//
+// genieCtxReadObject from any task, waiting for the report. As
+// with genieCtxReadObjectSync, the report is not put on the event
+// queue.
+//
+// Returns: ERROR_NONE with the object's value in value, the error,
+//              or ERROR_MT_FULL
+//
+int genieMtReadObject(GenieMt *mt, uint16_t object, uint16_t index, uint16_t *value) {
+    GenieMtWaiter w;
+    GenieMtCell *cell;
+    uint32_t pos;
+    int result;
+
+    if ((cell = mtReserve(mt, &pos)) == NULL) {
+        return ERROR_MT_FULL;
+    }
+
+    cell->cmd.kind = GENIE_READ_OBJ;
+    cell->cmd.object = (uint8_t)object;
+    cell->cmd.index = (uint8_t)index;
+    result = mtSubmit(mt, cell, pos, &w);
+
+    if (result == ERROR_NONE) {
+        *value = w.value;
+    }
+
+    return result;
+}
+
+/////////////////////// MtGetStats ////////////////////////
+//
+void genieMtGetStats(GenieMt *mt, GenieMtStats *stats) {
+    stats->queued = MT_LOAD(&mt->queued);
+    stats->full = MT_LOAD(&mt->full);
+    stats->highWater = MT_LOAD(&mt->highWater);
+}
+
+/////////////////////// MtService ////////////////////////
+//
+// The I/O task's loop body. Sends the commands queued so far, as
+// one burst where the window allows, then runs whatever has been
+// received through the state machine and the handlers, and gives
+// up on replies that are overdue.
+//
+// Returns: milliseconds the task may sleep if nothing arrives,
+//              see genieMtSleep
+//
+uint32_t genieMtService(GenieMt *mt) {
+    GenieMtCell *cell;
+    uint16_t n, waiting;
+
+    for (n = 0; n < GENIE_MT_QUEUE_SIZE; n++) {
+        cell = &mt->cells[mt->dequeuePos & (GENIE_MT_QUEUE_SIZE - 1)];
+
+        if (MT_LOAD_ACQUIRE(&cell->seq) != mt->dequeuePos + 1) {
+            break;
+        }
+
+        if (n == 0) {
+            genieCtxBeginBurst(&mt->ctx);
+        }
+
+        waiting = (uint16_t)(MT_LOAD(&mt->enqueuePos) - mt->dequeuePos);
+
+        if (waiting > mt->highWater) {
+            MT_STORE_RELEASE(&mt->highWater, waiting);
+        }
+
+        mtRun(mt, &cell->cmd);
+
+        // the slot is free for the producers' next lap
+        MT_STORE_RELEASE(&cell->seq, mt->dequeuePos + GENIE_MT_QUEUE_SIZE);
+        mt->dequeuePos++;
+    }
+
+    if (n > 0) {
+        genieCtxFlush(&mt->ctx);
+    }
+
+    genieCtxDoEventsBudget(&mt->ctx, true, 0, 0);
+    return genieCtxCheckTimeout(&mt->ctx);
+}
+
+/////////////////////// MtSleep ////////////////////////
+//
+// Call before the I/O task blocks. From then on the next command
+// queued calls the wake hook, once.
+//
+// Returns: FALSE if a command is already waiting, don't block
+//
+bool genieMtSleep(GenieMt *mt) {
+    GenieMtCell *cell = &mt->cells[mt->dequeuePos & (GENIE_MT_QUEUE_SIZE - 1)];
+
+    // a producer publishes its command and then looks at sleeping,
+    // this looks at sleeping's opposite number the other way round,
+    // so one of the two sees the other
+    MT_STORE(&mt->sleeping, 1);
+    MT_FENCE();
+
+    if (MT_LOAD_ACQUIRE(&cell->seq) == mt->dequeuePos + 1) {
+        MT_STORE(&mt->sleeping, 0);
+        return false;
+    }
+
+    return true;
+}
+
+/////////////////////// MtAwake ////////////////////////
+//
+// Call when the I/O task has woken, for whatever reason.
+//
+void genieMtAwake(GenieMt *mt) {
+    MT_STORE(&mt->sleeping, 0);
+}
+
+////////////////////// Mt::mtReserve ////////////////////////
+//
+// Claim the next slot of the queue. Each slot's seq says whose turn
+// it is: pos when a producer may fill it on lap pos, pos + 1 once
+// filled for the I/O task, then pos + GENIE_MT_QUEUE_SIZE when it
+// has been taken and is free again.
+//
+// Returns: the slot, or NULL if the queue is full
+//
+static GenieMtCell *mtReserve (GenieMt *mt, uint32_t *pos) {
+    GenieMtCell *cell;
+    uint32_t p = MT_LOAD(&mt->enqueuePos);
+    int32_t lag;
+
+    for (;;) {
+        cell = &mt->cells[p & (GENIE_MT_QUEUE_SIZE - 1)];
+        lag = (int32_t)(MT_LOAD_ACQUIRE(&cell->seq) - p);
+
+        if (lag == 0) {
+            // p is reloaded if another producer got there first
+            if (MT_CAS(&mt->enqueuePos, &p, p + 1)) {
+                *pos = p;
+                cell->cmd.waiter = NULL;
+                return cell;
+            }
+        } else if (lag < 0) {
+            // still holds a command from the last lap
+            MT_ADD(&mt->full, 1);
+            return NULL;
+        } else {
+            p = MT_LOAD(&mt->enqueuePos);
+        }
+    }
+}
+
+////////////////////// Mt::mtSubmit ////////////////////////
+//
+// Hand a filled slot to the I/O task, waking it if it sleeps, and
+// wait for the reply if w is given.
+//
+static int mtSubmit (GenieMt *mt, GenieMtCell *cell, uint32_t pos, GenieMtWaiter *w) {
+    if (w != NULL) {
+        w->done = 0;
+        w->result = ERROR_NONE;
+        w->value = 0;
+    }
+
+    cell->cmd.waiter = w;
+    MT_STORE_RELEASE(&cell->seq, pos + 1);
+    MT_ADD(&mt->queued, 1);
+    MT_FENCE();
+
+    if (MT_LOAD(&mt->sleeping) && MT_EXCHANGE(&mt->sleeping, 0) && mt->hooks.wake != NULL) {
+        mt->hooks.wake(mt->hooks.arg);
+    }
+
+    if (w == NULL) {
+        return ERROR_NONE;
+    }
+
+    while (MT_LOAD_ACQUIRE(&w->done) == 0) {
+        if (mt->hooks.wait != NULL) {
+            mt->hooks.wait(mt->hooks.arg, &w->done, 0);
+        }
+    }
+
+    return w->result;
+}
+
+////////////////////// Mt::mtPutData ////////////////////////
+//
+// Queue a command that carries data, size bytes of it.
+//
+static int mtPutData (GenieMt *mt, uint8_t kind, uint16_t index, const void *data,
+                      uint16_t len, uint16_t size, bool wait) {
+    GenieMtWaiter w;
+    GenieMtCell *cell;
+    uint32_t pos;
+
+    if (size > GENIE_MT_DATA_SIZE) {
+        return ERROR_MT_TOO_LONG;
+    }
+
+    if ((cell = mtReserve(mt, &pos)) == NULL) {
+        return ERROR_MT_FULL;
+    }
+
+    cell->cmd.kind = kind;
+    cell->cmd.index = (uint8_t)index;
+    cell->cmd.value = len;
+    memcpy(cell->cmd.data.bytes, data, size);
+    cell->cmd.data.text[size] = 0;
+    return mtSubmit(mt, cell, pos, wait ? &w : NULL);
+}
+
+////////////////////// Mt::mtRun ////////////////////////
+//
+// Carry out a queued command on the I/O task. A waiting producer
+// is matched to the reply by command id, or answered at once if
+// nothing was sent, as when the shadow table skips a write or the
+// scheduler holds it, or the library refused text that was too
+// long or not valid UTF-8. The other commands are always sent.
+//
+static void mtRun (GenieMt *mt, GenieMtCommand *cmd) {
+    GenieContext *ctx = &mt->ctx;
+    uint16_t id = ctx->nextId;
+    int result = ERROR_NONE;
+    GenieMagicVec vec;
+    GenieMtSlot *slot;
+
+    switch (cmd->kind) {
+        case GENIE_WRITE_OBJ:
+            genieCtxWriteObject(ctx, cmd->object, cmd->index, cmd->value);
+            break;
+
+        case GENIE_WRITE_CONTRAST:
+            genieCtxWriteContrast(ctx, cmd->value);
+            break;
+
+        case GENIE_WRITE_STR:
+            if (genieCtxWriteStr(ctx, cmd->index, cmd->data.text) != 0) {
+                result = ERROR_MT_REFUSED;
+            }
+            break;
+
+        case GENIE_WRITE_STRU:
+            if (genieCtxWriteStrUtf8(ctx, cmd->index, cmd->data.text, cmd->value) != 0) {
+                result = ERROR_MT_REFUSED;
+            }
+            break;
+
+        case GENIEM_WRITE_BYTES:
+            vec.data = cmd->data.bytes;
+            vec.len = cmd->value;
+            genieCtxWriteMagicBytesV(ctx, cmd->index, &vec, 1);
+            break;
+
+        case GENIEM_WRITE_DBYTES:
+            vec.data = cmd->data.shorts;
+            vec.len = cmd->value;
+            genieCtxWriteMagicDBytesV(ctx, cmd->index, &vec, 1);
+            break;
+
+        case GENIE_READ_OBJ:
+            genieCtxReadObject(ctx, cmd->object, cmd->index);
+            if (cmd->waiter != NULL) {
+                // the reader has the value, no one could take the
+                // report off the event queue
+                ctx->Pending.cmds[(ctx->Pending.wr_index - 1) & (GENIE_MAX_PENDING - 1)].flags |= GENIE_PENDING_SYNC;
+            }
+            break;
+
+        default:
+            result = ERROR_MT_REFUSED;
+            break;
+    }
+
+    if (cmd->waiter == NULL) {
+        return;
+    }
+
+    if (ctx->nextId == id || result != ERROR_NONE) {
+        mtFinish(mt, cmd->waiter, result, 0);
+        return;
+    }
+
+    // a magic write split into frames is answered by its last one
+    id = genieCtxLastCommandId(ctx);
+    slot = &mt->waiting[id & (GENIE_MAX_PENDING - 1)];
+    slot->id = id;
+    slot->waiter = cmd->waiter;
+}
+
+////////////////////// Mt::mtFinish ////////////////////////
+//
+// Hand a producer its result. Once done is set the waiter may be
+// gone, only its address is passed on to notify.
+//
+static void mtFinish (GenieMt *mt, GenieMtWaiter *w, int result, uint16_t value) {
+    w->result = result;
+    w->value = value;
+    MT_STORE_RELEASE(&w->done, 1);
+
+    if (mt->hooks.notify != NULL) {
+        mt->hooks.notify(mt->hooks.arg, &w->done);
+    }
+}
+
+////////////////////// Mt::mtCompleted ////////////////////////
+//
+// The context's completion handler. The context is the first
+// member of the GenieMt.
+//
+static void mtCompleted (GenieContext *ctx, GeniePendingCommand *pc, int result) {
+    GenieMt *mt = (GenieMt *)ctx;
+    GenieMtSlot *slot = &mt->waiting[pc->id & (GENIE_MAX_PENDING - 1)];
+
+    if (slot->waiter != NULL && slot->id == pc->id) {
+        mtFinish(mt, slot->waiter, result, pc->value);
+        slot->waiter = NULL;
+    }
+}
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+
+static void       *ioThread            (void *arg);
+static void        ioWake              (void *arg);
+static void        ioWait              (void *arg, volatile uint32_t *word, uint32_t value);
+static void        ioNotify            (void *arg, volatile uint32_t *word);
+
+/////////////////////// PosixIoStart ////////////////////////
+//
+// Run the I/O task for mt, set up with genieMtInit on a config from
+// geniePosixConfig, as a thread. It sleeps in poll() on the port
+// and a pipe the producers write to when they need it.
+//
+// Returns: 0 on success, -1 with errno set
+//
+int geniePosixIoStart(GeniePosixIo *io, GenieMt *mt, GeniePosixPort *port) {
+    GenieMtHooks hooks;
+    int err;
+
+    io->mt = mt;
+    io->port = port;
+    io->stop = 0;
+
+    if (pipe(io->wakeFds) < 0) {
+        return -1;
+    }
+
+    fcntl(io->wakeFds[0], F_SETFL, fcntl(io->wakeFds[0], F_GETFL) | O_NONBLOCK);
+    fcntl(io->wakeFds[1], F_SETFL, fcntl(io->wakeFds[1], F_GETFL) | O_NONBLOCK);
+    pthread_mutex_init(&io->lock, NULL);
+    pthread_cond_init(&io->answered, NULL);
+
+    hooks.wake = ioWake;
+    hooks.wait = ioWait;
+    hooks.notify = ioNotify;
+    hooks.arg = io;
+    genieMtSetHooks(mt, &hooks);
+
+    if ((err = pthread_create(&io->thread, NULL, ioThread, io)) != 0) {
+        close(io->wakeFds[0]);
+        close(io->wakeFds[1]);
+        errno = err;
+        return -1;
+    }
+
+    return 0;
+}
+
+/////////////////////// PosixIoStop ////////////////////////
+//
+// Stop the I/O thread once the commands queued so far have been
+// answered, and wait for it. Producers must have stopped.
+//
+void geniePosixIoStop(GeniePosixIo *io) {
+    MT_STORE(&io->stop, 1);
+    ioWake(io);
+    pthread_join(io->thread, NULL);
+    close(io->wakeFds[0]);
+    close(io->wakeFds[1]);
+    pthread_cond_destroy(&io->answered);
+    pthread_mutex_destroy(&io->lock);
+}
+
+////////////////////// Mt::ioThread ////////////////////////
+//
+static void *ioThread (void *arg) {
+    GeniePosixIo *io = arg;
+    struct pollfd pfd[2];
+    uint8_t drain[64];
+    uint32_t wait;
+
+    for (;;) {
+        wait = genieMtService(io->mt);
+
+        if (!genieMtSleep(io->mt)) {
+            continue;
+        }
+
+        // what was queued before the stop is still sent and answered
+        if (MT_LOAD(&io->stop) && io->mt->ctx.Pending.n_pending == 0) {
+            break;
+        }
+
+        pfd[0].fd = geniePosixFd(io->port);
+        pfd[0].events = POLLIN;
+        pfd[1].fd = io->wakeFds[0];
+        pfd[1].events = POLLIN;
+        poll(pfd, 2, (int)wait);
+        genieMtAwake(io->mt);
+
+        if (pfd[1].revents & POLLIN) {
+            while (read(io->wakeFds[0], drain, sizeof(drain)) > 0) {
+            }
+        }
+    }
+
+    return NULL;
+}
+
+////////////////////// Mt::ioWake ////////////////////////
+//
+// A full pipe already has the thread's attention, so EAGAIN is fine.
+//
+static void ioWake (void *arg) {
+    GeniePosixIo *io = arg;
+    ssize_t n;
+
+    do {
+        n = write(io->wakeFds[1], "", 1);
+    } while (n < 0 && errno == EINTR);
+}
+
+////////////////////// Mt::ioWait ////////////////////////
+//
+static void ioWait (void *arg, volatile uint32_t *word, uint32_t value) {
+    GeniePosixIo *io = arg;
+
+    pthread_mutex_lock(&io->lock);
+
+    while (MT_LOAD_ACQUIRE(word) == value) {
+        pthread_cond_wait(&io->answered, &io->lock);
+    }
+
+    pthread_mutex_unlock(&io->lock);
+}
+
+////////////////////// Mt::ioNotify ////////////////////////
+//
+// Every waiting producer wakes and checks its own word, replies are
+// few enough for that.
+//
+static void ioNotify (void *arg, volatile uint32_t *word) {
+    GeniePosixIo *io = arg;
+
+    (void)word;
+    pthread_mutex_lock(&io->lock);
+    pthread_cond_broadcast(&io->answered);
+    pthread_mutex_unlock(&io->lock);
+}
+
+#endif
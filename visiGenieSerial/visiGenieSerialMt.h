@@ -0,0 +1,165 @@
+/////////////////////// visiGenieSerialMt ///////////////////////
+//
+//      Thread safe access to one display for Linux and RTOS builds
+//      where several tasks update it.
+//
+//      The genieMt* calls can be made from any task. They encode
+//      the command and its data into a slot of a lock-free, bounded
+//      multi-producer, single-consumer queue and return. Only the
+//      I/O task touches the context: it takes commands off the
+//      queue, sends them and runs the receive side, replies, events
+//      and handlers included, in genieMtService. A producer that
+//      asks to wait is woken when its command is answered, it never
+//      holds a lock while the display works.
+//
+//      The platform supplies the wake up through GenieMtHooks. On
+//      POSIX hosts geniePosixIoStart runs the I/O thread and fills
+//      them in.
+//
+/*********************************************************************
+ * This file is part of visiGenieSerial:
+ *    visiGenieSerial is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU Lesser General Public License as
+ *    published by the Free Software Foundation, either version 3 of the
+ *    License, or (at your option) any later version.
+ *
+ *    visiGenieSerial is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU Lesser General Public License for more details.
+ *
+ *    You should have received a copy of the GNU Lesser General Public
+ *    License along with visiGenieSerial.
+ *    If not, see <http://www.gnu.org/licenses/>.
+ *********************************************************************/
+
+#ifndef visiGenieSerialMt_h
+#define visiGenieSerialMt_h
+
+#include "visiGenieSerial.h"
+
+#ifndef GENIE_MT_QUEUE_SIZE
+#define GENIE_MT_QUEUE_SIZE     64    // MUST be a power of 2
+#endif
+
+#ifndef GENIE_MT_DATA_SIZE
+#define GENIE_MT_DATA_SIZE      64    // bytes of a string or magic write a command can carry
+#endif
+
+// Results of the genieMt* calls, as well as the ERROR_* codes
+#define ERROR_MT_FULL       -9    // the queue had no free slot, nothing was sent
+#define ERROR_MT_TOO_LONG   -10   // more data than GENIE_MT_DATA_SIZE
+#define ERROR_MT_REFUSED    -11   // the library would not send the text, not UTF-8 or over 255 characters
+
+/////////////////////////////////////////////////////////////////////
+// What a producer waiting for its command to be answered sleeps on.
+// done goes from 0 to 1 once result and value are filled in.
+//
+typedef struct GenieMtWaiter {
+    volatile uint32_t   done;
+    int                 result;     // ERROR_NONE, ERROR_NAK, ERROR_TIMEOUT, ...
+    uint16_t            value;      // read back, for genieMtReadObject
+} GenieMtWaiter;
+
+typedef struct GenieMtCommand {
+    uint8_t             kind;       // GENIE_WRITE_OBJ, GENIE_READ_OBJ, ...
+    uint8_t             object;
+    uint8_t             index;
+    uint16_t            value;      // or the length of data
+    GenieMtWaiter      *waiter;     // NULL if nobody waits for the reply
+    union {
+        uint8_t         bytes[GENIE_MT_DATA_SIZE];
+        uint16_t        shorts[GENIE_MT_DATA_SIZE / 2];
+        char            text[GENIE_MT_DATA_SIZE + 1];
+    } data;
+} GenieMtCommand;
+
+typedef struct GenieMtCell {
+    volatile uint32_t   seq;        // whose turn the slot is, see mtReserve
+    GenieMtCommand      cmd;
+} GenieMtCell;
+
+/////////////////////////////////////////////////////////////////////
+// Platform hooks. Any may be NULL: without wake the I/O task has to
+// poll the queue, without wait and notify a waiting producer spins.
+//
+typedef struct GenieMtHooks {
+    void              (*wake)(void *arg);                                   // work for a sleeping I/O task
+    void              (*wait)(void *arg, volatile uint32_t *word, uint32_t value); // sleep while *word == value
+    void              (*notify)(void *arg, volatile uint32_t *word);       // wake those sleeping on word
+    void               *arg;
+} GenieMtHooks;
+
+typedef struct GenieMtStats {
+    uint32_t            queued;     // commands taken from producers
+    uint32_t            full;       // refused as the queue was full
+    uint16_t            highWater;  // most commands waiting at once
+} GenieMtStats;
+
+typedef struct GenieMtSlot {
+    uint16_t            id;
+    GenieMtWaiter      *waiter;
+} GenieMtSlot;
+
+/////////////////////////////////////////////////////////////////////
+// The context comes first, so the completion handler can find the
+// rest. Producers only touch enqueuePos, the cells and sleeping.
+//
+typedef struct GenieMt {
+    GenieContext        ctx;        // the I/O task's alone
+    GenieMtHooks        hooks;
+    uint32_t            dequeuePos;
+    GenieMtSlot         waiting[GENIE_MAX_PENDING]; // by command id
+    volatile uint16_t   highWater;
+    GenieMtCell         cells[GENIE_MT_QUEUE_SIZE];
+    volatile uint32_t   enqueuePos;
+    volatile uint32_t   sleeping;   // the I/O task is about to block, see genieMtSleep
+    volatile uint32_t   queued;
+    volatile uint32_t   full;
+} GenieMt;
+
+    // Setting up, before any producer runs
+    void        genieMtInit              (GenieMt *mt, UserApiConfig *config);
+    void        genieMtSetHooks          (GenieMt *mt, const GenieMtHooks *hooks);
+    GenieContext *genieMtContext         (GenieMt *mt);
+
+    // Producers, from any task. wait blocks until the reply, until
+    // the library has taken a write it did not send, see
+    // genieMtWriteObject, or until it has refused text it could not
+    // send, see genieMtWriteStrUtf8
+    int         genieMtWriteObject       (GenieMt *mt, uint16_t object, uint16_t index, uint16_t data, bool wait);
+    int         genieMtWriteContrast     (GenieMt *mt, uint16_t value, bool wait);
+    int         genieMtWriteStr          (GenieMt *mt, uint16_t index, const char *string, bool wait);
+    int         genieMtWriteStrUtf8      (GenieMt *mt, uint16_t index, const char *string, uint16_t len, bool wait);
+    int         genieMtWriteMagicBytes   (GenieMt *mt, uint16_t index, const uint8_t *bytes, uint16_t len, bool wait);
+    int         genieMtWriteMagicDBytes  (GenieMt *mt, uint16_t index, const uint16_t *shorts, uint16_t len, bool wait);
+    int         genieMtReadObject        (GenieMt *mt, uint16_t object, uint16_t index, uint16_t *value);
+    void        genieMtGetStats          (GenieMt *mt, GenieMtStats *stats);
+
+    // The I/O task
+    uint32_t    genieMtService           (GenieMt *mt);
+    bool        genieMtSleep             (GenieMt *mt);
+    void        genieMtAwake             (GenieMt *mt);
+
+#if defined(__unix__) || defined(__APPLE__)
+/////////////////////////////////////////////////////////////////////
+// An I/O thread for a GenieMt on a GeniePosixPort
+//
+#include <pthread.h>
+#include "visiGenieSerialPosix.h"
+
+typedef struct GeniePosixIo {
+    GenieMt            *mt;
+    GeniePosixPort     *port;
+    int                 wakeFds[2]; // a pipe, see genieMtSleep
+    pthread_t           thread;
+    pthread_mutex_t     lock;       // only held to sleep or wake, never across a reply
+    pthread_cond_t      answered;
+    volatile uint32_t   stop;
+} GeniePosixIo;
+
+    int         geniePosixIoStart        (GeniePosixIo *io, GenieMt *mt, GeniePosixPort *port);
+    void        geniePosixIoStop         (GeniePosixIo *io);
+#endif
+
+#endif
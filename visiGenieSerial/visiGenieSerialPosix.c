@@ -0,0 +1,328 @@
+/////////////////////// visiGenieSerialPosix ///////////////////////
+//
+//      POSIX serial transport for visiGenieSerial, see
+//      visiGenieSerialPosix.h.
+//
+/*********************************************************************
+ * This file is part of visiGenieSerial:
+ *    visiGenieSerial is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU Lesser General Public License as
+ *    published by the Free Software Foundation, either version 3 of the
+ *    License, or (at your option) any later version.
+ *
+ *    visiGenieSerial is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU Lesser General Public License for more details.
+ *
+ *    You should have received a copy of the GNU Lesser General Public
+ *    License along with visiGenieSerial.
+ *    If not, see <http://www.gnu.org/licenses/>.
+ *********************************************************************/
+
+#if defined(__unix__) || defined(__APPLE__)
+
+#ifndef _DEFAULT_SOURCE
+#define _DEFAULT_SOURCE
+#endif
+
+#include "visiGenieSerialPosix.h"
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/ioctl.h>
+#include <time.h>
+#include <unistd.h>
+
+// glibc's termios can't hold a rate that has no B constant, so on
+// Linux the port is set up through termios2 and BOTHER instead
+#ifdef __linux__
+#include <asm/termbits.h>
+#else
+#include <termios.h>
+#endif
+
+static void        portWrite           (void *port, const uint8_t *buf, size_t len);
+static size_t      portRead            (void *port, uint8_t *buf, size_t max);
+static void        portWait            (void *port, uint32_t maxMillis);
+static int         setRaw              (int fd, uint32_t baud);
+
+////////////////////// Posix::setRaw ////////////////////////
+//
+// 8N1, no flow control, no line editing, at any baud rate.
+//
+// Returns: 0 on success, -1 with errno set
+//
+#ifdef __linux__
+static int setRaw (int fd, uint32_t baud) {
+    struct termios2 tio;
+
+    if (ioctl(fd, TCGETS2, &tio) < 0) {
+        return -1;
+    }
+
+    tio.c_iflag &= ~(IGNBRK | BRKINT | PARMRK | ISTRIP | INLCR | IGNCR | ICRNL | IXON | IXOFF | IXANY);
+    tio.c_oflag &= ~OPOST;
+    tio.c_lflag &= ~(ECHO | ECHONL | ICANON | ISIG | IEXTEN);
+    tio.c_cflag &= ~(CSIZE | PARENB | CSTOPB | CRTSCTS | CBAUD | (CBAUD << IBSHIFT));
+    tio.c_cflag |= CS8 | CREAD | CLOCAL | BOTHER | (BOTHER << IBSHIFT);
+    tio.c_ispeed = baud;
+    tio.c_ospeed = baud;
+    tio.c_cc[VMIN] = 0;
+    tio.c_cc[VTIME] = 0;
+
+    return ioctl(fd, TCSETS2, &tio);
+}
+#else
+static int setRaw (int fd, uint32_t baud) {
+    struct termios tio;
+
+    if (tcgetattr(fd, &tio) < 0) {
+        return -1;
+    }
+
+    cfmakeraw(&tio);
+    tio.c_cflag &= ~(CSTOPB | CRTSCTS);
+    tio.c_cflag |= CREAD | CLOCAL;
+    tio.c_cc[VMIN] = 0;
+    tio.c_cc[VTIME] = 0;
+
+    // the BSDs take the rate itself as a speed_t
+    if (cfsetspeed(&tio, (speed_t)baud) < 0) {
+        return -1;
+    }
+
+    return tcsetattr(fd, TCSANOW, &tio);
+}
+#endif
+
+/////////////////////// PosixOpen ////////////////////////
+//
+// Open a serial device, e.g. "/dev/ttyUSB0", raw and non-blocking.
+//
+// Parms:   baud, any rate the UART supports, or 0 to leave it
+//
+// Returns: 0 on success, -1 with errno set
+//
+int geniePosixOpen(GeniePosixPort *port, const char *device, uint32_t baud) {
+    int fd = open(device, O_RDWR | O_NOCTTY | O_NONBLOCK | O_CLOEXEC);
+
+    if (fd < 0) {
+        return -1;
+    }
+
+    if (baud != 0 && setRaw(fd, baud) < 0) {
+        int err = errno;
+        close(fd);
+        errno = err;
+        return -1;
+    }
+
+    geniePosixAttach(port, fd);
+    port->ownsFd = true;
+    return 0;
+}
+
+/////////////////////// PosixAttach ////////////////////////
+//
+// Use a descriptor opened elsewhere, a pty or a socket for
+// instance. It is made non-blocking but otherwise left alone.
+//
+// Returns: 0 on success, -1 with errno set
+//
+int geniePosixAttach(GeniePosixPort *port, int fd) {
+    int flags = fcntl(fd, F_GETFL);
+
+    port->fd = fd;
+    port->ownsFd = false;
+    port->readErrors = 0;
+    port->writeErrors = 0;
+
+    if (flags < 0) {
+        return -1;
+    }
+
+    return fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
+
+/////////////////////// PosixClose ////////////////////////
+//
+void geniePosixClose(GeniePosixPort *port) {
+    if (port->ownsFd && port->fd >= 0) {
+        close(port->fd);
+    }
+
+    port->fd = -1;
+}
+
+/////////////////////// PosixConfig ////////////////////////
+//
+// Fill in config to talk through port. The config is cleared
+// first, so set any other members after calling this.
+//
+void geniePosixConfig(GeniePosixPort *port, UserApiConfig *config) {
+    memset(config, 0, sizeof(*config));
+    config->millis = geniePosixMillis;
+    config->port = port;
+    config->writePort = portWrite;
+    config->readPort = portRead;
+    config->waitPort = portWait;
+    config->micros = geniePosixMicros;
+}
+
+/////////////////////// PosixFd ////////////////////////
+//
+// Returns: the descriptor to watch for input in an epoll/poll loop
+//
+int geniePosixFd(GeniePosixPort *port) {
+    return port->fd;
+}
+
+/////////////////////// PosixService ////////////////////////
+//
+// Call when the port is readable. Runs everything that has arrived
+// through the state machine and, if DoHandler is set, hands the
+// events to their handlers. Never blocks.
+//
+// Returns: the number of frames received
+//
+uint16_t geniePosixService(GenieContext *ctx, bool DoHandler) {
+    return genieCtxDoEventsBudget(ctx, DoHandler, 0, 0);
+}
+
+/////////////////////// PosixMillis ////////////////////////
+//
+// Milliseconds from CLOCK_MONOTONIC, which wall clock changes
+// don't move.
+//
+uint32_t geniePosixMillis(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint32_t)ts.tv_sec * 1000u + (uint32_t)(ts.tv_nsec / 1000000);
+}
+
+/////////////////////// PosixMicros ////////////////////////
+//
+// Microseconds from CLOCK_MONOTONIC, wrapping at 2^32.
+//
+uint32_t geniePosixMicros(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint32_t)ts.tv_sec * 1000000u + (uint32_t)(ts.tv_nsec / 1000);
+}
+
+#if (GENIE_TRACE_SIZE > 0)
+/////////////////////// PosixTraceDump ////////////////////////
+//
+// Write the wire trace to a file for tools/genieTrace to decode.
+// Recording is paused while the ring is copied and then carries on.
+//
+// Returns: the number of records written, -1 with errno set
+//
+int geniePosixTraceDump(GenieContext *ctx, const char *path) {
+    GenieTraceFileHeader header;
+    GenieTraceRecord *records = malloc(sizeof(GenieTraceRecord) * GENIE_TRACE_SIZE);
+    bool on = ctx->traceOn;
+    FILE *f;
+    int err;
+
+    if (records == NULL) {
+        return -1;
+    }
+
+    ctx->traceOn = false;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, GENIE_TRACE_MAGIC, sizeof(header.magic));
+    header.version = GENIE_TRACE_VERSION;
+    header.recordSize = sizeof(GenieTraceRecord);
+    header.count = genieCtxTraceRead(ctx, records, GENIE_TRACE_SIZE);
+    ctx->traceOn = on;
+
+    if ((f = fopen(path, "wb")) == NULL) {
+        err = errno;
+        free(records);
+        errno = err;
+        return -1;
+    }
+
+    if (fwrite(&header, sizeof(header), 1, f) != 1 ||
+            fwrite(records, sizeof(GenieTraceRecord), header.count, f) != header.count) {
+        err = errno;
+        fclose(f);
+        free(records);
+        errno = err;
+        return -1;
+    }
+
+    free(records);
+    return (fclose(f) == 0) ? (int)header.count : -1;
+}
+#endif
+
+////////////////////// Posix::portWrite ////////////////////////
+//
+// Commands have to go out whole, so wait for room in the output
+// buffer rather than drop the rest.
+//
+static void portWrite (void *p, const uint8_t *buf, size_t len) {
+    GeniePosixPort *port = p;
+    struct pollfd pfd;
+    ssize_t n;
+
+    while (len > 0) {
+        n = write(port->fd, buf, len);
+
+        if (n > 0) {
+            buf += n;
+            len -= (size_t)n;
+        } else if (n < 0 && errno == EINTR) {
+            continue;
+        } else if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            pfd.fd = port->fd;
+            pfd.events = POLLOUT;
+            poll(&pfd, 1, -1);
+        } else {
+            port->writeErrors++;
+            return;
+        }
+    }
+}
+
+////////////////////// Posix::portRead ////////////////////////
+//
+static size_t portRead (void *p, uint8_t *buf, size_t max) {
+    GeniePosixPort *port = p;
+    ssize_t n;
+
+    do {
+        n = read(port->fd, buf, max);
+    } while (n < 0 && errno == EINTR);
+
+    if (n < 0) {
+        if (errno != EAGAIN && errno != EWOULDBLOCK) {
+            port->readErrors++;
+        }
+
+        return 0;
+    }
+
+    return (size_t)n;
+}
+
+////////////////////// Posix::portWait ////////////////////////
+//
+static void portWait (void *p, uint32_t maxMillis) {
+    GeniePosixPort *port = p;
+    struct pollfd pfd;
+
+    pfd.fd = port->fd;
+    pfd.events = POLLIN;
+    poll(&pfd, 1, maxMillis > 0x7FFFFFFF ? 0x7FFFFFFF : (int)maxMillis);
+}
+
+#endif
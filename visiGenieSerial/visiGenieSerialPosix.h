@@ -0,0 +1,71 @@
+/////////////////////// visiGenieSerialPosix ///////////////////////
+//
+//      POSIX serial transport for visiGenieSerial, for running the
+//      library on Linux and other Unix hosts.
+//
+//      geniePosixOpen sets the port up raw at any baud rate, the
+//      200000 of a Workshop project included, and non-blocking.
+//      geniePosixConfig fills in a UserApiConfig that reads and
+//      writes the port and uses CLOCK_MONOTONIC for millis and
+//      micros.
+//
+//      The library can then sit in an existing epoll/poll loop:
+//      watch geniePosixFd for input and call geniePosixService
+//      when it is readable. While waiting for a reply the library
+//      blocks in poll() instead of spinning.
+//
+/*********************************************************************
+ * This file is part of visiGenieSerial:
+ *    visiGenieSerial is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU Lesser General Public License as
+ *    published by the Free Software Foundation, either version 3 of the
+ *    License, or (at your option) any later version.
+ *
+ *    visiGenieSerial is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU Lesser General Public License for more details.
+ *
+ *    You should have received a copy of the GNU Lesser General Public
+ *    License along with visiGenieSerial.
+ *    If not, see <http://www.gnu.org/licenses/>.
+ *********************************************************************/
+
+#ifndef visiGenieSerialPosix_h
+#define visiGenieSerialPosix_h
+
+#include "visiGenieSerial.h"
+
+// Header of a file written by geniePosixTraceDump, followed by
+// count GenieTraceRecords in the host's byte order
+#define GENIE_TRACE_MAGIC       "GTRC"
+#define GENIE_TRACE_VERSION     1
+
+typedef struct GenieTraceFileHeader {
+    char            magic[4];
+    uint8_t         version;
+    uint8_t         recordSize; // sizeof(GenieTraceRecord)
+    uint16_t        reserved;
+    uint32_t        count;
+} GenieTraceFileHeader;
+
+typedef struct GeniePosixPort {
+    int             fd;
+    bool            ownsFd;     // geniePosixClose closes it
+    uint32_t        readErrors;
+    uint32_t        writeErrors;
+} GeniePosixPort;
+
+    int         geniePosixOpen           (GeniePosixPort *port, const char *device, uint32_t baud);
+    int         geniePosixAttach         (GeniePosixPort *port, int fd);
+    void        geniePosixClose          (GeniePosixPort *port);
+    void        geniePosixConfig         (GeniePosixPort *port, UserApiConfig *config);
+    int         geniePosixFd             (GeniePosixPort *port);
+    uint16_t    geniePosixService        (GenieContext *ctx, bool DoHandler);
+    uint32_t    geniePosixMillis         (void);
+    uint32_t    geniePosixMicros         (void);
+#if (GENIE_TRACE_SIZE > 0)
+    int         geniePosixTraceDump      (GenieContext *ctx, const char *path);
+#endif
+
+#endif